@@ -0,0 +1,284 @@
+/*
+ * Copyright (C) 2007 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "mkbootimg.h"
+#include "cache.h"
+#include "batch.h"
+
+/* Split a manifest line into arguments in place, with shell-like
+ * quoting: '...' is taken literally, "..." and bare words allow
+ * backslash escapes. Returns the argument count, or -1 on an unterminated
+ * quote or more than max arguments. */
+static int split_args(char *line, char **argv, int max)
+{
+    char *in = line;
+    int argc = 0;
+
+    for(;;) {
+        char *out;
+        char quote = 0;
+
+        while(*in == ' ' || *in == '\t' || *in == '\r' || *in == '\n') in++;
+        if(*in == '\0') break;
+        if(argc == max) return -1;
+
+        out = in;
+        argv[argc++] = out;
+        for(; *in; in++) {
+            if(quote == '\'') {
+                if(*in == '\'') quote = 0;
+                else *out++ = *in;
+            } else if(*in == '\\' && in[1] != '\0' &&
+                      (quote == 0 || in[1] == '"' || in[1] == '\\')) {
+                *out++ = *++in;
+            } else if(quote == '"') {
+                if(*in == '"') quote = 0;
+                else *out++ = *in;
+            } else if(*in == '\'' || *in == '"') {
+                quote = *in;
+            } else if(*in == ' ' || *in == '\t' || *in == '\r' || *in == '\n') {
+                break;
+            } else {
+                *out++ = *in;
+            }
+        }
+        if(quote) return -1;
+        if(*in) in++;
+        *out = '\0';
+    }
+    return argc;
+}
+
+#define BATCH_MAX_ARGS 128
+
+struct batch_spec {
+    unsigned line;
+    char *text;             /* owns the strings argv and opts point into */
+    struct build_opts opts;
+    bool valid;
+    int status;
+    struct build_result res;
+};
+
+struct batch {
+    struct batch_spec *specs;
+    unsigned count;
+    unsigned next;
+    struct input_cache inputs;
+    pthread_mutex_t lock;
+};
+
+static void *batch_worker(void *arg)
+{
+    struct batch *b = arg;
+
+    for(;;) {
+        struct batch_spec *spec;
+
+        pthread_mutex_lock(&b->lock);
+        spec = b->next < b->count ? &b->specs[b->next++] : NULL;
+        pthread_mutex_unlock(&b->lock);
+        if(spec == NULL) break;
+
+        if(spec->valid && spec->opts.update) {
+            spec->status = update_image(&spec->opts, &spec->res);
+        } else if(spec->valid) {
+            spec->status = spec->opts.cache ?
+                cached_build_image(&spec->opts, &b->inputs, &spec->res) :
+                build_image(&spec->opts, &b->inputs, &spec->res);
+        }
+    }
+    return NULL;
+}
+
+static void print_json_string(const char *s)
+{
+    if(s == NULL) {
+        printf("null");
+        return;
+    }
+    putchar('"');
+    for(; *s; s++) {
+        unsigned char c = *s;
+
+        if(c == '"' || c == '\\') {
+            printf("\\%c", c);
+        } else if(c < 0x20) {
+            printf("\\u%04x", c);
+        } else {
+            putchar(c);
+        }
+    }
+    putchar('"');
+}
+
+int run_batch(const struct build_opts *defaults, const char *manifest,
+              unsigned jobs)
+{
+    struct batch b;
+    unsigned alloc = 0;
+    unsigned failed = 0;
+    unsigned lineno = 0;
+    unsigned i;
+    pthread_t *workers = NULL;
+    unsigned nworkers = 0;
+    char *line = NULL;
+    size_t linecap = 0;
+    FILE *f;
+
+    if(!strcmp(manifest, "-")) {
+        f = stdin;
+    } else {
+        f = fopen(manifest, "r");
+    }
+    if(f == NULL) {
+        fprintf(stderr,"error: could not load manifest '%s'\n", manifest);
+        return 1;
+    }
+
+    memset(&b, 0, sizeof(b));
+    while(getline(&line, &linecap, f) >= 0) {
+        struct batch_spec *spec;
+        char *argv[BATCH_MAX_ARGS];
+        char *p = line;
+        int argc;
+
+        lineno++;
+        while(*p == ' ' || *p == '\t') p++;
+        if(*p == '#' || *p == '\n' || *p == '\r' || *p == '\0') continue;
+
+        if(b.count == alloc) {
+            struct batch_spec *specs;
+
+            alloc = alloc ? alloc * 2 : 64;
+            specs = realloc(b.specs, alloc * sizeof(*specs));
+            if(specs == NULL) {
+                fprintf(stderr,"error: out of memory reading manifest\n");
+                failed = 1;
+                goto out;
+            }
+            b.specs = specs;
+        }
+        spec = &b.specs[b.count++];
+        memset(spec, 0, sizeof(*spec));
+        spec->line = lineno;
+        spec->status = 1;
+        spec->opts = *defaults;
+        spec->opts.output = NULL;
+        /* an --update line changes only what the line itself gives */
+        spec->opts.set = 0;
+        spec->text = strdup(p);
+        if(spec->text == NULL) {
+            snprintf(spec->res.error, sizeof(spec->res.error), "out of memory");
+            continue;
+        }
+
+        argc = split_args(spec->text, argv, BATCH_MAX_ARGS);
+        if(argc < 0) {
+            snprintf(spec->res.error, sizeof(spec->res.error),
+                     "unterminated quote or too many arguments");
+            continue;
+        }
+        if(parse_opts(argc, argv, &spec->opts, spec->res.error,
+                      sizeof(spec->res.error))) {
+            if(spec->res.error[0] == '\0') {
+                snprintf(spec->res.error, sizeof(spec->res.error),
+                         "malformed arguments");
+            }
+            continue;
+        }
+        if(spec->opts.batch != defaults->batch || spec->opts.jobs != defaults->jobs ||
+           spec->opts.stats != defaults->stats) {
+            snprintf(spec->res.error, sizeof(spec->res.error),
+                     "--batch, --jobs and --stats cannot be used in a manifest");
+            continue;
+        }
+        spec->valid = !check_opts(&spec->opts, spec->res.error,
+                                  sizeof(spec->res.error));
+    }
+    if(ferror(f)) {
+        fprintf(stderr,"error: could not read manifest '%s'\n", manifest);
+        failed = 1;
+        goto out;
+    }
+
+    input_cache_init(&b.inputs, 0);
+    pthread_mutex_init(&b.lock, NULL);
+
+    if(jobs > b.count) jobs = b.count;
+    if(jobs > 1) {
+        workers = calloc(jobs, sizeof(*workers));
+    }
+    for(i = 0; workers && i < jobs; i++) {
+        if(pthread_create(&workers[nworkers], NULL, batch_worker, &b) == 0) {
+            nworkers++;
+        }
+    }
+    /* the main thread works the queue too, which also covers the case
+     * where no worker could be started */
+    batch_worker(&b);
+    for(i = 0; i < nworkers; i++) {
+        pthread_join(workers[i], NULL);
+    }
+    free(workers);
+
+    pthread_mutex_destroy(&b.lock);
+    input_cache_destroy(&b.inputs);
+
+    printf("{\"images\":[");
+    for(i = 0; i < b.count; i++) {
+        struct batch_spec *spec = &b.specs[i];
+
+        printf("%s{\"line\":%u,\"output\":", i ? "," : "", spec->line);
+        print_json_string(spec->opts.update ? spec->opts.update : spec->opts.output);
+        if(spec->status == 0) {
+            unsigned j;
+
+            printf(",\"status\":\"ok\",\"id\":\"0x");
+            for(j = 0; j < sizeof(spec->res.id); j++) {
+                printf("%02x", spec->res.id[j]);
+            }
+            printf("\"");
+            if(spec->opts.diff_write) {
+                printf(",\"written\":%llu", (unsigned long long)spec->res.written);
+            }
+            printf("}");
+        } else {
+            printf(",\"status\":\"error\",\"error\":");
+            print_json_string(spec->res.error);
+            printf("}");
+            failed++;
+        }
+    }
+    printf("],\"succeeded\":%u,\"failed\":%u}\n", b.count - failed, failed);
+
+out:
+    for(i = 0; i < b.count; i++) {
+        free(b.specs[i].text);
+    }
+    free(b.specs);
+    free(line);
+    if(f != stdin) fclose(f);
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,28 @@
+/*
+ * Copyright (C) 2007 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#pragma once
+
+#include "mkbootimg.h"
+
+/* Build every image listed in a manifest, one set of mkbootimg arguments
+ * per line, each applied over the defaults given on the command line.
+ * Blank lines and lines starting with '#' are skipped; "-" reads the
+ * manifest from stdin. Results are reported as one JSON document on
+ * stdout. Returns non-zero if any image failed. */
+int run_batch(const struct build_opts *defaults, const char *manifest,
+              unsigned jobs);
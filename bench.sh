@@ -0,0 +1,154 @@
+#!/bin/sh
+#
+# Throughput benchmark for mkbootimg and unpackbootimg, run by make bench.
+#
+# For each input size it generates a synthetic kernel, ramdisk and dtb of
+# random data, then builds an image from them for every page size, header
+# version, hash type and --io write method and unpacks it again, keeping
+# the best of BENCH_RUNS runs of each. The times and peak RSS come from
+# the tools' own --stats=json report. Results go to BENCH_OUT as JSON, one
+# entry per build or unpack, with the input bytes, wall time, MB/s and
+# peak RSS; the unpacks have an "io" of null.
+#
+# Everything is generated locally, so it needs no network. The inputs are
+# read from the page cache after the first run, so the numbers are for
+# warm-cache builds, which is what repeated builds on a farm see.
+#
+# BENCH_SIZES       input sizes in MB (default "1 16 64"; up to 1024, see
+#                   make bench-full)
+# BENCH_PAGESIZES   page sizes (default every one mkbootimg supports)
+# BENCH_VERSIONS    header versions (default "0 1 2 3")
+# BENCH_HASHES      hash types (default "sha1 sha256")
+# BENCH_IOS         mkbootimg --io methods (default "rw uring")
+# BENCH_RUNS        runs per case, the fastest is kept (default 3)
+# BENCH_DIR         scratch directory (default a new one under /tmp)
+# BENCH_OUT         results file (default bench.json)
+
+set -e
+
+MKBOOTIMG=${MKBOOTIMG:-./mkbootimg}
+UNPACKBOOTIMG=${UNPACKBOOTIMG:-./unpackbootimg}
+BENCH_SIZES=${BENCH_SIZES:-"1 16 64"}
+BENCH_PAGESIZES=${BENCH_PAGESIZES:-"2048 4096 8192 16384 32768 65536 131072"}
+BENCH_VERSIONS=${BENCH_VERSIONS:-"0 1 2 3"}
+BENCH_HASHES=${BENCH_HASHES:-"sha1 sha256"}
+BENCH_IOS=${BENCH_IOS:-"rw uring"}
+BENCH_RUNS=${BENCH_RUNS:-3}
+BENCH_OUT=${BENCH_OUT:-bench.json}
+
+if [ -z "$BENCH_DIR" ]; then
+    BENCH_DIR=$(mktemp -d /tmp/bootimg-bench.XXXXXX)
+    trap 'rm -rf "$BENCH_DIR"' EXIT
+    trap 'exit 1' INT TERM
+fi
+mkdir -p "$BENCH_DIR"
+
+# A run-wide field of the JSON report, the last line a tool writes to
+# stderr; the same names inside "io" and "phases" come after them.
+stats_field() {
+    sed -n 's/^{[^{[]*"'"$2"'":\([0-9]*\).*/\1/p' "$1" | tail -n 1
+}
+
+# run <stats file> <command...>: run the command BENCH_RUNS times and leave
+# the best wall time and the peak RSS of that run in wall_ns and rss_kb
+run() {
+    out=$1
+    shift
+    wall_ns=
+    rss_kb=
+    i=0
+    while [ $i -lt "$BENCH_RUNS" ]; do
+        if ! "$@" 2>"$out" >/dev/null; then
+            echo "error: $* failed:" >&2
+            cat "$out" >&2
+            exit 1
+        fi
+        w=$(stats_field "$out" wall_ns)
+        if [ -z "$wall_ns" ] || [ "$w" -lt "$wall_ns" ]; then
+            wall_ns=$w
+            rss_kb=$(stats_field "$out" peak_rss_kb)
+        fi
+        i=$((i + 1))
+    done
+}
+
+# result <tool> <size MB> <pagesize> <version> <hash> <io, or - for none>
+#        <bytes>
+result() {
+    mbps=$(awk -v b="$7" -v ns="$wall_ns" \
+           'BEGIN { printf "%.1f", ns ? b / 1048576 / (ns / 1e9) : 0 }')
+    if [ "$6" = - ]; then
+        io=null
+    else
+        io=\"$6\"
+    fi
+    printf '%s    {"tool":"%s","size_mb":%s,"pagesize":%s,"header_version":%s,' \
+           "$sep" "$1" "$2" "$3" "$4" >>"$BENCH_OUT.tmp"
+    printf '"hashtype":"%s","io":%s,"bytes":%s,"wall_ns":%s,"mb_per_s":%s,' \
+           "$5" "$io" "$7" "$wall_ns" "$mbps" >>"$BENCH_OUT.tmp"
+    printf '"peak_rss_kb":%s}' "$rss_kb" >>"$BENCH_OUT.tmp"
+    sep=",
+"
+    printf '%-13s %5s MB  page %6s  v%s  %-6s %-8s %9s MB/s  %8s KiB\n' \
+           "$1" "$2" "$3" "$4" "$5" "$6" "$mbps" "$rss_kb"
+}
+
+{
+    printf '{\n  "date":"%s",\n' "$(date -u +%Y-%m-%dT%H:%M:%SZ)"
+    printf '  "host":"%s",\n' "$(uname -srm)"
+    printf '  "cpus":%s,\n' "$(getconf _NPROCESSORS_ONLN 2>/dev/null || echo 1)"
+    printf '  "runs":%s,\n' "$BENCH_RUNS"
+    printf '  "results":[\n'
+} >"$BENCH_OUT.tmp"
+sep=
+
+for size in $BENCH_SIZES; do
+    # a kernel of half the total, and the rest split 3:1 between the
+    # ramdisk and the dtb
+    total=$((size * 1048576))
+    kernel_sz=$((total / 2))
+    dtb_sz=$((total / 8))
+    ramdisk_sz=$((total - kernel_sz - dtb_sz))
+    head -c $kernel_sz /dev/urandom >"$BENCH_DIR/kernel"
+    head -c $ramdisk_sz /dev/urandom >"$BENCH_DIR/ramdisk"
+    head -c $dtb_sz /dev/urandom >"$BENCH_DIR/dtb"
+
+    for version in $BENCH_VERSIONS; do
+        # versions 0 and 1 have no dtb, and 3 always has 4096 byte pages
+        if [ "$version" -lt 2 ]; then
+            bytes=$((kernel_sz + ramdisk_sz))
+        else
+            bytes=$total
+        fi
+        for pagesize in $BENCH_PAGESIZES; do
+            if [ "$version" -eq 3 ] && [ "$pagesize" -ne 4096 ]; then
+                continue
+            fi
+            for hash in $BENCH_HASHES; do
+                img=$BENCH_DIR/boot.img
+                for io in $BENCH_IOS; do
+                    rm -f "$img"
+                    run "$BENCH_DIR/stats" "$MKBOOTIMG" --stats=json \
+                        --kernel "$BENCH_DIR/kernel" --ramdisk "$BENCH_DIR/ramdisk" \
+                        --dtb "$BENCH_DIR/dtb" --header_version "$version" \
+                        --pagesize "$pagesize" --hashtype "$hash" --io "$io" \
+                        -o "$img"
+                    result mkbootimg "$size" "$pagesize" "$version" "$hash" "$io" \
+                        "$bytes"
+                done
+
+                # the image is the same whichever way it was written
+                mkdir -p "$BENCH_DIR/out"
+                run "$BENCH_DIR/stats" "$UNPACKBOOTIMG" --stats=json \
+                    -i "$img" -o "$BENCH_DIR/out"
+                result unpackbootimg "$size" "$pagesize" "$version" "$hash" - "$bytes"
+                rm -rf "$img" "$BENCH_DIR/out"
+            done
+        done
+    done
+    rm -f "$BENCH_DIR/kernel" "$BENCH_DIR/ramdisk" "$BENCH_DIR/dtb"
+done
+
+printf '\n  ]\n}\n' >>"$BENCH_OUT.tmp"
+mv "$BENCH_OUT.tmp" "$BENCH_OUT"
+echo "results written to $BENCH_OUT"
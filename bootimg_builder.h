@@ -0,0 +1,136 @@
+/*
+ * Copyright (C) 2007 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * libbootimg: build boot images without going through the filesystem.
+ *
+ *     struct bootimg_builder *b = bootimg_builder_new();
+ *     bootimg_set_buffer(b, BOOTIMG_KERNEL, kernel, kernel_size);
+ *     bootimg_set_fd(b, BOOTIMG_RAMDISK, ramdisk_fd, 0, ramdisk_size);
+ *     if(bootimg_write_fd(b, out_fd))
+ *         fprintf(stderr, "error: %s\n", bootimg_error(b));
+ *     bootimg_builder_free(b);
+ *
+ * Setters return 0, or -1 with the reason available from bootimg_error().
+ * Segment sources are not copied: buffers must stay valid and fds open
+ * until the builder is freed or the segment replaced. Sources are only
+ * read with explicit offsets, never moving an fd's file position.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif  // __cplusplus
+
+/* In the order they are laid out after the header page. */
+enum bootimg_segment {
+    BOOTIMG_KERNEL = 0,
+    BOOTIMG_RAMDISK,
+    BOOTIMG_SECOND,
+    BOOTIMG_DT,             /* header version 0 only */
+    BOOTIMG_RECOVERY_DTBO,  /* header versions 1 and 2 */
+    BOOTIMG_DTB,            /* header version 2 */
+    BOOTIMG_SEGMENT_COUNT,
+};
+
+enum bootimg_hash {
+    BOOTIMG_SHA1 = 0,
+    BOOTIMG_SHA256,
+};
+
+/* Load addresses are base + offset, as with mkbootimg's options. */
+enum bootimg_address {
+    BOOTIMG_BASE = 0,
+    BOOTIMG_KERNEL_OFFSET,
+    BOOTIMG_RAMDISK_OFFSET,
+    BOOTIMG_SECOND_OFFSET,
+    BOOTIMG_TAGS_OFFSET,
+    BOOTIMG_DTB_OFFSET,
+    BOOTIMG_ADDRESS_COUNT,
+};
+
+/* Read up to len bytes of a callback segment, starting at offset, into
+ * buf. Returns the number of bytes read, 0 at end of data or -1 with errno
+ * set. Offsets only ever increase within a pass, but a segment may be read
+ * twice when the output cannot seek. */
+typedef ssize_t (*bootimg_read_fn)(void *opaque, void *buf, size_t len,
+                                   uint64_t offset);
+
+struct bootimg_builder;
+
+/* Defaults match mkbootimg: header version 0, 2048 byte pages, sha1 and
+ * the usual base and offsets. Returns NULL if out of memory. */
+struct bootimg_builder *bootimg_builder_new(void);
+void bootimg_builder_free(struct bootimg_builder *b);
+
+/* The reason the last call on b failed. */
+const char *bootimg_error(const struct bootimg_builder *b);
+
+int bootimg_set_header_version(struct bootimg_builder *b, unsigned version);
+int bootimg_set_page_size(struct bootimg_builder *b, uint32_t pagesize);
+int bootimg_set_hash(struct bootimg_builder *b, enum bootimg_hash alg);
+int bootimg_set_address(struct bootimg_builder *b, enum bootimg_address which,
+                        uint32_t value);
+int bootimg_set_cmdline(struct bootimg_builder *b, const char *cmdline);
+int bootimg_set_board(struct bootimg_builder *b, const char *board);
+/* Packed as returned by bootimg_parse_os_version() and
+ * bootimg_parse_os_patch_level(). */
+int bootimg_set_os_version(struct bootimg_builder *b, unsigned version,
+                           unsigned patch_level);
+
+/* "A.B.C" and "YYYY-MM-DD"; 0 if the string does not parse. */
+int bootimg_parse_os_version(const char *ver);
+int bootimg_parse_os_patch_level(const char *lvl);
+
+/* Set the source of a segment, replacing any previous one. */
+int bootimg_set_buffer(struct bootimg_builder *b, enum bootimg_segment seg,
+                       const void *data, uint32_t size);
+int bootimg_set_fd(struct bootimg_builder *b, enum bootimg_segment seg,
+                   int fd, uint64_t offset, uint32_t size);
+int bootimg_set_callback(struct bootimg_builder *b, enum bootimg_segment seg,
+                         bootimg_read_fn read, void *opaque, uint32_t size);
+int bootimg_clear_segment(struct bootimg_builder *b, enum bootimg_segment seg);
+
+/* Layout of the image as currently configured: its total size, and where
+ * a segment starts (0 when absent). bootimg_image_size() returns 0 if the
+ * configuration cannot be built. */
+uint64_t bootimg_image_size(struct bootimg_builder *b);
+uint64_t bootimg_segment_offset(struct bootimg_builder *b, enum bootimg_segment seg);
+
+/* Hash the segments into the id stored in the header, unless the last
+ * write already did. Copies the digest (20 bytes for sha1, 32 for sha256)
+ * to id and returns its size, or -1. */
+int bootimg_id(struct bootimg_builder *b, uint8_t id[32]);
+
+/* Write the image. A seekable fd is written from offset 0 and, if it is a
+ * regular file, truncated to the image size with the padding left as
+ * holes; anything else, like a pipe or socket, is written sequentially
+ * after a first pass to compute the id. */
+int bootimg_write_fd(struct bootimg_builder *b, int fd);
+/* buf must hold at least bootimg_image_size() bytes. */
+int bootimg_write_buffer(struct bootimg_builder *b, void *buf, size_t len);
+/* Write the image to a new anonymous memory file (Linux only) and return
+ * its fd, positioned at 0, or -1. */
+int bootimg_write_memfd(struct bootimg_builder *b, const char *name);
+
+#ifdef __cplusplus
+}
+#endif  // __cplusplus
@@ -0,0 +1,93 @@
+/*
+ * Copyright (C) 2007 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * The boot image format as mkbootimg and libbootimg both write it: the
+ * layout, which segments the id covers, the header and the id itself.
+ * Built into libbootimg but not part of its API; the symbols are hidden
+ * from the shared library.
+ *
+ * Segments are indexed in enum bootimg_segment order, which is also the
+ * order mkbootimg's SEG_* constants follow.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "mincrypt/sha.h"
+#include "bootimg.h"
+#include "bootimg_builder.h"
+
+#pragma GCC visibility push(hidden)
+
+/* The longest command line, across cmdline and extra_cmdline up to v2 and
+ * in the single field of v3, which then has no terminator. */
+#define BOOTIMG_CMDLINE_MAX (BOOT_ARGS_SIZE + BOOT_EXTRA_ARGS_SIZE)
+
+/* What goes in the header besides the segment sizes. */
+struct bootimg_params {
+    unsigned header_version;
+    uint32_t pagesize;          /* as given; see bootimg_layout_pagesize() */
+    uint64_t addr[BOOTIMG_ADDRESS_COUNT];   /* the dtb address is 64 bit */
+    uint32_t os_version;        /* packed, see bootimg_set_os_version() */
+    const char *board;          /* shorter than BOOT_NAME_SIZE */
+    const char *cmdline;        /* at most BOOTIMG_CMDLINE_MAX */
+};
+
+/* The page size the image is laid out with: 4096 for v3, which has no
+ * page size field, and pagesize otherwise. */
+uint32_t bootimg_layout_pagesize(unsigned header_version, uint32_t pagesize);
+
+/* Whether the id covers segment seg, which depends on whether there is a
+ * v0 dt. */
+bool bootimg_segment_hashed(unsigned seg, unsigned header_version, bool have_dt);
+
+/* Lay the present segments out after the header page, each on a page
+ * boundary, filling in offsets from the start of the image for all of
+ * them, and return the image size. */
+uint64_t bootimg_layout(const uint32_t sizes[BOOTIMG_SEGMENT_COUNT],
+                        const bool present[BOOTIMG_SEGMENT_COUNT],
+                        uint32_t pagesize, uint64_t offsets[BOOTIMG_SEGMENT_COUNT]);
+
+/* Start a v0-v2 header from p, with no segment sizes and no id. */
+void bootimg_init_header(boot_img_hdr_v2 *hdr, const struct bootimg_params *p);
+
+/* Split cmdline across cmdline and extra_cmdline. */
+void bootimg_set_header_cmdline(boot_img_hdr_v2 *hdr, const char *cmdline);
+
+/* The segment sizes and the recovery dtbo offset, from bootimg_layout(). */
+void bootimg_set_header_sizes(boot_img_hdr_v2 *hdr, unsigned header_version,
+                              const uint32_t sizes[BOOTIMG_SEGMENT_COUNT],
+                              const bool present[BOOTIMG_SEGMENT_COUNT],
+                              const uint64_t offsets[BOOTIMG_SEGMENT_COUNT]);
+
+/* Lay out the header for header_version as it goes on disk, hdr
+ * carrying the fields and id, and return its size. out must have room for
+ * a boot_img_hdr_v2, the largest version. */
+size_t bootimg_format_header(const boot_img_hdr_v2 *hdr, unsigned header_version,
+                             const char *cmdline, void *out);
+
+/* The id is the hash of each hashed segment's payload followed by its
+ * size as a uint32_t. Returns -1 for an unknown hash. */
+int bootimg_id_init(HASH_CTX *ctx, enum bootimg_hash alg);
+void bootimg_id_add_size(HASH_CTX *ctx, uint32_t size);
+/* Store the digest in id, zero padded, and return its size. */
+int bootimg_id_finish(HASH_CTX *ctx, uint8_t id[32]);
+
+#pragma GCC visibility pop
@@ -0,0 +1,496 @@
+/*
+ * Copyright (C) 2007 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <stddef.h>
+#include <limits.h>
+#include <dirent.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#endif
+
+#include "mincrypt/sha256.h"
+#include "bootimg_format.h"
+#include "mkbootimg.h"
+#include "cache.h"
+
+/* Copy size bytes of in to out from the start, in the kernel where it can. */
+static int copy_file(int in, int out, uint64_t size)
+{
+    uint64_t pos = 0;
+
+    while(pos < size) {
+        off_t in_off = pos;
+        ssize_t count = -1;
+        char buf[65536];
+
+#ifdef __linux__
+        count = copy_file_range(in, &in_off, out, NULL, size - pos, 0);
+#endif
+        if(count < 0) {
+            count = pread(in, buf, sizeof(buf), pos);
+            if(count <= 0 || write(out, buf, count) != count) return -1;
+        } else if(count == 0) {
+            return -1;
+        }
+        pos += count;
+    }
+    return 0;
+}
+
+#define CACHE_MAGIC "mkbootimg cache 3"
+
+/* What changes when a file is written to, replaced or relinked. */
+struct cache_stamp {
+    uint64_t dev;
+    uint64_t ino;
+    uint64_t size;
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+    int64_t ctime_sec;
+    int64_t ctime_nsec;
+};
+
+struct cache_digest {
+    char magic[sizeof(CACHE_MAGIC)];
+    struct cache_stamp stamp;
+    uint8_t digest[SHA256_DIGEST_SIZE];
+};
+
+/* The .id file of an object. */
+struct cache_entry {
+    char magic[sizeof(CACHE_MAGIC)];
+    uint8_t id[32];
+    struct cache_stamp object;
+};
+
+static void cache_stamp(struct cache_stamp *stamp, const struct stat *st)
+{
+    stamp->dev = st->st_dev;
+    stamp->ino = st->st_ino;
+    stamp->size = st->st_size;
+    stamp->mtime_sec = st->st_mtim.tv_sec;
+    stamp->mtime_nsec = st->st_mtim.tv_nsec;
+    stamp->ctime_sec = st->st_ctim.tv_sec;
+    stamp->ctime_nsec = st->st_ctim.tv_nsec;
+}
+
+static void cache_hex(char *out, const uint8_t *bytes, size_t len)
+{
+    size_t i;
+
+    for(i = 0; i < len; i++) {
+        sprintf(out + 2 * i, "%02x", bytes[i]);
+    }
+}
+
+/* SHA-256 of an input file, from the memo if it is still current. */
+static int cache_input_digest(const char *dir, const char *fn, uint32_t *size,
+                              uint8_t *digest)
+{
+    struct cache_digest want, have;
+    char path[PATH_MAX];
+    char tmp[PATH_MAX + 8];
+    struct stat st;
+    HASH_CTX ctx;
+    int in, fd;
+
+    in = open_file(fn, size);
+    if(in < 0) return -1;
+    if(fstat(in, &st)) goto fail;
+
+    memset(&want, 0, sizeof(want));
+    memcpy(want.magic, CACHE_MAGIC, sizeof(want.magic));
+    cache_stamp(&want.stamp, &st);
+
+    snprintf(path, sizeof(path), "%s/inputs/%llx-%llx", dir,
+             (unsigned long long) want.stamp.dev, (unsigned long long) want.stamp.ino);
+    fd = open(path, O_RDONLY);
+    if(fd >= 0) {
+        ssize_t n = read(fd, &have, sizeof(have));
+
+        close(fd);
+        if(n == sizeof(have) &&
+           !memcmp(&have, &want, offsetof(struct cache_digest, digest))) {
+            memcpy(digest, have.digest, sizeof(have.digest));
+            close(in);
+            return 0;
+        }
+    }
+
+    SHA256_init(&ctx);
+    if(hash_file(in, fn, *size, &ctx)) goto fail;
+    memcpy(want.digest, SHA256_final(&ctx), sizeof(want.digest));
+    memcpy(digest, want.digest, sizeof(want.digest));
+    close(in);
+
+    snprintf(tmp, sizeof(tmp), "%s.XXXXXX", path);
+    fd = mkstemp(tmp);
+    if(fd >= 0) {
+        if(write(fd, &want, sizeof(want)) != sizeof(want) || close(fd) ||
+           rename(tmp, path)) {
+            unlink(tmp);
+        }
+    }
+    return 0;
+
+fail:
+    close(in);
+    return -1;
+}
+
+static void cache_key_str(HASH_CTX *ctx, const char *name, const char *val)
+{
+    char len[32];
+
+    snprintf(len, sizeof(len), "%s %zu:", name, strlen(val));
+    SHA256_update(ctx, len, strlen(len));
+    SHA256_update(ctx, val, strlen(val));
+    SHA256_update(ctx, "\n", 1);
+}
+
+/* Compute the cache key of the image o describes, as a hex string.
+ * Inputs are chosen the way build_image() chooses them. Returns -1 if
+ * an input cannot be read; the build then reports it properly. */
+static int cache_key(const struct build_opts *o, char *hex)
+{
+    const char *inputs[BOOTIMG_SEGMENT_COUNT] = {
+        [BOOTIMG_KERNEL] = o->kernel_fn,
+        [BOOTIMG_RAMDISK] = o->ramdisk_fn,
+        [BOOTIMG_SECOND] = o->second_fn,
+        [BOOTIMG_DT] = o->header_version == 0 ? o->dt_fn : NULL,
+        [BOOTIMG_RECOVERY_DTBO] = o->header_version > 0 ? o->recovery_dtbo_fn : NULL,
+        [BOOTIMG_DTB] = o->header_version > 1 ? o->dtb_fn : NULL,
+    };
+    char line[256];
+    HASH_CTX ctx;
+    unsigned i;
+
+    /* a packed directory has no one file to take the digest of */
+    if(o->ramdisk_dir) return -1;
+
+    SHA256_init(&ctx);
+    snprintf(line, sizeof(line),
+             CACHE_MAGIC "\nheader_version %d\npagesize %u\nhashtype %s\n"
+             "base %08x kernel %08x ramdisk %08x second %08x tags %08x dtb %016llx\n"
+             "os_version %d os_patch_level %d\n",
+             o->header_version, bootimg_layout_pagesize(o->header_version, o->pagesize),
+             hash_names[o->hash_alg].name, o->base, o->kernel_offset,
+             o->ramdisk_offset, o->second_offset, o->tags_offset,
+             (unsigned long long) o->dtb_offset, o->os_version, o->os_patch_level);
+    SHA256_update(&ctx, line, strlen(line));
+    if(o->ramdisk_compress != COMPRESS_NONE) {
+        snprintf(line, sizeof(line), "ramdisk_compress %s %d\n",
+                 compress_method_name(o->ramdisk_compress), o->compress_level);
+        SHA256_update(&ctx, line, strlen(line));
+    }
+    cache_key_str(&ctx, "board", o->board);
+    cache_key_str(&ctx, "cmdline", o->cmdline);
+
+    for(i = 0; i < BOOTIMG_SEGMENT_COUNT; i++) {
+        uint8_t digest[SHA256_DIGEST_SIZE];
+        char digest_hex[2 * SHA256_DIGEST_SIZE + 1];
+        char *files[SEG_MAX_PARTS];
+        char *list;
+        uint32_t size;
+        unsigned n, j;
+
+        if(inputs[i] == NULL) {
+            snprintf(line, sizeof(line), "segment %u none\n", i);
+            SHA256_update(&ctx, line, strlen(line));
+            continue;
+        }
+        /* a line per file of the segment */
+        list = strdup(inputs[i]);
+        n = list ? split_files(list, files, SEG_MAX_PARTS) : 0;
+        if(n == 0) {
+            free(list);
+            return -1;
+        }
+        for(j = 0; j < n; j++) {
+            if(cache_input_digest(o->cache, files[j], &size, digest)) {
+                free(list);
+                return -1;
+            }
+            cache_hex(digest_hex, digest, sizeof(digest));
+            snprintf(line, sizeof(line), "segment %u %u %s\n", i, size, digest_hex);
+            SHA256_update(&ctx, line, strlen(line));
+        }
+        free(list);
+    }
+
+    cache_hex(hex, SHA256_final(&ctx), SHA256_DIGEST_SIZE);
+    return 0;
+}
+
+/* Put a copy of the image open at in at out, a new file, sharing its
+ * blocks if the filesystem allows. */
+static int cache_copy_out(int in, const char *out)
+{
+    struct stat st;
+    int fd;
+    int err;
+
+    if(fstat(in, &st)) return -1;
+    if(unlink(out) && errno != ENOENT) return -1;
+    fd = open(out, O_CREAT | O_EXCL | O_WRONLY, 0644);
+    if(fd < 0) return -1;
+#ifdef __linux__
+    if(ioctl(fd, FICLONE, in) == 0) goto done;
+#endif
+    if(copy_file(in, fd, st.st_size)) goto fail;
+done:
+    if(close(fd)) {
+        fd = -1;
+        goto fail;
+    }
+    return 0;
+
+fail:
+    err = errno;
+    if(fd >= 0) close(fd);
+    unlink(out);
+    errno = err;
+    return -1;
+}
+
+/* Deliver the cached object to out if it is still the file stamp
+ * describes. Returns 0, 1 if it is not or -1 on error. */
+static int cache_deliver(const char *object, const struct cache_stamp *stamp,
+                         const char *out)
+{
+    struct cache_stamp have;
+    struct stat st;
+    int in;
+    int ret;
+
+    in = open(object, O_RDONLY);
+    if(in < 0) return errno == ENOENT ? 1 : -1;
+    if(fstat(in, &st)) {
+        close(in);
+        return -1;
+    }
+    memset(&have, 0, sizeof(have));
+    cache_stamp(&have, &st);
+    if(memcmp(&have, stamp, sizeof(have))) {
+        close(in);
+        return 1;
+    }
+    ret = cache_copy_out(in, out);
+    close(in);
+    return ret;
+}
+
+struct cache_object {
+    char name[2 * SHA256_DIGEST_SIZE + 5];
+    struct timespec used;
+    uint64_t size;
+};
+
+static int cache_object_cmp(const void *a, const void *b)
+{
+    const struct cache_object *x = a, *y = b;
+
+    if(x->used.tv_sec != y->used.tv_sec) return x->used.tv_sec < y->used.tv_sec ? -1 : 1;
+    if(x->used.tv_nsec != y->used.tv_nsec) return x->used.tv_nsec < y->used.tv_nsec ? -1 : 1;
+    return 0;
+}
+
+/* Remove the least recently used objects until the cache holds at most
+ * limit bytes of images. keep is never removed. */
+static void cache_evict(const char *dir, uint64_t limit, const char *keep)
+{
+    struct cache_object *objs = NULL;
+    unsigned count = 0, alloc = 0, i;
+    uint64_t total = 0;
+    char path[PATH_MAX];
+    struct dirent *de;
+    DIR *d;
+    int lock;
+
+    snprintf(path, sizeof(path), "%s/lock", dir);
+    lock = open(path, O_CREAT | O_RDWR, 0644);
+    if(lock < 0) return;
+    if(flock(lock, LOCK_EX)) goto out;
+
+    snprintf(path, sizeof(path), "%s/objects", dir);
+    d = opendir(path);
+    if(d == NULL) goto out;
+    while((de = readdir(d)) != NULL) {
+        size_t len = strlen(de->d_name);
+        struct stat st;
+
+        char id[2 * SHA256_DIGEST_SIZE + 4];
+
+        if(len != 2 * SHA256_DIGEST_SIZE + 4 || strcmp(de->d_name + len - 4, ".img")) continue;
+        if(fstatat(dirfd(d), de->d_name, &st, 0)) continue;
+        if(count == alloc) {
+            struct cache_object *n;
+
+            alloc = alloc ? alloc * 2 : 64;
+            n = realloc(objs, alloc * sizeof(*objs));
+            if(n == NULL) break;
+            objs = n;
+        }
+        strcpy(objs[count].name, de->d_name);
+        objs[count].size = st.st_size;
+        /* hits touch the .id file, never the object itself; one that
+         * has none goes first */
+        snprintf(id, sizeof(id), "%.*s.id", 2 * SHA256_DIGEST_SIZE, de->d_name);
+        if(fstatat(dirfd(d), id, &st, 0)) {
+            memset(&objs[count].used, 0, sizeof(objs[count].used));
+        } else {
+            objs[count].used = st.st_mtim;
+        }
+        total += objs[count].size;
+        count++;
+    }
+
+    qsort(objs, count, sizeof(*objs), cache_object_cmp);
+    for(i = 0; i < count && total > limit; i++) {
+        if(!strncmp(objs[i].name, keep, 2 * SHA256_DIGEST_SIZE)) continue;
+        unlinkat(dirfd(d), objs[i].name, 0);
+        strcpy(objs[i].name + 2 * SHA256_DIGEST_SIZE, ".id");
+        unlinkat(dirfd(d), objs[i].name, 0);
+        total -= objs[i].size;
+    }
+    closedir(d);
+    free(objs);
+out:
+    close(lock);
+}
+
+int cached_build_image(const struct build_opts *o, struct input_cache *inputs,
+                       struct build_result *res)
+{
+    char key[2 * SHA256_DIGEST_SIZE + 1];
+    char object[PATH_MAX];
+    char idfile[PATH_MAX];
+    char tmp[PATH_MAX];
+    char tmp_id[PATH_MAX + 8];
+    struct cache_entry entry;
+    struct build_opts miss;
+    struct stat st;
+    int fd, img;
+
+    snprintf(tmp, sizeof(tmp), "%s/objects", o->cache);
+    mkdir(o->cache, 0755);
+    mkdir(tmp, 0755);
+    snprintf(tmp, sizeof(tmp), "%s/inputs", o->cache);
+    mkdir(tmp, 0755);
+
+    /* only a regular output can take a copy of the object; devices and
+     * the like are simply built */
+    if(!strcmp(o->output, "-") ||
+       (stat(o->output, &st) == 0 && !S_ISREG(st.st_mode)) ||
+       cache_key(o, key)) {
+        return build_image(o, inputs, res);
+    }
+
+    snprintf(object, sizeof(object), "%s/objects/%s.img", o->cache, key);
+    snprintf(idfile, sizeof(idfile), "%s/objects/%s.id", o->cache, key);
+
+    fd = open(idfile, O_RDONLY);
+    if(fd >= 0) {
+        ssize_t n = read(fd, &entry, sizeof(entry));
+        int ret = 1;
+
+        if(n == sizeof(entry) && !memcmp(entry.magic, CACHE_MAGIC, sizeof(entry.magic))) {
+            ret = cache_deliver(object, &entry.object, o->output);
+        }
+        if(ret == 0) {
+            /* a hit makes the object the most recently used */
+            futimens(fd, NULL);
+            close(fd);
+            memcpy(res->id, entry.id, sizeof(res->id));
+            res->error[0] = '\0';
+            return 0;
+        }
+        close(fd);
+        if(ret == 1) {
+            /* changed, gone or left over from an older cache; build it
+             * again */
+            unlink(object);
+            unlink(idfile);
+        }
+    }
+
+    /* build under a temporary name, publish the image, then its id */
+    snprintf(tmp, sizeof(tmp), "%s/objects/%s.XXXXXX", o->cache, key);
+    fd = mkstemp(tmp);
+    if(fd < 0) return build_image(o, inputs, res);
+    close(fd);
+
+    miss = *o;
+    miss.output = tmp;
+    if(build_image(&miss, inputs, res)) {
+        unlink(tmp);
+        return 1;
+    }
+
+    /* the stamp is taken once the object is in place, as the rename
+     * changes its ctime */
+    snprintf(tmp_id, sizeof(tmp_id), "%s.id", tmp);
+    memset(&entry, 0, sizeof(entry));
+    memcpy(entry.magic, CACHE_MAGIC, sizeof(entry.magic));
+    memcpy(entry.id, res->id, sizeof(entry.id));
+    img = open(tmp, O_RDONLY);
+    if(img < 0) {
+        unlink(tmp);
+        snprintf(res->error, sizeof(res->error), "could not open '%s': %s",
+                 tmp, strerror(errno));
+        return 1;
+    }
+    fd = -1;
+    if(fchmod(img, 0444) == 0 && rename(tmp, object) == 0 && fstat(img, &st) == 0) {
+        cache_stamp(&entry.object, &st);
+        fd = open(tmp_id, O_CREAT | O_EXCL | O_WRONLY, 0444);
+    } else {
+        unlink(tmp);
+    }
+    if(fd >= 0) {
+        bool written = write(fd, &entry, sizeof(entry)) == sizeof(entry);
+
+        if(close(fd) || !written || rename(tmp_id, idfile)) {
+            /* without its id the object is never delivered, and goes
+             * first when space is needed */
+            unlink(tmp_id);
+        }
+    }
+
+    cache_evict(o->cache, o->cache_size, key);
+
+    /* from the image just built, whatever became of the cache */
+    if(cache_copy_out(img, o->output)) {
+        snprintf(res->error, sizeof(res->error), "could not create '%s': %s",
+                 o->output, strerror(errno));
+        close(img);
+        return 1;
+    }
+    close(img);
+    return 0;
+}
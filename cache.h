@@ -0,0 +1,41 @@
+/*
+ * Copyright (C) 2007 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#pragma once
+
+#include "mkbootimg.h"
+
+/* Content-addressed cache of finished images, enabled with --cache. The
+ * key is a SHA-256 over every header field the options set and the
+ * content digest of every input the image uses, so two builds with the
+ * same key produce the same bytes. A hit is delivered to the output by
+ * reflink or, failing that, a copy into a new file, without building
+ * anything. No link to an object is ever handed out, and its .id file
+ * records the object's identity and timestamps next to the image id, so
+ * an object changed behind the cache's back is built again rather than
+ * delivered. The .id file's mtime serves as the LRU clock for eviction
+ * down to --cache-size.
+ *
+ * Content digests are memoized per input file under inputs/, keyed on
+ * its identity and timestamps, so a hit does not read any payload. */
+
+#define CACHE_DEFAULT_SIZE (4ULL << 30)
+
+/* build_image() through the cache in o->cache. On a miss the image is
+ * built into the cache and then delivered like a hit. */
+int cached_build_image(const struct build_opts *o, struct input_cache *inputs,
+                       struct build_result *res);
@@ -0,0 +1,380 @@
+#!/bin/sh
+#
+# Round-trip tests for mkbootimg, run by make check.
+#
+# Each --ramdisk-compress method builds an image from a ramdisk, which is
+# then extracted with unpackbootimg and decompressed with the standard
+# tool, lz4 -dc or gzip -dc; that has to give back the ramdisk. The
+# ramdisks cover the edges of the compressor's blocks: empty, a single
+# byte, exactly 8 MiB, 8 MiB and one byte, and incompressible random
+# data. An empty ramdisk is left empty rather than compressed. The same
+# image is also built into a pipe, which makes the ramdisk twice, and has
+# to come out the same. The compressor's own options are refused without
+# a method.
+#
+# Then images built with libbootimg, through check_builder, have to be
+# byte for byte what mkbootimg makes of the same inputs, for each header
+# version, both hashes and command lines up to the longest allowed, and
+# for each way of handing the library its inputs and taking the image.
+#
+# --update has to give what a fresh build does, whether it rewrites the
+# header, a segment or the whole image. So does --cache, on a miss and on
+# a hit, while keeping its objects out of reach of later builds, and
+# --id-cache has to notice a kernel that changed where it does not
+# sample. Requests forwarded to mkbootimg --serve by mkbootimg-client have
+# to give what mkbootimg does. The shared library exports nothing but its
+# bootimg_* API.
+#
+# Needs lz4 and gzip on the PATH, and nm for the exports.
+#
+# CHECK_DIR         scratch directory (default a new one under /tmp)
+
+set -e
+
+MKBOOTIMG=${MKBOOTIMG:-./mkbootimg}
+UNPACKBOOTIMG=${UNPACKBOOTIMG:-./unpackbootimg}
+CHECK_BUILDER=${CHECK_BUILDER:-./check_builder}
+MKBOOTIMG_CLIENT=${MKBOOTIMG_CLIENT:-./mkbootimg-client}
+LIBBOOTIMG=${LIBBOOTIMG:-./libbootimg.so}
+
+server=
+scratch=
+cleanup() {
+    [ -z "$server" ] || kill "$server" 2>/dev/null || :
+    [ -z "$scratch" ] || rm -rf "$CHECK_DIR"
+}
+if [ -z "$CHECK_DIR" ]; then
+    CHECK_DIR=$(mktemp -d /tmp/bootimg-check.XXXXXX)
+    scratch=1
+fi
+trap cleanup EXIT
+trap 'exit 1' INT TERM
+mkdir -p "$CHECK_DIR"
+
+failed=0
+
+fail() {
+    echo "FAIL: $*" >&2
+    failed=1
+}
+
+# a run of text that compresses well, size bytes of it
+text() {
+    yes 'the quick brown fox jumps over the lazy dog' | head -c "$1"
+}
+
+head -c 4096 /dev/urandom >"$CHECK_DIR/kernel"
+: >"$CHECK_DIR/empty"
+printf x >"$CHECK_DIR/1"
+text 8388608 >"$CHECK_DIR/8m"
+text 8388609 >"$CHECK_DIR/8m+1"
+head -c 20000000 /dev/urandom >"$CHECK_DIR/random"
+
+for method in gzip lz4; do
+    if [ $method = gzip ]; then
+        decompress="gzip -dc"
+    else
+        decompress="lz4 -dc"
+    fi
+    for ramdisk in empty 1 8m 8m+1 random; do
+        name="$method $ramdisk"
+        img=$CHECK_DIR/boot.img
+        out=$CHECK_DIR/out
+        rm -rf "$img" "$out"
+        mkdir "$out"
+
+        if ! "$MKBOOTIMG" --kernel "$CHECK_DIR/kernel" \
+                --ramdisk "$CHECK_DIR/$ramdisk" --ramdisk-compress $method \
+                -o "$img"; then
+            fail "$name: mkbootimg failed"
+            continue
+        fi
+        if ! "$MKBOOTIMG" --kernel "$CHECK_DIR/kernel" \
+                --ramdisk "$CHECK_DIR/$ramdisk" --ramdisk-compress $method \
+                -o - | cmp -s - "$img"; then
+            fail "$name: the image written to a pipe differs"
+        fi
+        if ! "$UNPACKBOOTIMG" -i "$img" -o "$out" >/dev/null; then
+            fail "$name: unpackbootimg failed"
+            continue
+        fi
+
+        extracted=$out/boot.img-ramdisk.gz
+        if [ ! -s "$CHECK_DIR/$ramdisk" ]; then
+            [ -s "$extracted" ] && fail "$name: the ramdisk is not empty"
+        elif ! $decompress "$extracted" >"$CHECK_DIR/back"; then
+            fail "$name: $decompress failed"
+        elif ! cmp -s "$CHECK_DIR/back" "$CHECK_DIR/$ramdisk"; then
+            fail "$name: the ramdisk does not decompress to the input"
+        fi
+        rm -f "$CHECK_DIR/back"
+    done
+done
+
+# the compressor's settings are refused rather than ignored without
+# --ramdisk-compress, and a thread count has to be a whole number
+for opts in "--compress-level 6" "--compress-threads 2" \
+        "--ramdisk-compress gzip --compress-threads 4x"; do
+    "$MKBOOTIMG" --kernel "$CHECK_DIR/kernel" --ramdisk "$CHECK_DIR/1" \
+        $opts -o "$CHECK_DIR/boot.img" 2>/dev/null &&
+        fail "mkbootimg took $opts"
+done
+
+head -c 5000 /dev/urandom >"$CHECK_DIR/second"
+head -c 3000 /dev/urandom >"$CHECK_DIR/extra"
+
+# a command line of length bytes
+cmdline_of() {
+    head -c "$1" /dev/zero | tr '\0' c
+}
+
+# mk_image <output> and lib_image <output>: the image for the settings
+# below, with mkbootimg and with libbootimg, which takes check_builder's
+# options from lib_opts; version 3 has no second stage, extra or board
+mk_image() {
+    if [ "$version" -lt 3 ]; then
+        set -- --second "$CHECK_DIR/second" $extra "$CHECK_DIR/extra" \
+            --board check -o "$1"
+    else
+        set -- -o "$1"
+    fi
+    "$MKBOOTIMG" --kernel "$CHECK_DIR/kernel" --ramdisk "$CHECK_DIR/8m+1" \
+        --header_version "$version" --pagesize "$pagesize" --hashtype "$hash" \
+        --cmdline "$cmdline" --os_version 11.0.0 --os_patch_level 2021-06 "$@"
+}
+
+lib_image() {
+    out=$1
+    if [ "$version" -lt 3 ]; then
+        board=check
+        set -- "$CHECK_DIR/second" "$CHECK_DIR/extra"
+    else
+        board=
+        set --
+    fi
+    "$CHECK_BUILDER" $lib_opts "$out" "$version" "$pagesize" "$hash" "$board" "$cmdline" \
+        11.0.0 2021-06 "$CHECK_DIR/kernel" "$CHECK_DIR/8m+1" "$@"
+}
+
+lib_opts=
+for version in 0 1 2 3; do
+    case $version in
+        0) pagesize=2048 hash=sha1 cmdline="console=ttyS0" extra=--dt ;;
+        1) pagesize=4096 hash=sha256 cmdline=$(cmdline_of 1000) extra=--recovery_dtbo ;;
+        2) pagesize=2048 hash=sha1 cmdline=$(cmdline_of 1536) extra=--dtb ;;
+        3) pagesize=2048 hash=sha256 cmdline=$(cmdline_of 1536) extra= ;;
+    esac
+    name="libbootimg v$version"
+    rm -f "$CHECK_DIR/mk.img" "$CHECK_DIR/lib.img"
+
+    if ! mk_image "$CHECK_DIR/mk.img"; then
+        fail "$name: mkbootimg failed"
+        continue
+    fi
+    if ! lib_image "$CHECK_DIR/lib.img"; then
+        fail "$name: check_builder failed"
+        continue
+    fi
+    cmp -s "$CHECK_DIR/mk.img" "$CHECK_DIR/lib.img" ||
+        fail "$name: the image differs from mkbootimg's"
+    lib_image - | cmp -s - "$CHECK_DIR/mk.img" ||
+        fail "$name: the image written to a pipe differs from mkbootimg's"
+
+    # the other sources and write calls; a pipe reads callbacks twice
+    for lib_opts in "-s buffer" "-s callback" "-w buffer" "-w memfd" \
+            "-s callback -w buffer"; do
+        rm -f "$CHECK_DIR/lib.img"
+        lib_image "$CHECK_DIR/lib.img" &&
+            cmp -s "$CHECK_DIR/mk.img" "$CHECK_DIR/lib.img" ||
+            fail "$name: the image from check_builder $lib_opts differs from mkbootimg's"
+    done
+    lib_opts="-s callback"
+    lib_image - | cmp -s - "$CHECK_DIR/mk.img" ||
+        fail "$name: callback inputs written to a pipe differ from mkbootimg's"
+    lib_opts=
+
+    # both take the same longest command line
+    cmdline=$(cmdline_of 1537)
+    mk_image "$CHECK_DIR/mk.img" 2>/dev/null &&
+        fail "$name: mkbootimg took a command line of 1537 bytes"
+    lib_image "$CHECK_DIR/lib.img" 2>/dev/null &&
+        fail "$name: check_builder took a command line of 1537 bytes"
+done
+
+# --update: a header field changed in the header alone, a segment
+# replaced in place when it keeps its page count and the image rebuilt
+# when it does not, each image and id as a fresh build makes them
+head -c 3000 /dev/urandom >"$CHECK_DIR/ramdisk2"
+head -c 9000 /dev/urandom >"$CHECK_DIR/ramdisk3"
+updated() {
+    "$MKBOOTIMG" --kernel "$CHECK_DIR/kernel" --second "$CHECK_DIR/second" \
+        --dtb "$CHECK_DIR/extra" --header_version 2 --board check --id "$@"
+}
+for change in "header --cmdline updated" "in-place --ramdisk $CHECK_DIR/ramdisk2" \
+        "rebuild --ramdisk $CHECK_DIR/ramdisk3"; do
+    path=${change%% *}
+    opts=${change#* }
+    rm -f "$CHECK_DIR/update.img"
+    updated --ramdisk "$CHECK_DIR/extra" -o "$CHECK_DIR/update.img" >/dev/null
+    inode=$(stat -c %i "$CHECK_DIR/update.img")
+    if ! "$MKBOOTIMG" --update "$CHECK_DIR/update.img" $opts --id \
+            >"$CHECK_DIR/update.id"; then
+        fail "update $path: mkbootimg failed"
+        continue
+    fi
+    updated --ramdisk "$CHECK_DIR/extra" $opts -o "$CHECK_DIR/fresh.img" \
+        >"$CHECK_DIR/fresh.id"
+    cmp -s "$CHECK_DIR/update.img" "$CHECK_DIR/fresh.img" ||
+        fail "update $path: the image differs from a fresh build"
+    cmp -s "$CHECK_DIR/update.id" "$CHECK_DIR/fresh.id" ||
+        fail "update $path: the id differs from a fresh build"
+    if [ $path = rebuild ]; then
+        [ "$(stat -c %i "$CHECK_DIR/update.img")" != "$inode" ] ||
+            fail "update $path: the image was changed in place"
+    else
+        [ "$(stat -c %i "$CHECK_DIR/update.img")" = "$inode" ] ||
+            fail "update $path: the image was rebuilt"
+    fi
+done
+
+# --cache: a miss builds the object and a hit delivers it untouched, with
+# the same id, both as fresh builds would; an object that was changed is
+# built again, the least recently used go to keep under --cache-size, and
+# an output a hit wrote can be built over like any other
+cache=$CHECK_DIR/cache
+objects=$cache/objects
+rm -rf "$cache"
+cached() {
+    "$MKBOOTIMG" --kernel "$CHECK_DIR/kernel" --ramdisk "$CHECK_DIR/second" \
+        --cache "$cache" --id "$@"
+}
+# an object built again may get the inode of the one it replaces
+objects_stamp() {
+    stat -c '%i %y' "$objects"/*.img
+}
+"$MKBOOTIMG" --kernel "$CHECK_DIR/kernel" --ramdisk "$CHECK_DIR/second" \
+    --id -o "$CHECK_DIR/fresh.img" >"$CHECK_DIR/fresh.id"
+if ! cached -o "$CHECK_DIR/miss.img" >"$CHECK_DIR/miss.id"; then
+    fail "cache: the build that misses failed"
+else
+    stamp=$(objects_stamp)
+    inode=$(stat -c %i "$objects"/*.img)
+    cached -o "$CHECK_DIR/hit.img" >"$CHECK_DIR/hit.id" ||
+        fail "cache: the build that hits failed"
+    [ "$(objects_stamp)" = "$stamp" ] || fail "cache: a hit built the object again"
+    for run in miss hit; do
+        cmp -s "$CHECK_DIR/$run.img" "$CHECK_DIR/fresh.img" ||
+            fail "cache: the image from a $run differs from a fresh build"
+        cmp -s "$CHECK_DIR/$run.id" "$CHECK_DIR/fresh.id" ||
+            fail "cache: the id from a $run differs from a fresh build"
+        [ "$(stat -c %i "$CHECK_DIR/$run.img")" != "$inode" ] ||
+            fail "cache: the output of a $run is a link to the object"
+        [ "$(stat -c %A "$CHECK_DIR/$run.img" | cut -c3)" = w ] ||
+            fail "cache: the output of a $run is read-only"
+    done
+
+    # built over, the cached output leaves the object as it was
+    "$MKBOOTIMG" --kernel "$CHECK_DIR/kernel" --ramdisk "$CHECK_DIR/1" \
+        -o "$CHECK_DIR/hit.img" || fail "cache: could not build over a hit"
+    "$MKBOOTIMG" --kernel "$CHECK_DIR/kernel" --ramdisk "$CHECK_DIR/1" \
+        --cmdline changed --diff-write -o "$CHECK_DIR/miss.img" >/dev/null 2>&1 ||
+        fail "cache: could not --diff-write over a miss"
+    cached -o "$CHECK_DIR/hit.img" >/dev/null && cmp -s "$CHECK_DIR/hit.img" "$CHECK_DIR/fresh.img" ||
+        fail "cache: building over an output changed the object"
+
+    # changed in place, the object is not delivered again
+    obj=$(ls "$objects"/*.img)
+    chmod u+w "$obj"
+    printf 'XXXX' | dd of="$obj" bs=1 seek=2048 conv=notrunc 2>/dev/null
+    cached -o "$CHECK_DIR/hit.img" >"$CHECK_DIR/hit.id" &&
+        cmp -s "$CHECK_DIR/hit.img" "$CHECK_DIR/fresh.img" &&
+        cmp -s "$CHECK_DIR/hit.id" "$CHECK_DIR/fresh.id" ||
+        fail "cache: a changed object was delivered"
+    cmp -s "$(ls "$objects"/*.img)" "$CHECK_DIR/fresh.img" ||
+        fail "cache: a changed object was not built again"
+
+    # room for one of these images: the older goes
+    cached -o "$CHECK_DIR/hit.img" --cache-size 12K >/dev/null
+    cached -o "$CHECK_DIR/other.img" --cmdline other --cache-size 12K >/dev/null ||
+        fail "cache: the build that evicts failed"
+    [ "$(ls "$objects"/*.img | wc -l)" = 1 ] || fail "cache: nothing was evicted"
+    [ "$(ls "$objects"/*.id | wc -l)" = 1 ] || fail "cache: an evicted id was left"
+    cached -o "$CHECK_DIR/hit.img" --cmdline other --cache-size 12K >/dev/null &&
+        cmp -s "$CHECK_DIR/hit.img" "$CHECK_DIR/other.img" ||
+        fail "cache: the newest object was evicted"
+fi
+
+# --id-cache: a kernel rewritten in place, same size and only in the
+# middle, away from the samples the entry keeps, gets its new id
+idcache=$CHECK_DIR/idcache
+rm -rf "$idcache"
+mkdir "$idcache"
+cp "$CHECK_DIR/8m" "$CHECK_DIR/idkernel"
+for run in 1 2; do
+    "$MKBOOTIMG" --kernel "$CHECK_DIR/idkernel" --ramdisk "$CHECK_DIR/1" \
+        --id-cache "$idcache" --id -o "$CHECK_DIR/id.img" >"$CHECK_DIR/cached.id" ||
+        fail "id cache: mkbootimg failed"
+    "$MKBOOTIMG" --kernel "$CHECK_DIR/idkernel" --ramdisk "$CHECK_DIR/1" \
+        --id -o "$CHECK_DIR/id.img" >"$CHECK_DIR/fresh.id"
+    cmp -s "$CHECK_DIR/cached.id" "$CHECK_DIR/fresh.id" ||
+        fail "id cache: run $run gave a stale id"
+    printf 'changed' | dd of="$CHECK_DIR/idkernel" bs=1 seek=4000000 \
+        conv=notrunc 2>/dev/null
+done
+
+# --serve: mkbootimg-client's requests give what mkbootimg does when run
+# directly, for an image written to the client's stdout and for paths
+# relative to the client's working directory
+sock=$CHECK_DIR/sock
+"$MKBOOTIMG" --serve "$sock" --jobs 2 &
+server=$!
+tries=0
+while [ ! -S "$sock" ] && [ $tries -lt 50 ]; do
+    sleep 0.1
+    tries=$((tries + 1))
+done
+if [ ! -S "$sock" ]; then
+    fail "serve: the server did not start"
+else
+    "$MKBOOTIMG" --kernel "$CHECK_DIR/kernel" --ramdisk "$CHECK_DIR/second" \
+        --cmdline served -o - >"$CHECK_DIR/direct.img"
+    "$MKBOOTIMG_CLIENT" --socket "$sock" --kernel "$CHECK_DIR/kernel" \
+        --ramdisk "$CHECK_DIR/second" --cmdline served -o - >"$CHECK_DIR/served.img" ||
+        fail "serve: the request for stdout failed"
+    cmp -s "$CHECK_DIR/served.img" "$CHECK_DIR/direct.img" ||
+        fail "serve: the image written to stdout differs from mkbootimg's"
+
+    "$MKBOOTIMG" --kernel "$CHECK_DIR/kernel" --ramdisk "$CHECK_DIR/second" \
+        --second "$CHECK_DIR/1" --id -o "$CHECK_DIR/direct.img" >"$CHECK_DIR/direct.id"
+    rm -f "$CHECK_DIR/served.img"
+    case $MKBOOTIMG_CLIENT in
+        /*) client=$MKBOOTIMG_CLIENT ;;
+        */*) client=$PWD/$MKBOOTIMG_CLIENT ;;
+        *) client=$MKBOOTIMG_CLIENT ;;
+    esac
+    (cd "$CHECK_DIR" && "$client" --socket sock --kernel kernel \
+        --ramdisk second --second 1 --id -o served.img) >"$CHECK_DIR/served.id" ||
+        fail "serve: the request with relative paths failed"
+    cmp -s "$CHECK_DIR/served.img" "$CHECK_DIR/direct.img" ||
+        fail "serve: the image from relative paths differs from mkbootimg's"
+    cmp -s "$CHECK_DIR/served.id" "$CHECK_DIR/direct.id" ||
+        fail "serve: the id from relative paths differs from mkbootimg's"
+fi
+kill $server
+wait $server 2>/dev/null || :
+server=
+[ ! -e "$sock" ] || fail "serve: the socket was left behind"
+
+exports=$(nm -D --defined-only "$LIBBOOTIMG" | awk '$2 == "T" || $2 == "D" || $2 == "B" { print $3 }')
+[ -n "$exports" ] || fail "libbootimg.so exports nothing"
+for sym in $exports; do
+    case $sym in
+        bootimg_*) ;;
+        *) fail "libbootimg.so exports $sym" ;;
+    esac
+done
+
+if [ $failed != 0 ]; then
+    exit 1
+fi
+echo "all checks passed"
@@ -0,0 +1,236 @@
+/*
+ * Copyright (C) 2007 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Build an image with libbootimg, for check.sh to compare with what
+ * mkbootimg makes of the same inputs:
+ *
+ *     check_builder [-s fd|buffer|callback] [-w fd|buffer|memfd]
+ *                   <output|-> <header version> <page size> <sha1|sha256>
+ *                   <board> <cmdline> <os version> <os patch level>
+ *                   <kernel> <ramdisk> [<second|-> [<extra>]]
+ *
+ * extra is the dt for header version 0, the recovery dtbo for 1 and the
+ * dtb for 2. -s picks how the inputs are handed to the builder and -w
+ * which call writes the image, fd by default for both. An output of - is
+ * stdout, which bootimg_write_fd() writes as a stream, reading each input
+ * twice.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include "bootimg_builder.h"
+
+enum source { SOURCE_FD, SOURCE_BUFFER, SOURCE_CALLBACK };
+enum writer { WRITE_FD, WRITE_BUFFER, WRITE_MEMFD };
+
+static enum source source = SOURCE_FD;
+
+/* A callback input, read sequentially the way the builder promises: the
+ * offset only moves forward, except back to 0 for another pass. */
+struct callback_file {
+    int fd;
+    uint64_t pos;
+};
+
+static ssize_t read_callback(void *opaque, void *buf, size_t len, uint64_t offset)
+{
+    struct callback_file *f = opaque;
+    ssize_t n;
+
+    if(offset != f->pos) {
+        if(offset != 0 || lseek(f->fd, 0, SEEK_SET)) {
+            fprintf(stderr, "error: callback read at %llu after %llu\n",
+                    (unsigned long long)offset, (unsigned long long)f->pos);
+            errno = EINVAL;
+            return -1;
+        }
+        f->pos = 0;
+    }
+    n = read(f->fd, buf, len);
+    if(n > 0) f->pos += n;
+    return n;
+}
+
+static int set_file(struct bootimg_builder *b, enum bootimg_segment seg,
+                    const char *fn)
+{
+    struct callback_file *f;
+    struct stat st;
+    void *data;
+    int fd = open(fn, O_RDONLY);
+
+    if(fd < 0 || fstat(fd, &st)) {
+        fprintf(stderr, "error: could not open '%s'\n", fn);
+        exit(1);
+    }
+    /* everything is left open or allocated until exit, as the builder
+     * reads it when writing */
+    switch(source) {
+        case SOURCE_BUFFER:
+            data = malloc(st.st_size ? st.st_size : 1);
+            if(data == NULL || read(fd, data, st.st_size) != st.st_size) {
+                fprintf(stderr, "error: could not read '%s'\n", fn);
+                exit(1);
+            }
+            close(fd);
+            return bootimg_set_buffer(b, seg, data, st.st_size);
+        case SOURCE_CALLBACK:
+            f = calloc(1, sizeof(*f));
+            if(f == NULL) {
+                fprintf(stderr, "error: out of memory\n");
+                exit(1);
+            }
+            f->fd = fd;
+            return bootimg_set_callback(b, seg, read_callback, f, st.st_size);
+        default:
+            return bootimg_set_fd(b, seg, fd, 0, st.st_size);
+    }
+}
+
+static int write_all(int fd, const void *buf, size_t len)
+{
+    const char *p = buf;
+
+    while(len) {
+        ssize_t n = write(fd, p, len);
+
+        if(n < 0) {
+            if(errno == EINTR) continue;
+            return -1;
+        }
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/* Write the image with bootimg_write_buffer() or bootimg_write_memfd(),
+ * then copy it to fd. */
+static int write_copy(struct bootimg_builder *b, enum writer writer, int fd)
+{
+    uint64_t size = bootimg_image_size(b);
+    char *buf;
+    int mfd;
+    int ret = -1;
+
+    if(size == 0) {
+        return -1;
+    }
+    buf = malloc(size);
+    if(buf == NULL) {
+        fprintf(stderr, "error: out of memory\n");
+        exit(1);
+    }
+    if(writer == WRITE_BUFFER) {
+        if(bootimg_write_buffer(b, buf, size)) goto out;
+    } else {
+        mfd = bootimg_write_memfd(b, "check_builder");
+        if(mfd < 0) goto out;
+        if(read(mfd, buf, size) != (ssize_t)size) {
+            fprintf(stderr, "error: short read from the memfd\n");
+            exit(1);
+        }
+        close(mfd);
+    }
+    if(write_all(fd, buf, size)) {
+        fprintf(stderr, "error: could not write the image\n");
+        exit(1);
+    }
+    ret = 0;
+out:
+    free(buf);
+    return ret;
+}
+
+int main(int argc, char **argv)
+{
+    static const enum bootimg_segment extra[] = {
+        BOOTIMG_DT, BOOTIMG_RECOVERY_DTBO, BOOTIMG_DTB,
+    };
+    enum writer writer = WRITE_FD;
+    struct bootimg_builder *b;
+    unsigned version;
+    int fd;
+
+    while(argc > 2 && argv[1][0] == '-' && argv[1][1]) {
+        if(!strcmp(argv[1], "-s") && !strcmp(argv[2], "buffer")) {
+            source = SOURCE_BUFFER;
+        } else if(!strcmp(argv[1], "-s") && !strcmp(argv[2], "callback")) {
+            source = SOURCE_CALLBACK;
+        } else if(!strcmp(argv[1], "-w") && !strcmp(argv[2], "buffer")) {
+            writer = WRITE_BUFFER;
+        } else if(!strcmp(argv[1], "-w") && !strcmp(argv[2], "memfd")) {
+            writer = WRITE_MEMFD;
+        } else if(strcmp(argv[2], "fd")) {
+            fprintf(stderr, "error: unknown option %s %s\n", argv[1], argv[2]);
+            return 1;
+        }
+        argc -= 2;
+        argv += 2;
+    }
+    if(argc < 11 || argc > 13) {
+        fprintf(stderr, "usage: check_builder [-s fd|buffer|callback] "
+                "[-w fd|buffer|memfd] <output|-> <header version> "
+                "<page size> <sha1|sha256> <board> <cmdline> <os version> "
+                "<os patch level> <kernel> <ramdisk> [<second|-> [<extra>]]\n");
+        return 1;
+    }
+    version = strtoul(argv[2], 0, 10);
+
+    b = bootimg_builder_new();
+    if(b == NULL) {
+        fprintf(stderr, "error: out of memory\n");
+        return 1;
+    }
+    if(bootimg_set_header_version(b, version) ||
+       bootimg_set_page_size(b, strtoul(argv[3], 0, 10)) ||
+       bootimg_set_hash(b, strcmp(argv[4], "sha256") ? BOOTIMG_SHA1 : BOOTIMG_SHA256) ||
+       bootimg_set_board(b, argv[5]) ||
+       bootimg_set_cmdline(b, argv[6]) ||
+       bootimg_set_os_version(b, bootimg_parse_os_version(argv[7]),
+                              bootimg_parse_os_patch_level(argv[8])) ||
+       set_file(b, BOOTIMG_KERNEL, argv[9]) ||
+       set_file(b, BOOTIMG_RAMDISK, argv[10]) ||
+       (argc > 11 && strcmp(argv[11], "-") && set_file(b, BOOTIMG_SECOND, argv[11])) ||
+       (argc > 12 && set_file(b, extra[version < 2 ? version : 2], argv[12]))) {
+        fprintf(stderr, "error: %s\n", bootimg_error(b));
+        return 1;
+    }
+
+    if(!strcmp(argv[1], "-")) {
+        fd = STDOUT_FILENO;
+    } else {
+        fd = open(argv[1], O_CREAT | O_TRUNC | O_WRONLY, 0644);
+        if(fd < 0) {
+            fprintf(stderr, "error: could not create '%s'\n", argv[1]);
+            return 1;
+        }
+    }
+    if((writer == WRITE_FD ? bootimg_write_fd(b, fd) : write_copy(b, writer, fd)) ||
+       close(fd)) {
+        fprintf(stderr, "error: %s\n", bootimg_error(b));
+        return 1;
+    }
+    bootimg_builder_free(b);
+    return 0;
+}
@@ -0,0 +1,531 @@
+/*
+ * Copyright (C) 2007 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <zlib.h>
+
+#include "compress.h"
+
+#define GZIP_BLOCK_SIZE (128 * 1024)
+#define GZIP_DICT_SIZE (32 * 1024)
+/* blocks compressed ahead of the one being written, per thread */
+#define GZIP_WINDOW 4
+
+#define LZ4_LEGACY_MAGIC 0x184c2102
+#define LZ4_BLOCK_SIZE (8 * 1024 * 1024)
+#define LZ4_HASH_LOG 16
+#define LZ4_MIN_MATCH 4
+#define LZ4_MAX_OFFSET 65535
+#define LZ4_MF_LIMIT 12     /* no match starts in the last 12 bytes */
+#define LZ4_LAST_LITERALS 5 /* and the last 5 are always literals */
+
+#define COMPRESS_MAX_THREADS 64
+
+struct compressor;
+
+struct block {
+    uint8_t *out;
+    size_t len;         /* of out */
+    uint32_t crc;       /* of the input, for gzip */
+    bool done;
+};
+
+/* How one method cuts up and compresses its input. */
+struct compress_ops {
+    size_t block_size;
+    size_t dict_size;   /* of the input before a block that it may refer to */
+    void *(*start)(struct compressor *c);
+    void (*stop)(void *state);
+    /* Compress the len bytes at in + dict into b->out. */
+    int (*block)(struct compressor *c, void *state, const uint8_t *in,
+                 size_t dict, size_t len, bool last, struct block *b);
+};
+
+/* Workers take blocks in order, no further ahead of the writer than the
+ * window, and the writer collects them in order and hands them on. */
+struct compressor {
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    const struct compress_ops *ops;
+    const struct compress_input *in;
+    unsigned count;
+    uint64_t total;
+    int level;
+    struct block *blocks;
+    size_t nblocks;
+    size_t next;        /* next block to compress */
+    size_t written;     /* blocks the writer is done with */
+    size_t window;
+    int (*write)(void *arg, const void *buf, size_t len);
+    void *arg;
+    uint64_t pos;       /* bytes written */
+    bool failed;
+    char msg[256];
+};
+
+static void fail(struct compressor *c, const char *fmt, const char *arg)
+{
+    pthread_mutex_lock(&c->lock);
+    if(!c->failed) {
+        snprintf(c->msg, sizeof(c->msg), fmt, arg);
+        c->failed = true;
+    }
+    pthread_cond_broadcast(&c->wake);
+    pthread_mutex_unlock(&c->lock);
+}
+
+/* Read len bytes at offset of the inputs taken as one. */
+static int read_inputs(const struct compressor *c, uint8_t *buf, size_t len,
+                       uint64_t offset)
+{
+    unsigned i = 0;
+
+    while(len > 0) {
+        ssize_t n;
+
+        while(offset >= c->in[i].size) {
+            offset -= c->in[i].size;
+            i++;
+        }
+        n = len < c->in[i].size - offset ? len : c->in[i].size - offset;
+        if(c->in[i].read) {
+            if(c->in[i].read(c->in[i].arg, buf, n, offset)) return -1;
+        } else {
+            n = pread(c->in[i].fd, buf, n, offset);
+        }
+        if(n < 0 && errno == EINTR) continue;
+        if(n <= 0) {
+            if(n == 0) errno = EIO;
+            return -1;
+        }
+        buf += n;
+        len -= n;
+        offset += n;
+    }
+    return 0;
+}
+
+static void *gzip_start(struct compressor *c)
+{
+    z_stream *s = calloc(1, sizeof(*s));
+
+    if(s && deflateInit2(s, c->level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        free(s);
+        s = NULL;
+    }
+    return s;
+}
+
+static void gzip_stop(void *state)
+{
+    deflateEnd(state);
+    free(state);
+}
+
+static int gzip_block(struct compressor *c, void *state, const uint8_t *in,
+                      size_t dict, size_t len, bool last, struct block *b)
+{
+    z_stream *s = state;
+    size_t bound;
+    int ret;
+
+    (void)c;
+    if(deflateReset(s) != Z_OK ||
+       (dict && deflateSetDictionary(s, in, dict) != Z_OK)) {
+        return -1;
+    }
+    /* room for the empty stored block a sync flush ends with */
+    bound = deflateBound(s, len) + 16;
+    b->out = malloc(bound);
+    if(b->out == NULL) return -1;
+    s->next_in = (uint8_t *)in + dict;
+    s->avail_in = len;
+    s->next_out = b->out;
+    s->avail_out = bound;
+    /* every block but the last ends on a byte boundary without the final
+     * bit set, so the raw streams join into one */
+    ret = deflate(s, last ? Z_FINISH : Z_SYNC_FLUSH);
+    if(ret != (last ? Z_STREAM_END : Z_OK) || s->avail_in != 0) {
+        return -1;
+    }
+    b->len = bound - s->avail_out;
+    b->crc = crc32(0, in + dict, len);
+    return 0;
+}
+
+static const struct compress_ops gzip_ops = {
+    GZIP_BLOCK_SIZE, GZIP_DICT_SIZE, gzip_start, gzip_stop, gzip_block,
+};
+
+static void *lz4_start(struct compressor *c)
+{
+    (void)c;
+    return malloc(sizeof(uint32_t) << LZ4_HASH_LOG);
+}
+
+static uint32_t lz4_read32(const uint8_t *p)
+{
+    uint32_t v;
+
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static uint32_t lz4_hash(uint32_t v)
+{
+    return (v * 2654435761U) >> (32 - LZ4_HASH_LOG);
+}
+
+static uint8_t *lz4_put_length(uint8_t *op, size_t len)
+{
+    while(len >= 255) {
+        *op++ = 255;
+        len -= 255;
+    }
+    *op++ = len;
+    return op;
+}
+
+/* How many bytes from p on equal those from q, stopping at end. */
+static size_t lz4_count(const uint8_t *p, const uint8_t *q, const uint8_t *end)
+{
+    const uint8_t *start = p;
+
+    while(p + 8 <= end) {
+        uint64_t a, b;
+
+        memcpy(&a, p, 8);
+        memcpy(&b, q, 8);
+        if(a != b) {
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+            return p - start + (__builtin_ctzll(a ^ b) >> 3);
+#else
+            break;
+#endif
+        }
+        p += 8;
+        q += 8;
+    }
+    while(p < end && *p == *q) {
+        p++;
+        q++;
+    }
+    return p - start;
+}
+
+/* One LZ4 block, greedily taking the last position seen with the same
+ * four bytes as LZ4's fast mode does. The search skips ahead faster the
+ * longer it goes without a match, so incompressible data passes quickly. */
+static size_t lz4_compress(const uint8_t *src, size_t len, uint8_t *dst,
+                           uint32_t *table)
+{
+    const uint8_t *ip = src;
+    const uint8_t *anchor = src;
+    const uint8_t *end = src + len;
+    uint8_t *op = dst;
+    size_t litlen;
+
+    if(len > LZ4_MF_LIMIT) {
+        const uint8_t *mflimit = end - LZ4_MF_LIMIT;
+        const uint8_t *matchlimit = end - LZ4_LAST_LITERALS;
+        unsigned misses = 0;
+
+        memset(table, 0, sizeof(uint32_t) << LZ4_HASH_LOG);
+        ip++;
+        while(ip <= mflimit) {
+            uint32_t seq = lz4_read32(ip);
+            uint32_t h = lz4_hash(seq);
+            const uint8_t *ref = src + table[h];
+            size_t matchlen;
+            uint8_t *token;
+
+            table[h] = ip - src;
+            if(ref >= ip || ip - ref > LZ4_MAX_OFFSET || lz4_read32(ref) != seq) {
+                ip += 1 + (misses++ >> 6);
+                continue;
+            }
+            misses = 0;
+            while(ip > anchor && ref > src && ip[-1] == ref[-1]) {
+                ip--;
+                ref--;
+            }
+            matchlen = lz4_count(ip + LZ4_MIN_MATCH, ref + LZ4_MIN_MATCH, matchlimit);
+
+            litlen = ip - anchor;
+            token = op++;
+            *token = (litlen >= 15 ? 15 : litlen) << 4;
+            if(litlen >= 15) op = lz4_put_length(op, litlen - 15);
+            memcpy(op, anchor, litlen);
+            op += litlen;
+            *op++ = (ip - ref) & 0xff;
+            *op++ = (ip - ref) >> 8;
+            *token |= matchlen >= 15 ? 15 : matchlen;
+            if(matchlen >= 15) op = lz4_put_length(op, matchlen - 15);
+
+            ip += LZ4_MIN_MATCH + matchlen;
+            anchor = ip;
+            /* just before where the search resumes often starts a repeat */
+            if(ip <= mflimit) {
+                table[lz4_hash(lz4_read32(ip - 2))] = ip - 2 - src;
+            }
+        }
+    }
+
+    litlen = end - anchor;
+    *op++ = (litlen >= 15 ? 15 : litlen) << 4;
+    if(litlen >= 15) op = lz4_put_length(op, litlen - 15);
+    memcpy(op, anchor, litlen);
+    op += litlen;
+    return op - dst;
+}
+
+/* A legacy frame block: its compressed size, then the data. */
+static int lz4_block(struct compressor *c, void *state, const uint8_t *in,
+                     size_t dict, size_t len, bool last, struct block *b)
+{
+    size_t n;
+
+    (void)c;
+    (void)dict;
+    (void)last;
+    b->out = malloc(4 + len + len / 255 + 16);
+    if(b->out == NULL) return -1;
+    n = lz4_compress(in, len, b->out + 4, state);
+    b->out[0] = n;
+    b->out[1] = n >> 8;
+    b->out[2] = n >> 16;
+    b->out[3] = n >> 24;
+    b->len = 4 + n;
+    return 0;
+}
+
+static const struct compress_ops lz4_ops = {
+    LZ4_BLOCK_SIZE, 0, lz4_start, free, lz4_block,
+};
+
+static void *compress_thread(void *arg)
+{
+    struct compressor *c = arg;
+    const struct compress_ops *ops = c->ops;
+    uint8_t *in = malloc(ops->dict_size + ops->block_size);
+    void *state = in ? ops->start(c) : NULL;
+
+    if(state == NULL) {
+        free(in);
+        fail(c, "%s", "out of memory");
+        return NULL;
+    }
+    for(;;) {
+        struct block *b;
+        uint64_t start;
+        size_t dict, len;
+        size_t i;
+
+        pthread_mutex_lock(&c->lock);
+        while(!c->failed && c->next < c->nblocks &&
+              c->next >= c->written + c->window) {
+            pthread_cond_wait(&c->wake, &c->lock);
+        }
+        if(c->failed || c->next == c->nblocks) {
+            pthread_mutex_unlock(&c->lock);
+            break;
+        }
+        i = c->next++;
+        pthread_mutex_unlock(&c->lock);
+
+        b = &c->blocks[i];
+        start = (uint64_t)i * ops->block_size;
+        dict = start < ops->dict_size ? start : ops->dict_size;
+        len = c->total - start < ops->block_size ? c->total - start : ops->block_size;
+        if(read_inputs(c, in, dict + len, start - dict)) {
+            fail(c, "could not read the ramdisk: %s", strerror(errno));
+            break;
+        }
+        if(ops->block(c, state, in, dict, len, i + 1 == c->nblocks, b)) {
+            fail(c, "%s", "compression failed");
+            break;
+        }
+
+        pthread_mutex_lock(&c->lock);
+        b->done = true;
+        pthread_cond_broadcast(&c->wake);
+        pthread_mutex_unlock(&c->lock);
+    }
+    ops->stop(state);
+    free(in);
+    return NULL;
+}
+
+static int write_out(struct compressor *c, const void *buf, size_t len)
+{
+    if(c->write(c->arg, buf, len)) return -1;
+    c->pos += len;
+    return 0;
+}
+
+/* Run the workers, writing head, the blocks in order and, for gzip, the
+ * trailer. */
+static int run_compressor(struct compressor *c, unsigned threads,
+                          const uint8_t *head, size_t head_len,
+                          uint64_t *size, char *err, size_t errlen)
+{
+    pthread_t tids[COMPRESS_MAX_THREADS];
+    uint32_t crc = crc32(0, NULL, 0);
+    unsigned n;
+    size_t i;
+    int ret = -1;
+
+    c->nblocks = (c->total + c->ops->block_size - 1) / c->ops->block_size;
+    if(c->nblocks == 0) c->nblocks = 1;
+    c->blocks = calloc(c->nblocks, sizeof(*c->blocks));
+    if(c->blocks == NULL) {
+        snprintf(err, errlen, "out of memory");
+        return -1;
+    }
+
+    for(n = 0; n < threads; n++) {
+        if(pthread_create(&tids[n], NULL, compress_thread, c)) break;
+    }
+    if(n == 0) {
+        snprintf(c->msg, sizeof(c->msg), "could not start a thread");
+        c->failed = true;
+    }
+
+    if(write_out(c, head, head_len)) {
+        fail(c, "could not write the ramdisk: %s", strerror(errno));
+    }
+    for(i = 0; i < c->nblocks; i++) {
+        struct block *b = &c->blocks[i];
+        uint64_t len = i + 1 < c->nblocks ? c->ops->block_size :
+                       c->total - (uint64_t)i * c->ops->block_size;
+        bool failed;
+
+        pthread_mutex_lock(&c->lock);
+        while(!c->failed && !b->done) {
+            pthread_cond_wait(&c->wake, &c->lock);
+        }
+        failed = c->failed;
+        pthread_mutex_unlock(&c->lock);
+        if(failed) break;
+
+        if(write_out(c, b->out, b->len)) {
+            fail(c, "could not write the ramdisk: %s", strerror(errno));
+            break;
+        }
+        if(c->ops == &gzip_ops) {
+            crc = crc32_combine(crc, b->crc, len);
+        }
+        free(b->out);
+        b->out = NULL;
+
+        pthread_mutex_lock(&c->lock);
+        c->written++;
+        pthread_cond_broadcast(&c->wake);
+        pthread_mutex_unlock(&c->lock);
+    }
+    for(i = 0; i < n; i++) {
+        pthread_join(tids[i], NULL);
+    }
+    if(c->failed) {
+        snprintf(err, errlen, "%s", c->msg);
+        goto out;
+    }
+
+    if(c->ops == &gzip_ops) {
+        uint8_t tail[8];
+
+        for(i = 0; i < 4; i++) {
+            tail[i] = crc >> (8 * i);
+            tail[4 + i] = c->total >> (8 * i);  /* the size modulo 2^32 */
+        }
+        if(write_out(c, tail, sizeof(tail))) {
+            snprintf(err, errlen, "could not write the ramdisk: %s", strerror(errno));
+            goto out;
+        }
+    }
+    *size = c->pos;
+    ret = 0;
+out:
+    for(i = 0; i < c->nblocks; i++) {
+        free(c->blocks[i].out);
+    }
+    free(c->blocks);
+    return ret;
+}
+
+int compress_inputs(enum compress_method method, int level, unsigned threads,
+                    const struct compress_input *in, unsigned count,
+                    int (*write)(void *arg, const void *buf, size_t len), void *arg,
+                    uint64_t *size, char *err, size_t errlen)
+{
+    uint8_t gzip_head[10] = { 0x1f, 0x8b, Z_DEFLATED, 0, 0, 0, 0, 0, 0, 3 /* Unix */ };
+    const uint8_t lz4_head[4] = {
+        LZ4_LEGACY_MAGIC & 0xff, (LZ4_LEGACY_MAGIC >> 8) & 0xff,
+        (LZ4_LEGACY_MAGIC >> 16) & 0xff, LZ4_LEGACY_MAGIC >> 24,
+    };
+    struct compressor c;
+    unsigned i;
+    int ret = -1;
+
+    memset(&c, 0, sizeof(c));
+    pthread_mutex_init(&c.lock, NULL);
+    pthread_cond_init(&c.wake, NULL);
+    c.in = in;
+    c.count = count;
+    c.write = write;
+    c.arg = arg;
+    for(i = 0; i < count; i++) {
+        c.total += in[i].size;
+    }
+
+    if(threads == 0) {
+        long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+
+        threads = ncpu > 0 ? ncpu : 1;
+    }
+    if(threads > COMPRESS_MAX_THREADS) threads = COMPRESS_MAX_THREADS;
+
+    switch(method) {
+    case COMPRESS_GZIP:
+        c.ops = &gzip_ops;
+        c.level = level < 0 ? 6 : level;
+        c.window = threads * GZIP_WINDOW;
+        gzip_head[8] = c.level == 9 ? 2 : c.level == 1 ? 4 : 0;
+        ret = run_compressor(&c, threads, gzip_head, sizeof(gzip_head),
+                             size, err, errlen);
+        break;
+    case COMPRESS_LZ4:
+        /* the blocks are large, so at most one waiting per thread */
+        c.ops = &lz4_ops;
+        c.window = threads + 1;
+        ret = run_compressor(&c, threads, lz4_head, sizeof(lz4_head),
+                             size, err, errlen);
+        break;
+    default:
+        snprintf(err, errlen, "unsupported compression");
+        break;
+    }
+
+    pthread_cond_destroy(&c.wake);
+    pthread_mutex_destroy(&c.lock);
+    return ret;
+}
@@ -0,0 +1,63 @@
+/*
+ * Copyright (C) 2007 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+enum compress_method {
+    COMPRESS_UNKNOWN = -1,
+    COMPRESS_NONE = 0,
+    COMPRESS_GZIP,
+    COMPRESS_LZ4,
+};
+
+/* One piece of the data to compress, read with pread from offset 0 of
+ * fd, or with read when it is set. read may be called from several
+ * threads at once and returns 0, or -1 with errno set. */
+struct compress_input {
+    int fd;
+    uint64_t size;
+    int (*read)(void *arg, void *buf, size_t len, uint64_t offset);
+    void *arg;
+};
+
+/* Compress the inputs, one after the other, into a single stream handed
+ * to write in order as it comes, on up to threads threads (0 for one per
+ * CPU). Only a few blocks per thread are held at a time, so the memory
+ * taken does not grow with the data. write returns 0, or -1 with errno
+ * set, which stops the compression.
+ *
+ * gzip is done as pigz does it: the data is cut into blocks that are
+ * deflated independently, each primed with the 32K before it, and joined
+ * in order into one deflate stream under one gzip header, with the CRC
+ * of the whole combined from the blocks'. level is 1 to 9, or -1 for the
+ * default of 6.
+ *
+ * lz4 is the legacy frame the kernel and lz4 -l use: a magic number, then
+ * 8M blocks compressed independently, each after its compressed size.
+ * There are no levels.
+ *
+ * Either way the output depends only on the data and the level, not on
+ * the number of threads.
+ *
+ * Returns 0 with the compressed size in *size, or -1 with the reason in
+ * err. */
+int compress_inputs(enum compress_method method, int level, unsigned threads,
+                    const struct compress_input *in, unsigned count,
+                    int (*write)(void *arg, const void *buf, size_t len), void *arg,
+                    uint64_t *size, char *err, size_t errlen);
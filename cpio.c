@@ -0,0 +1,557 @@
+/*
+ * Copyright (C) 2007 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <limits.h>
+#include <pthread.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+
+#include "cpio.h"
+
+#define CPIO_MAGIC "070701"
+#define CPIO_HEADER_SIZE 110
+#define CPIO_TRAILER "TRAILER!!!"
+#define CPIO_FIRST_INO 300000
+#define CPIO_MAX_THREADS 16
+/* room for a message about a path and a name in it, and why */
+#define CPIO_MSG_SIZE (PATH_MAX + NAME_MAX + 64)
+
+#define ALIGN4(n) (((n) + 3) & ~(uint64_t)3)
+
+struct entry {
+    char *path;         /* relative to the root, without a leading slash */
+    char *link;         /* target of a symbolic link */
+    mode_t mode;
+    dev_t rdev;
+    uint64_t size;      /* of the data after the header */
+    uint64_t offset;    /* of the header in the archive */
+};
+
+/* The scan fills entries from a stack of directories still to be read,
+ * on several threads. Once they are sorted and laid out, the archive is
+ * made on demand by cpio_read(), while prefetch threads pull the files
+ * into the page cache ahead of it in archive order. */
+struct cpio_archive {
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    int root;
+    const char **dirs;
+    size_t ndirs;
+    size_t adirs;
+    unsigned scanning;  /* threads reading a directory */
+    struct entry *entries;  /* the last is the trailer */
+    size_t count;
+    size_t alloc;
+    uint64_t size;
+    uint32_t mtime;
+    size_t next;        /* next entry to prefetch */
+    bool stop;          /* prefetching is no longer wanted */
+    pthread_t prefetchers[CPIO_MAX_THREADS];
+    unsigned nprefetchers;
+    bool failed;
+    char err[CPIO_MSG_SIZE];
+};
+
+static void free_entries(struct entry *entries, size_t count)
+{
+    size_t i;
+
+    for(i = 0; i < count; i++) {
+        free(entries[i].path);
+        free(entries[i].link);
+    }
+    free(entries);
+}
+
+/* Keep the first failure; called with the lock held. */
+static void fail_locked(struct cpio_archive *p, const char *msg)
+{
+    if(!p->failed) {
+        snprintf(p->err, sizeof(p->err), "%s", msg);
+        p->failed = true;
+    }
+    pthread_cond_broadcast(&p->wake);
+}
+
+static char *read_link(int dirfd, const char *name, off_t hint)
+{
+    size_t len = hint > 0 ? (size_t)hint : PATH_MAX;
+    char *buf = malloc(len + 1);
+    ssize_t n;
+
+    if(buf == NULL) return NULL;
+    n = readlinkat(dirfd, name, buf, len + 1);
+    if(n < 0 || (size_t)n > len) {
+        if(n >= 0) errno = EAGAIN;  /* changed since it was stat'ed */
+        free(buf);
+        return NULL;
+    }
+    buf[n] = '\0';
+    return buf;
+}
+
+/* Read the directory rel into a new array of entries. */
+static int scan_dir(struct cpio_archive *p, const char *rel, struct entry **found,
+                    size_t *count, char *msg, size_t msglen)
+{
+    const char *shown = *rel ? rel : ".";
+    size_t alloc = 0;
+    struct dirent *de;
+    DIR *d;
+    int fd;
+
+    *found = NULL;
+    *count = 0;
+    fd = openat(p->root, shown, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if(fd < 0 || (d = fdopendir(fd)) == NULL) {
+        snprintf(msg, msglen, "could not open '%s': %s", shown, strerror(errno));
+        if(fd >= 0) close(fd);
+        return -1;
+    }
+    for(;;) {
+        struct stat st;
+        struct entry *e;
+
+        errno = 0;
+        de = readdir(d);
+        if(de == NULL) {
+            if(errno == 0) break;
+            snprintf(msg, msglen, "could not read '%s': %s", shown, strerror(errno));
+            goto fail;
+        }
+        if(!strcmp(de->d_name, ".") || !strcmp(de->d_name, "..")) continue;
+
+        if(fstatat(dirfd(d), de->d_name, &st, AT_SYMLINK_NOFOLLOW)) {
+            snprintf(msg, msglen, "could not stat '%s/%s': %s",
+                     shown, de->d_name, strerror(errno));
+            goto fail;
+        }
+        if(S_ISSOCK(st.st_mode)) continue;
+
+        if(*count == alloc) {
+            size_t n = alloc ? alloc * 2 : 64;
+            struct entry *grown = realloc(*found, n * sizeof(**found));
+
+            if(grown == NULL) goto oom;
+            *found = grown;
+            alloc = n;
+        }
+        e = &(*found)[(*count)++];
+        memset(e, 0, sizeof(*e));
+        e->mode = st.st_mode;
+        e->rdev = st.st_rdev;
+        if(asprintf(&e->path, "%s%s%s", rel, *rel ? "/" : "", de->d_name) < 0) {
+            e->path = NULL;
+            goto oom;
+        }
+        if(S_ISREG(st.st_mode)) {
+            e->size = st.st_size;
+        } else if(S_ISLNK(st.st_mode)) {
+            e->link = read_link(dirfd(d), de->d_name, st.st_size);
+            if(e->link == NULL) {
+                snprintf(msg, msglen, "could not read link '%s': %s",
+                         e->path, strerror(errno));
+                goto fail;
+            }
+            e->size = strlen(e->link);
+        }
+    }
+    closedir(d);
+    return 0;
+
+oom:
+    snprintf(msg, msglen, "out of memory reading '%s'", shown);
+fail:
+    closedir(d);
+    free_entries(*found, *count);
+    *found = NULL;
+    *count = 0;
+    return -1;
+}
+
+/* Add what one directory held, queueing its subdirectories; called with
+ * the lock held. */
+static int add_entries(struct cpio_archive *p, struct entry *found, size_t count)
+{
+    size_t i;
+
+    if(p->count + count > p->alloc) {
+        size_t n = p->alloc ? p->alloc : 256;
+        struct entry *grown;
+
+        while(n < p->count + count) n *= 2;
+        grown = realloc(p->entries, n * sizeof(*grown));
+        if(grown == NULL) return -1;
+        p->entries = grown;
+        p->alloc = n;
+    }
+    for(i = 0; i < count; i++) {
+        if(!S_ISDIR(found[i].mode)) continue;
+        if(p->ndirs == p->adirs) {
+            size_t n = p->adirs ? p->adirs * 2 : 64;
+            const char **grown = realloc(p->dirs, n * sizeof(*grown));
+
+            if(grown == NULL) return -1;
+            p->dirs = grown;
+            p->adirs = n;
+        }
+        p->dirs[p->ndirs++] = found[i].path;
+    }
+    memcpy(p->entries + p->count, found, count * sizeof(*found));
+    p->count += count;
+    return 0;
+}
+
+static void *scan_thread(void *arg)
+{
+    struct cpio_archive *p = arg;
+    char msg[CPIO_MSG_SIZE];
+
+    pthread_mutex_lock(&p->lock);
+    for(;;) {
+        struct entry *found;
+        size_t count;
+        const char *rel;
+        int ret;
+
+        while(p->ndirs == 0 && p->scanning > 0 && !p->failed) {
+            pthread_cond_wait(&p->wake, &p->lock);
+        }
+        if(p->failed || p->ndirs == 0) break;
+
+        rel = p->dirs[--p->ndirs];
+        p->scanning++;
+        pthread_mutex_unlock(&p->lock);
+
+        ret = scan_dir(p, rel, &found, &count, msg, sizeof(msg));
+
+        pthread_mutex_lock(&p->lock);
+        p->scanning--;
+        if(ret == 0 && add_entries(p, found, count)) {
+            free_entries(found, count);
+            snprintf(msg, sizeof(msg), "out of memory");
+            ret = -1;
+        } else {
+            free(found);
+        }
+        if(ret) fail_locked(p, msg);
+        pthread_cond_broadcast(&p->wake);
+    }
+    pthread_cond_broadcast(&p->wake);
+    pthread_mutex_unlock(&p->lock);
+    return NULL;
+}
+
+/* Bytewise, except that '/' sorts before any other character, which puts
+ * every directory's contents right after it in name order. */
+static int entry_cmp(const void *a, const void *b)
+{
+    const unsigned char *x = (const unsigned char *)((const struct entry *)a)->path;
+    const unsigned char *y = (const unsigned char *)((const struct entry *)b)->path;
+
+    while(*x && *x == *y) {
+        x++;
+        y++;
+    }
+    return (*x == '/' ? 1 : *x) - (*y == '/' ? 1 : *y);
+}
+
+/* The header and name of entry i, in the newc format, which comes to
+ * CPIO_HEADER_SIZE + strlen(path) + 1 bytes before the padding. */
+static void format_header(const struct cpio_archive *p, size_t i, char *at)
+{
+    const struct entry *e = &p->entries[i];
+    bool trailer = i + 1 == p->count;
+
+    /* ino mode uid gid nlink mtime filesize devmajor devminor rdevmajor
+     * rdevminor namesize check */
+    snprintf(at, CPIO_HEADER_SIZE + 1,
+             CPIO_MAGIC "%08x%08x%08x%08x%08x%08x%08x%08x%08x%08x%08x%08x%08x",
+             trailer ? 0 : CPIO_FIRST_INO + (uint32_t)i, (uint32_t)e->mode, 0, 0, 1,
+             trailer ? 0 : p->mtime, (uint32_t)e->size, 0, 0,
+             (uint32_t)major(e->rdev), (uint32_t)minor(e->rdev),
+             (uint32_t)strlen(e->path) + 1, 0);
+}
+
+static uint64_t header_size(const struct entry *e)
+{
+    return ALIGN4(CPIO_HEADER_SIZE + strlen(e->path) + 1);
+}
+
+/* Read len bytes at off of a regular file's data. Reaching its end, make
+ * sure it has not grown since the scan either. */
+static int read_file(struct cpio_archive *p, const struct entry *e, uint8_t *buf,
+                     size_t len, uint64_t off)
+{
+    char msg[CPIO_MSG_SIZE];
+    bool end = off + len == e->size;
+    char extra;
+    int fd;
+
+    fd = openat(p->root, e->path, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+    if(fd < 0) {
+        snprintf(msg, sizeof(msg), "could not open '%s': %s", e->path, strerror(errno));
+        goto fail;
+    }
+    while(len > 0) {
+        ssize_t n = pread(fd, buf, len, off);
+
+        if(n < 0 && errno == EINTR) continue;
+        if(n <= 0) {
+            snprintf(msg, sizeof(msg), "could not read '%s': %s", e->path,
+                     n < 0 ? strerror(errno) : "file changed while packing");
+            goto fail;
+        }
+        buf += n;
+        len -= n;
+        off += n;
+    }
+    if(end && pread(fd, &extra, 1, off) > 0) {
+        snprintf(msg, sizeof(msg), "could not read '%s': file changed while packing",
+                 e->path);
+        goto fail;
+    }
+    close(fd);
+    return 0;
+
+fail:
+    if(fd >= 0) close(fd);
+    pthread_mutex_lock(&p->lock);
+    fail_locked(p, msg);
+    pthread_mutex_unlock(&p->lock);
+    return -1;
+}
+
+int cpio_read(struct cpio_archive *p, void *buf, size_t len, uint64_t offset)
+{
+    uint8_t *out = buf;
+    size_t lo = 0, hi = p->count;
+
+    if(offset > p->size || len > p->size - offset) {
+        pthread_mutex_lock(&p->lock);
+        fail_locked(p, "read past the end of the archive");
+        pthread_mutex_unlock(&p->lock);
+        return -1;
+    }
+
+    /* the last entry that starts at or before offset */
+    while(hi - lo > 1) {
+        size_t mid = lo + (hi - lo) / 2;
+
+        if(p->entries[mid].offset <= offset) lo = mid;
+        else hi = mid;
+    }
+
+    while(len > 0) {
+        const struct entry *e = &p->entries[lo];
+        uint64_t pos = offset - e->offset;
+        uint64_t hsz = header_size(e);
+        uint64_t end = hsz + ALIGN4(e->size);
+        size_t n;
+
+        if(pos >= end) {
+            lo++;
+            continue;
+        }
+        if(pos < hsz) {
+            char head[CPIO_HEADER_SIZE + 1];
+            size_t namesize = strlen(e->path) + 1;
+            size_t k;
+
+            n = len < hsz - pos ? len : hsz - pos;
+            format_header(p, lo, head);
+            /* the header, the name with its NUL and zeros up to hsz */
+            for(k = 0; k < n; k++) {
+                uint64_t at = pos + k;
+
+                out[k] = at < CPIO_HEADER_SIZE ? head[at] :
+                         at < CPIO_HEADER_SIZE + namesize ?
+                         e->path[at - CPIO_HEADER_SIZE] : 0;
+            }
+        } else if(pos < hsz + e->size) {
+            n = len < hsz + e->size - pos ? len : hsz + e->size - pos;
+            if(e->link) {
+                memcpy(out, e->link + (pos - hsz), n);
+            } else if(read_file(p, e, out, n, pos - hsz)) {
+                return -1;
+            }
+        } else {
+            n = len < end - pos ? len : end - pos;
+            memset(out, 0, n);
+        }
+        out += n;
+        len -= n;
+        offset += n;
+    }
+    return 0;
+}
+
+const char *cpio_error(struct cpio_archive *p)
+{
+    const char *err;
+
+    pthread_mutex_lock(&p->lock);
+    err = p->failed ? p->err : "";
+    pthread_mutex_unlock(&p->lock);
+    return err;
+}
+
+static void *prefetch_thread(void *arg)
+{
+    struct cpio_archive *p = arg;
+
+    while(!__atomic_load_n(&p->stop, __ATOMIC_RELAXED)) {
+        size_t i = __atomic_fetch_add(&p->next, 1, __ATOMIC_RELAXED);
+        const struct entry *e;
+        int fd;
+
+        if(i >= p->count) break;
+        e = &p->entries[i];
+        if(!S_ISREG(e->mode) || e->size == 0) continue;
+        fd = openat(p->root, e->path, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+        if(fd < 0) continue;    /* reported when it is read */
+#ifdef __linux__
+        readahead(fd, 0, e->size);
+#elif defined(POSIX_FADV_WILLNEED)
+        posix_fadvise(fd, 0, e->size, POSIX_FADV_WILLNEED);
+#endif
+        close(fd);
+    }
+    return NULL;
+}
+
+/* Run fn on the calling thread and up to threads - 1 others. */
+static void run_threads(void *(*fn)(void *), struct cpio_archive *p, unsigned threads)
+{
+    pthread_t tids[CPIO_MAX_THREADS];
+    unsigned i, n;
+
+    for(n = 0; n + 1 < threads; n++) {
+        if(pthread_create(&tids[n], NULL, fn, p)) break;
+    }
+    fn(p);
+    for(i = 0; i < n; i++) {
+        pthread_join(tids[i], NULL);
+    }
+}
+
+void cpio_close(struct cpio_archive *p)
+{
+    unsigned i;
+
+    if(p == NULL) return;
+    __atomic_store_n(&p->stop, true, __ATOMIC_RELAXED);
+    for(i = 0; i < p->nprefetchers; i++) {
+        pthread_join(p->prefetchers[i], NULL);
+    }
+    if(p->root >= 0) close(p->root);
+    free(p->dirs);
+    free_entries(p->entries, p->count);
+    pthread_cond_destroy(&p->wake);
+    pthread_mutex_destroy(&p->lock);
+    free(p);
+}
+
+struct cpio_archive *cpio_open_dir(const char *dir, uint64_t mtime, unsigned threads,
+                                   uint64_t *size, char *err, size_t errlen)
+{
+    struct cpio_archive *p;
+    struct entry *trailer;
+    uint64_t total = 0;
+    size_t i;
+
+    p = calloc(1, sizeof(*p));
+    if(p == NULL) {
+        snprintf(err, errlen, "out of memory");
+        return NULL;
+    }
+    pthread_mutex_init(&p->lock, NULL);
+    pthread_cond_init(&p->wake, NULL);
+    p->mtime = mtime;
+
+    if(threads == 0) {
+        long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+
+        threads = ncpu > 0 ? ncpu : 1;
+    }
+    if(threads > CPIO_MAX_THREADS) threads = CPIO_MAX_THREADS;
+
+    p->root = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if(p->root < 0) {
+        snprintf(err, errlen, "could not open '%s': %s", dir, strerror(errno));
+        goto fail;
+    }
+    p->dirs = malloc(sizeof(*p->dirs));
+    if(p->dirs == NULL) {
+        snprintf(err, errlen, "out of memory");
+        goto fail;
+    }
+    p->dirs[0] = "";
+    p->ndirs = p->adirs = 1;
+
+    run_threads(scan_thread, p, threads);
+    if(p->failed) {
+        snprintf(err, errlen, "%s", p->err);
+        goto fail;
+    }
+
+    qsort(p->entries, p->count, sizeof(*p->entries), entry_cmp);
+    trailer = realloc(p->entries, (p->count + 1) * sizeof(*trailer));
+    if(trailer == NULL) {
+        snprintf(err, errlen, "out of memory");
+        goto fail;
+    }
+    p->entries = trailer;
+    p->alloc = p->count + 1;
+    trailer = &p->entries[p->count];
+    memset(trailer, 0, sizeof(*trailer));
+    trailer->path = strdup(CPIO_TRAILER);
+    if(trailer->path == NULL) {
+        snprintf(err, errlen, "out of memory");
+        goto fail;
+    }
+    p->count++;
+
+    for(i = 0; i < p->count; i++) {
+        p->entries[i].offset = total;
+        total += header_size(&p->entries[i]) + ALIGN4(p->entries[i].size);
+    }
+    p->size = *size = total;
+    if(*size > UINT32_MAX) {
+        snprintf(err, errlen, "'%s' is too large for a ramdisk", dir);
+        goto fail;
+    }
+
+    for(i = 0; i < threads; i++) {
+        if(pthread_create(&p->prefetchers[i], NULL, prefetch_thread, p)) break;
+    }
+    p->nprefetchers = i;
+    return p;
+
+fail:
+    cpio_close(p);
+    return NULL;
+}
@@ -0,0 +1,49 @@
+/*
+ * Copyright (C) 2007 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+struct cpio_archive;
+
+/* Scan the tree under dir, but not dir itself, and lay it out as an
+ * uncompressed newc cpio archive as mkbootfs would: entries in depth-first
+ * order with each directory's names sorted bytewise, owned by root,
+ * numbered from 300000 and stamped with mtime, so the same tree always
+ * gives the same bytes. Symbolic links are stored, not followed, and
+ * sockets are skipped.
+ *
+ * Only the tree is scanned, on up to threads threads (0 for one per CPU);
+ * the archive is not made until it is read, so it takes memory for the
+ * names but not the files. The same number of threads start pulling the
+ * files into the page cache in archive order. Returns the archive with
+ * its size in *size, or NULL with the reason in err. */
+struct cpio_archive *cpio_open_dir(const char *dir, uint64_t mtime, unsigned threads,
+                                   uint64_t *size, char *err, size_t errlen);
+
+/* Read len bytes at offset of the archive, making the headers and reading
+ * the files they cover. Any number of threads may read at once. Returns
+ * 0, or -1 with the reason left for cpio_error(), including a file that
+ * has changed size since the scan. */
+int cpio_read(struct cpio_archive *archive, void *buf, size_t len, uint64_t offset);
+
+/* Why the first failed cpio_read() failed, or "" if none has. */
+const char *cpio_error(struct cpio_archive *archive);
+
+/* Stop the prefetching and free the archive. */
+void cpio_close(struct cpio_archive *archive);
@@ -0,0 +1,586 @@
+/*
+ * Copyright (C) 2007 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "mincrypt/sha.h"
+#include "bootimg.h"
+#include "bootimg_builder.h"
+#include "bootimg_format.h"
+
+#define CHUNK_SIZE (1024 * 1024)
+
+enum source_kind {
+    SOURCE_NONE = 0,
+    SOURCE_BUFFER,
+    SOURCE_FD,
+    SOURCE_CALLBACK,
+};
+
+struct source {
+    enum source_kind kind;
+    uint32_t size;
+    const void *data;
+    int fd;
+    uint64_t offset;   /* of the segment within fd */
+    bootimg_read_fn read;
+    void *opaque;
+};
+
+struct bootimg_builder {
+    unsigned header_version;
+    uint32_t pagesize;
+    enum bootimg_hash hash_alg;
+    uint32_t addr[BOOTIMG_ADDRESS_COUNT];
+    uint32_t os_version;
+    char cmdline[BOOTIMG_CMDLINE_MAX + 1];
+    char board[BOOT_NAME_SIZE];
+    struct source src[BOOTIMG_SEGMENT_COUNT];
+
+    /* filled in by plan() */
+    uint64_t offset[BOOTIMG_SEGMENT_COUNT];
+    bool hashed[BOOTIMG_SEGMENT_COUNT];
+    uint32_t image_pagesize;
+    uint64_t image_size;
+
+    bool have_id;      /* cleared by every setter */
+    uint8_t id[32];
+    int id_size;
+
+    uint8_t *buf;      /* CHUNK_SIZE, for fd and callback sources */
+    char error[256];
+};
+
+/* The sink an image is written to. Writes arrive in increasing offset
+ * order except for the header, which seekable sinks get last. */
+struct sink {
+    int fd;            /* -1 for a buffer */
+    uint8_t *buf;
+    bool seekable;
+    bool sparse;       /* padding may be left as holes */
+};
+
+static const char *segment_names[BOOTIMG_SEGMENT_COUNT] = {
+    "kernel", "ramdisk", "secondstage", "dt", "recovery dtbo", "dtb",
+};
+
+static const unsigned char zeros[4096];
+
+static int fail(struct bootimg_builder *b, const char *fmt, ...)
+    __attribute__((format(printf, 2, 3)));
+
+static int fail(struct bootimg_builder *b, const char *fmt, ...)
+{
+    va_list ap;
+
+    va_start(ap, fmt);
+    vsnprintf(b->error, sizeof(b->error), fmt, ap);
+    va_end(ap);
+    return -1;
+}
+
+struct bootimg_builder *bootimg_builder_new(void)
+{
+    struct bootimg_builder *b = calloc(1, sizeof(*b));
+
+    if(b == NULL) return NULL;
+    b->pagesize = 2048;
+    b->hash_alg = BOOTIMG_SHA1;
+    b->addr[BOOTIMG_BASE]           = 0x10000000U;
+    b->addr[BOOTIMG_KERNEL_OFFSET]  = 0x00008000U;
+    b->addr[BOOTIMG_RAMDISK_OFFSET] = 0x01000000U;
+    b->addr[BOOTIMG_SECOND_OFFSET]  = 0x00f00000U;
+    b->addr[BOOTIMG_TAGS_OFFSET]    = 0x00000100U;
+    b->addr[BOOTIMG_DTB_OFFSET]     = 0x01f00000U;
+    return b;
+}
+
+void bootimg_builder_free(struct bootimg_builder *b)
+{
+    if(b == NULL) return;
+    free(b->buf);
+    free(b);
+}
+
+const char *bootimg_error(const struct bootimg_builder *b)
+{
+    return b->error;
+}
+
+int bootimg_set_header_version(struct bootimg_builder *b, unsigned version)
+{
+    if(version > 3) {
+        return fail(b, "unsupported header version %u", version);
+    }
+    b->header_version = version;
+    b->have_id = false;
+    return 0;
+}
+
+int bootimg_set_page_size(struct bootimg_builder *b, uint32_t pagesize)
+{
+    if((pagesize != 2048) && (pagesize != 4096)
+        && (pagesize != 8192) && (pagesize != 16384)
+        && (pagesize != 32768) && (pagesize != 65536)
+        && (pagesize != 131072)) {
+        return fail(b, "unsupported page size %u", pagesize);
+    }
+    b->pagesize = pagesize;
+    b->have_id = false;
+    return 0;
+}
+
+int bootimg_set_hash(struct bootimg_builder *b, enum bootimg_hash alg)
+{
+    if(alg != BOOTIMG_SHA1 && alg != BOOTIMG_SHA256) {
+        return fail(b, "unknown hash type");
+    }
+    b->hash_alg = alg;
+    b->have_id = false;
+    return 0;
+}
+
+int bootimg_set_address(struct bootimg_builder *b, enum bootimg_address which,
+                        uint32_t value)
+{
+    if((unsigned)which >= BOOTIMG_ADDRESS_COUNT) {
+        return fail(b, "unknown address");
+    }
+    b->addr[which] = value;
+    b->have_id = false;
+    return 0;
+}
+
+int bootimg_set_cmdline(struct bootimg_builder *b, const char *cmdline)
+{
+    if(strlen(cmdline) > BOOTIMG_CMDLINE_MAX) {
+        return fail(b, "kernel commandline too large");
+    }
+    strcpy(b->cmdline, cmdline);
+    b->have_id = false;
+    return 0;
+}
+
+int bootimg_set_board(struct bootimg_builder *b, const char *board)
+{
+    if(strlen(board) >= BOOT_NAME_SIZE) {
+        return fail(b, "board name too large");
+    }
+    strcpy(b->board, board);
+    b->have_id = false;
+    return 0;
+}
+
+int bootimg_set_os_version(struct bootimg_builder *b, unsigned version,
+                           unsigned patch_level)
+{
+    if(version >= (1 << 21) || patch_level >= (1 << 11)) {
+        return fail(b, "os version out of range");
+    }
+    b->os_version = (version << 11) | patch_level;
+    b->have_id = false;
+    return 0;
+}
+
+int bootimg_parse_os_version(const char *ver)
+{
+    int a = 0, b = 0, c = 0;
+    int i;
+
+    i = sscanf(ver, "%u.%u.%u", &a, &b, &c);
+
+    if((i >= 1) && (a < 128) && (b < 128) && (c < 128))
+        return (a << 14) | (b << 7) | c;
+    return 0;
+}
+
+int bootimg_parse_os_patch_level(const char *lvl)
+{
+    int y = 0, m = 0;
+    int i;
+
+    i = sscanf(lvl, "%u-%u", &y, &m);
+    y -= 2000;
+
+    if((i == 2) && (y >= 0) && (y < 128) && (m > 0) && (m <= 12))
+        return (y << 4) | m;
+    return 0;
+}
+
+static int set_source(struct bootimg_builder *b, enum bootimg_segment seg,
+                      const struct source *src)
+{
+    if((unsigned)seg >= BOOTIMG_SEGMENT_COUNT) {
+        return fail(b, "unknown segment");
+    }
+    b->src[seg] = *src;
+    b->have_id = false;
+    return 0;
+}
+
+int bootimg_set_buffer(struct bootimg_builder *b, enum bootimg_segment seg,
+                       const void *data, uint32_t size)
+{
+    struct source src = { SOURCE_BUFFER, size, data, -1, 0, NULL, NULL };
+
+    if(data == NULL && size > 0) {
+        return fail(b, "no data for %u byte segment", size);
+    }
+    return set_source(b, seg, &src);
+}
+
+int bootimg_set_fd(struct bootimg_builder *b, enum bootimg_segment seg,
+                   int fd, uint64_t offset, uint32_t size)
+{
+    struct source src = { SOURCE_FD, size, NULL, fd, offset, NULL, NULL };
+
+    if(fd < 0) {
+        return fail(b, "invalid fd");
+    }
+    return set_source(b, seg, &src);
+}
+
+int bootimg_set_callback(struct bootimg_builder *b, enum bootimg_segment seg,
+                         bootimg_read_fn read, void *opaque, uint32_t size)
+{
+    struct source src = { SOURCE_CALLBACK, size, NULL, -1, 0, read, opaque };
+
+    if(read == NULL) {
+        return fail(b, "no read callback");
+    }
+    return set_source(b, seg, &src);
+}
+
+int bootimg_clear_segment(struct bootimg_builder *b, enum bootimg_segment seg)
+{
+    struct source src = { SOURCE_NONE, 0, NULL, -1, 0, NULL, NULL };
+
+    return set_source(b, seg, &src);
+}
+
+/* The sizes of the segments, and which are present, for bootimg_format.h. */
+static void segment_sizes(const struct bootimg_builder *b, uint32_t *sizes,
+                          bool *present)
+{
+    unsigned i;
+
+    for(i = 0; i < BOOTIMG_SEGMENT_COUNT; i++) {
+        sizes[i] = b->src[i].size;
+        present[i] = b->src[i].kind != SOURCE_NONE;
+    }
+}
+
+/* Check the segments against the header version and lay them out the way
+ * mkbootimg does, see bootimg_format.h. */
+static int plan(struct bootimg_builder *b)
+{
+    unsigned version = b->header_version;
+    bool have_dt = b->src[BOOTIMG_DT].kind != SOURCE_NONE;
+    uint32_t sizes[BOOTIMG_SEGMENT_COUNT];
+    bool present[BOOTIMG_SEGMENT_COUNT];
+    unsigned i;
+
+    if(b->src[BOOTIMG_KERNEL].kind == SOURCE_NONE) {
+        return fail(b, "no kernel image specified");
+    }
+    for(i = BOOTIMG_SECOND; i < BOOTIMG_SEGMENT_COUNT; i++) {
+        bool allowed;
+
+        if(b->src[i].kind == SOURCE_NONE) continue;
+        switch(i) {
+            case BOOTIMG_SECOND:        allowed = version < 3; break;
+            case BOOTIMG_DT:            allowed = version == 0; break;
+            case BOOTIMG_RECOVERY_DTBO: allowed = version == 1 || version == 2; break;
+            default:                    allowed = version == 2; break;
+        }
+        if(!allowed) {
+            return fail(b, "header version %u has no %s", version, segment_names[i]);
+        }
+        if(i != BOOTIMG_SECOND && b->src[i].size == 0) {
+            return fail(b, "%s is empty", segment_names[i]);
+        }
+    }
+
+    segment_sizes(b, sizes, present);
+    b->image_pagesize = bootimg_layout_pagesize(version, b->pagesize);
+    b->image_size = bootimg_layout(sizes, present, b->image_pagesize, b->offset);
+    for(i = 0; i < BOOTIMG_SEGMENT_COUNT; i++) {
+        b->hashed[i] = bootimg_segment_hashed(i, version, have_dt);
+    }
+    return 0;
+}
+
+uint64_t bootimg_image_size(struct bootimg_builder *b)
+{
+    return plan(b) ? 0 : b->image_size;
+}
+
+uint64_t bootimg_segment_offset(struct bootimg_builder *b, enum bootimg_segment seg)
+{
+    if((unsigned)seg >= BOOTIMG_SEGMENT_COUNT || plan(b)) return 0;
+    return b->src[seg].kind != SOURCE_NONE ? b->offset[seg] : 0;
+}
+
+static void init_id(struct bootimg_builder *b, HASH_CTX *ctx)
+{
+    bootimg_id_init(ctx, b->hash_alg);
+}
+
+static void finish_id(struct bootimg_builder *b, HASH_CTX *ctx)
+{
+    b->id_size = bootimg_id_finish(ctx, b->id);
+    b->have_id = true;
+}
+
+/* Return up to len bytes of segment i starting at pos, pointing into the
+ * source itself for buffers and into b->buf otherwise. Returns the number
+ * of bytes available, or -1 if the source could not be read. */
+static ssize_t read_source(struct bootimg_builder *b, unsigned i, uint32_t pos,
+                           size_t len, const uint8_t **data)
+{
+    struct source *src = &b->src[i];
+    ssize_t count;
+
+    if(len > CHUNK_SIZE) len = CHUNK_SIZE;
+    if(src->kind == SOURCE_BUFFER) {
+        *data = (const uint8_t *)src->data + pos;
+        return len;
+    }
+    if(b->buf == NULL && (b->buf = malloc(CHUNK_SIZE)) == NULL) {
+        return fail(b, "out of memory");
+    }
+    if(src->kind == SOURCE_FD) {
+        count = pread(src->fd, b->buf, len, src->offset + pos);
+    } else {
+        count = src->read(src->opaque, b->buf, len, pos);
+    }
+    if(count <= 0) {
+        return fail(b, "could not read %s: %s", segment_names[i],
+                    count < 0 ? strerror(errno) : "unexpected end of file");
+    }
+    *data = b->buf;
+    return count;
+}
+
+static int sink_write(struct bootimg_builder *b, struct sink *s, const void *data,
+                      size_t len, uint64_t offset)
+{
+    const uint8_t *p = data;
+
+    if(s->fd < 0) {
+        memcpy(s->buf + offset, data, len);
+        return 0;
+    }
+    while(len > 0) {
+        ssize_t count;
+
+        if(s->seekable) {
+            count = pwrite(s->fd, p, len, offset);
+        } else {
+            count = write(s->fd, p, len);
+        }
+        if(count < 0 && errno == EINTR) continue;
+        if(count <= 0) {
+            return fail(b, "failed writing image: %s",
+                        count < 0 ? strerror(errno) : "no space left");
+        }
+        p += count;
+        offset += count;
+        len -= count;
+    }
+    return 0;
+}
+
+static int sink_zero(struct bootimg_builder *b, struct sink *s, uint64_t len,
+                     uint64_t offset)
+{
+    if(s->sparse) return 0;
+    if(s->fd < 0) {
+        memset(s->buf + offset, 0, len);
+        return 0;
+    }
+    while(len > 0) {
+        size_t count = len < sizeof(zeros) ? len : sizeof(zeros);
+
+        if(sink_write(b, s, zeros, count, offset)) return -1;
+        offset += count;
+        len -= count;
+    }
+    return 0;
+}
+
+/* Stream every segment through ctx and, when s is not NULL, to its place
+ * in the image along with its padding. */
+static int copy_segments(struct bootimg_builder *b, struct sink *s, HASH_CTX *ctx)
+{
+    unsigned pagesize = b->image_pagesize;
+    unsigned i;
+
+    for(i = 0; i < BOOTIMG_SEGMENT_COUNT; i++) {
+        struct source *src = &b->src[i];
+        uint32_t pos = 0;
+
+        if(src->kind != SOURCE_NONE) {
+            while(pos < src->size) {
+                const uint8_t *data;
+                ssize_t count = read_source(b, i, pos, src->size - pos, &data);
+
+                if(count < 0) return -1;
+                if(b->hashed[i]) HASH_update(ctx, data, count);
+                if(s && sink_write(b, s, data, count, b->offset[i] + pos)) return -1;
+                pos += count;
+            }
+            if(s && (src->size & (pagesize - 1))) {
+                if(sink_zero(b, s, pagesize - (src->size & (pagesize - 1)),
+                             b->offset[i] + src->size)) return -1;
+            }
+        }
+        if(b->hashed[i]) {
+            bootimg_id_add_size(ctx, src->size);
+        }
+    }
+    return 0;
+}
+
+/* The header page, id included, as it goes at the start of the image. */
+static int write_header(struct bootimg_builder *b, struct sink *s)
+{
+    struct bootimg_params p = {
+        b->header_version, b->pagesize, { 0, }, b->os_version, b->board, b->cmdline,
+    };
+    uint32_t sizes[BOOTIMG_SEGMENT_COUNT];
+    bool present[BOOTIMG_SEGMENT_COUNT];
+    boot_img_hdr_v2 hdr;
+    uint8_t data[sizeof(boot_img_hdr_v2)];
+    size_t size;
+    unsigned i;
+
+    for(i = 0; i < BOOTIMG_ADDRESS_COUNT; i++) {
+        p.addr[i] = b->addr[i];
+    }
+    bootimg_init_header(&hdr, &p);
+    segment_sizes(b, sizes, present);
+    bootimg_set_header_sizes(&hdr, b->header_version, sizes, present, b->offset);
+    memcpy(hdr.id, b->id, sizeof(hdr.id));
+    size = bootimg_format_header(&hdr, b->header_version, b->cmdline, data);
+
+    if(sink_write(b, s, data, size, 0)) return -1;
+    return sink_zero(b, s, b->image_pagesize - size, size);
+}
+
+static int write_image(struct bootimg_builder *b, struct sink *s)
+{
+    HASH_CTX ctx;
+
+    if(plan(b)) return -1;
+    init_id(b, &ctx);
+
+    if(s->seekable) {
+        /* the header goes in last, once the id is known */
+        if(copy_segments(b, s, &ctx)) return -1;
+        finish_id(b, &ctx);
+        return write_header(b, s);
+    }
+
+    /* a stream has to start with the header, so hash everything first */
+    if(!b->have_id) {
+        if(copy_segments(b, NULL, &ctx)) return -1;
+        finish_id(b, &ctx);
+        init_id(b, &ctx);
+    }
+    if(write_header(b, s)) return -1;
+    return copy_segments(b, s, &ctx);
+}
+
+int bootimg_id(struct bootimg_builder *b, uint8_t id[32])
+{
+    HASH_CTX ctx;
+
+    if(!b->have_id) {
+        if(plan(b)) return -1;
+        init_id(b, &ctx);
+        if(copy_segments(b, NULL, &ctx)) return -1;
+        finish_id(b, &ctx);
+    }
+    memcpy(id, b->id, sizeof(b->id));
+    return b->id_size;
+}
+
+int bootimg_write_fd(struct bootimg_builder *b, int fd)
+{
+    struct sink s = { fd, NULL, false, false };
+    struct stat st;
+
+    if(fstat(fd, &st)) {
+        return fail(b, "invalid output fd: %s", strerror(errno));
+    }
+    s.seekable = lseek(fd, 0, SEEK_CUR) >= 0;
+    s.sparse = S_ISREG(st.st_mode);
+    if(s.sparse && ftruncate(fd, 0)) {
+        return fail(b, "could not truncate output: %s", strerror(errno));
+    }
+    if(write_image(b, &s)) return -1;
+    if(s.sparse && ftruncate(fd, b->image_size)) {
+        return fail(b, "failed writing image: %s", strerror(errno));
+    }
+    return 0;
+}
+
+int bootimg_write_buffer(struct bootimg_builder *b, void *buf, size_t len)
+{
+    struct sink s = { -1, buf, true, false };
+
+    if(plan(b)) return -1;
+    if(len < b->image_size) {
+        return fail(b, "buffer of %zu bytes too small for %llu byte image",
+                    len, (unsigned long long)b->image_size);
+    }
+    return write_image(b, &s);
+}
+
+int bootimg_write_memfd(struct bootimg_builder *b, const char *name)
+{
+#ifdef __linux__
+    int fd = memfd_create(name ? name : "boot.img", MFD_CLOEXEC);
+
+    if(fd < 0) {
+        return fail(b, "could not create memfd: %s", strerror(errno));
+    }
+    if(bootimg_write_fd(b, fd)) {
+        close(fd);
+        return -1;
+    }
+    if(lseek(fd, 0, SEEK_SET) != 0) {
+        fail(b, "could not rewind memfd: %s", strerror(errno));
+        close(fd);
+        return -1;
+    }
+    return fd;
+#else
+    (void)name;
+    return fail(b, "memfd is not supported on this platform");
+#endif
+}
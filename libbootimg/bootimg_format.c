@@ -0,0 +1,163 @@
+/*
+ * Copyright (C) 2007 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <string.h>
+
+#include "mincrypt/sha.h"
+#include "mincrypt/sha256.h"
+#include "bootimg_format.h"
+
+uint32_t bootimg_layout_pagesize(unsigned header_version, uint32_t pagesize)
+{
+    return header_version == 3 ? 4096 : pagesize;
+}
+
+bool bootimg_segment_hashed(unsigned seg, unsigned header_version, bool have_dt)
+{
+    switch(seg) {
+        case BOOTIMG_DT:            return have_dt;
+        case BOOTIMG_RECOVERY_DTBO: return !have_dt && header_version > 0;
+        case BOOTIMG_DTB:           return !have_dt && header_version > 1;
+        default:                    return true;
+    }
+}
+
+uint64_t bootimg_layout(const uint32_t sizes[BOOTIMG_SEGMENT_COUNT],
+                        const bool present[BOOTIMG_SEGMENT_COUNT],
+                        uint32_t pagesize, uint64_t offsets[BOOTIMG_SEGMENT_COUNT])
+{
+    uint64_t offset = pagesize;
+    unsigned i;
+
+    for(i = 0; i < BOOTIMG_SEGMENT_COUNT; i++) {
+        offsets[i] = offset;
+        if(present[i]) {
+            offset += ((uint64_t)sizes[i] + pagesize - 1) / pagesize * pagesize;
+        }
+    }
+    return offset;
+}
+
+void bootimg_init_header(boot_img_hdr_v2 *hdr, const struct bootimg_params *p)
+{
+    const uint64_t *addr = p->addr;
+
+    memset(hdr, 0, sizeof(*hdr));
+    memcpy(hdr->magic, BOOT_MAGIC, BOOT_MAGIC_SIZE);
+    hdr->kernel_addr =  addr[BOOTIMG_BASE] + addr[BOOTIMG_KERNEL_OFFSET];
+    hdr->ramdisk_addr = addr[BOOTIMG_BASE] + addr[BOOTIMG_RAMDISK_OFFSET];
+    hdr->second_addr =  addr[BOOTIMG_BASE] + addr[BOOTIMG_SECOND_OFFSET];
+    hdr->tags_addr =    addr[BOOTIMG_BASE] + addr[BOOTIMG_TAGS_OFFSET];
+    hdr->page_size = p->pagesize;
+    hdr->os_version = p->os_version;
+    strncpy((char *)hdr->name, p->board, sizeof(hdr->name) - 1);
+    bootimg_set_header_cmdline(hdr, p->cmdline);
+
+    /* version 0 leaves header_version to dt_size */
+    if(p->header_version > 0) {
+        hdr->header_version = p->header_version;
+        hdr->header_size = p->header_version == 1 ? 1648 : sizeof(*hdr);
+    }
+    if(p->header_version > 1) {
+        hdr->dtb_addr = addr[BOOTIMG_BASE] + addr[BOOTIMG_DTB_OFFSET];
+    }
+}
+
+void bootimg_set_header_cmdline(boot_img_hdr_v2 *hdr, const char *cmdline)
+{
+    size_t cmdlen = strlen(cmdline);
+
+    memset(hdr->cmdline, 0, sizeof(hdr->cmdline));
+    memset(hdr->extra_cmdline, 0, sizeof(hdr->extra_cmdline));
+    if(cmdlen <= BOOT_ARGS_SIZE) {
+        memcpy(hdr->cmdline, cmdline, cmdlen);
+    } else {
+        /* exceeds the limits of the base command-line size, go for the extra */
+        memcpy(hdr->cmdline, cmdline, BOOT_ARGS_SIZE);
+        strncpy((char *)hdr->extra_cmdline, cmdline + BOOT_ARGS_SIZE,
+                sizeof(hdr->extra_cmdline));
+    }
+}
+
+void bootimg_set_header_sizes(boot_img_hdr_v2 *hdr, unsigned header_version,
+                              const uint32_t sizes[BOOTIMG_SEGMENT_COUNT],
+                              const bool present[BOOTIMG_SEGMENT_COUNT],
+                              const uint64_t offsets[BOOTIMG_SEGMENT_COUNT])
+{
+    hdr->kernel_size = sizes[BOOTIMG_KERNEL];
+    hdr->ramdisk_size = sizes[BOOTIMG_RAMDISK];
+    hdr->second_size = sizes[BOOTIMG_SECOND];
+    if(header_version == 0) {
+        hdr->dt_size = sizes[BOOTIMG_DT]; /* overrides hdr->header_version */
+        return;
+    }
+    hdr->recovery_dtbo_size = sizes[BOOTIMG_RECOVERY_DTBO];
+    hdr->recovery_dtbo_offset = present[BOOTIMG_RECOVERY_DTBO] ?
+                                offsets[BOOTIMG_RECOVERY_DTBO] : 0;
+    hdr->dtb_size = sizes[BOOTIMG_DTB];
+}
+
+size_t bootimg_format_header(const boot_img_hdr_v2 *hdr, unsigned header_version,
+                             const char *cmdline, void *out)
+{
+    boot_img_hdr_v3 hdr_v3;
+
+    if (header_version != 3) {
+        memcpy(out, hdr, sizeof(*hdr));
+        return sizeof(*hdr);
+    }
+
+    memset(&hdr_v3, 0, sizeof(hdr_v3));
+    hdr_v3.header_size = sizeof(boot_img_hdr_v3);
+    hdr_v3.header_version = 3;
+    hdr_v3.kernel_size = hdr->kernel_size;
+    hdr_v3.os_version = hdr->os_version;
+    hdr_v3.ramdisk_size = hdr->ramdisk_size;
+    memcpy(hdr_v3.magic, BOOT_MAGIC, BOOT_MAGIC_SIZE);
+    /* from the option, not hdr->cmdline, which stops at 512 bytes
+     * without a terminator when the rest went to extra_cmdline */
+    strncpy((char *)hdr_v3.cmdline, cmdline, sizeof(hdr_v3.cmdline));
+    memcpy(out, &hdr_v3, sizeof(hdr_v3));
+    return sizeof(hdr_v3);
+}
+
+int bootimg_id_init(HASH_CTX *ctx, enum bootimg_hash alg)
+{
+    switch(alg) {
+        case BOOTIMG_SHA1:
+            SHA_init(ctx);
+            return 0;
+        case BOOTIMG_SHA256:
+            SHA256_init(ctx);
+            return 0;
+        default:
+            return -1;
+    }
+}
+
+void bootimg_id_add_size(HASH_CTX *ctx, uint32_t size)
+{
+    HASH_update(ctx, &size, sizeof(size));
+}
+
+int bootimg_id_finish(HASH_CTX *ctx, uint8_t id[32])
+{
+    int sz = HASH_size(ctx);
+
+    memset(id, 0, 32);
+    memcpy(id, HASH_final(ctx), sz > 32 ? 32 : sz);
+    return sz;
+}
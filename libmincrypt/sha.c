@@ -153,3 +153,40 @@ const uint8_t* SHA_hash(const void* data, int len, uint8_t* digest) {
     memcpy(digest, SHA_final(&ctx), SHA_DIGEST_SIZE);
     return digest;
 }
+
+/* Midstate export/import. The layout is the 64-bit byte count, the
+ * chaining words, then the partially filled block, all big-endian, so a
+ * saved state can be resumed on any host. */
+int SHA_export(const SHA_CTX* ctx, uint8_t* out) {
+    int i;
+
+    for (i = 0; i < 8; ++i) {
+        *out++ = (uint8_t) (ctx->count >> ((7 - i) * 8));
+    }
+    for (i = 0; i < 5; i++) {
+        uint32_t tmp = ctx->state[i];
+        *out++ = tmp >> 24;
+        *out++ = tmp >> 16;
+        *out++ = tmp >> 8;
+        *out++ = tmp >> 0;
+    }
+    memcpy(out, ctx->buf, sizeof(ctx->buf));
+    return SHA_MIDSTATE_SIZE;
+}
+
+int SHA_import(SHA_CTX* ctx, const uint8_t* in, int len) {
+    int i;
+
+    if (len != SHA_MIDSTATE_SIZE) return -1;
+
+    SHA_init(ctx);
+    for (i = 0; i < 8; ++i) {
+        ctx->count = (ctx->count << 8) | *in++;
+    }
+    for (i = 0; i < 5; i++) {
+        ctx->state[i] = (uint32_t) in[0] << 24 | in[1] << 16 | in[2] << 8 | in[3];
+        in += 4;
+    }
+    memcpy(ctx->buf, in, sizeof(ctx->buf));
+    return 0;
+}
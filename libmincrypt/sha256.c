@@ -182,3 +182,38 @@ const uint8_t* SHA256_hash(const void* data, int len, uint8_t* digest) {
     memcpy(digest, SHA256_final(&ctx), SHA256_DIGEST_SIZE);
     return digest;
 }
+
+/* Same layout as SHA_export(), with eight chaining words. */
+int SHA256_export(const SHA256_CTX* ctx, uint8_t* out) {
+    int i;
+
+    for (i = 0; i < 8; ++i) {
+        *out++ = (uint8_t) (ctx->count >> ((7 - i) * 8));
+    }
+    for (i = 0; i < 8; i++) {
+        uint32_t tmp = ctx->state[i];
+        *out++ = tmp >> 24;
+        *out++ = tmp >> 16;
+        *out++ = tmp >> 8;
+        *out++ = tmp >> 0;
+    }
+    memcpy(out, ctx->buf, sizeof(ctx->buf));
+    return SHA256_MIDSTATE_SIZE;
+}
+
+int SHA256_import(SHA256_CTX* ctx, const uint8_t* in, int len) {
+    int i;
+
+    if (len != SHA256_MIDSTATE_SIZE) return -1;
+
+    SHA256_init(ctx);
+    for (i = 0; i < 8; ++i) {
+        ctx->count = (ctx->count << 8) | *in++;
+    }
+    for (i = 0; i < 8; i++) {
+        ctx->state[i] = (uint32_t) in[0] << 24 | in[1] << 16 | in[2] << 8 | in[3];
+        in += 4;
+    }
+    memcpy(ctx->buf, in, sizeof(ctx->buf));
+    return 0;
+}
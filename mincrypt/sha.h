@@ -45,6 +45,15 @@ const uint8_t* SHA_hash(const void* data, int len, uint8_t* digest);
 
 #define SHA_DIGEST_SIZE 20
 
+// Save and restore the state of an unfinished hash, e.g. to resume a
+// long prefix without hashing it again. Export writes
+// SHA_MIDSTATE_SIZE bytes and returns that count; import returns 0,
+// or -1 if len is not SHA_MIDSTATE_SIZE.
+int SHA_export(const SHA_CTX* ctx, uint8_t* out);
+int SHA_import(SHA_CTX* ctx, const uint8_t* in, int len);
+
+#define SHA_MIDSTATE_SIZE (8 + 20 + 64)
+
 #ifdef __cplusplus
 }
 #endif // __cplusplus
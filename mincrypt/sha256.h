@@ -45,6 +45,12 @@ const uint8_t* SHA256_hash(const void* data, int len, uint8_t* digest);
 
 #define SHA256_DIGEST_SIZE 32
 
+// Midstate save/restore, as SHA_export()/SHA_import().
+int SHA256_export(const SHA256_CTX* ctx, uint8_t* out);
+int SHA256_import(SHA256_CTX* ctx, const uint8_t* in, int len);
+
+#define SHA256_MIDSTATE_SIZE (8 + 32 + 64)
+
 #ifdef __cplusplus
 }
 #endif // __cplusplus
@@ -14,6 +14,8 @@
  * limitations under the License.
  */
 
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -21,48 +23,71 @@
 #include <fcntl.h>
 #include <errno.h>
 #include <stdbool.h>
+#include <stddef.h>
+#include <limits.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/fs.h>
+#ifdef __NR_io_uring_setup
+#include <linux/io_uring.h>
+#define HAVE_IO_URING
+#endif
+#endif
 
 #include "mincrypt/sha.h"
 #include "mincrypt/sha256.h"
 #include "bootimg.h"
+#include "bootimg_builder.h"
+#include "bootimg_format.h"
+#include "cpio.h"
+#include "compress.h"
+#include "stats.h"
+#include "mkbootimg.h"
+#include "cache.h"
+#include "batch.h"
+#include "server.h"
+
+#define COPY_CHUNK_SIZE (1024 * 1024)
+#define MAP_WINDOW_SIZE (16 * 1024 * 1024)
 
-static void *load_file(const char *fn, unsigned *_sz)
+int open_file(const char *fn, unsigned *_sz)
 {
-    char *data;
-    int sz;
+    off_t sz;
     int fd;
 
-    data = 0;
     fd = open(fn, O_RDONLY);
-    if(fd < 0) return 0;
+    if(fd < 0) return -1;
 
     sz = lseek(fd, 0, SEEK_END);
-    if(sz < 0) goto oops;
+    if(sz < 0 || sz > UINT32_MAX) goto oops;
 
     if(lseek(fd, 0, SEEK_SET) != 0) goto oops;
 
-    data = (char *)malloc(sz);
-    if(data == 0) goto oops;
-
-    if(read(fd, data, sz) != sz) goto oops;
-    close(fd);
-
     if(_sz) *_sz = sz;
-    return data;
+    return fd;
 
 oops:
     close(fd);
-    if(data != 0) free(data);
-    return 0;
+    return -1;
 }
 
 int usage(void)
 {
     fprintf(stderr,"usage: mkbootimg\n"
-            "       --kernel <filename>\n"
-            "       [ --ramdisk <filename> ]\n"
+            "       --kernel <filename>[,<filename>...]\n"
+            "       [ --ramdisk <filename>[,<filename>...] ]\n"
+            "       [ --ramdisk-dir <directory> ]\n"
+            "       [ --ramdisk-compress <none(default)|gzip|lz4> ]\n"
+            "       [ --compress-level <level> ] [ --compress-threads <n> ]\n"
             "       [ --second <filename> ]\n"
-            "       [ --dtb <filename> ]\n"
+            "       [ --dtb <filename>[,<filename>...] ]\n"
             "       [ --recovery_dtbo <filename> ]\n"
             "       [ --recovery_acpio <filename> ]\n"
             "       [ --cmdline <command line> ]\n"
@@ -79,28 +104,46 @@ int usage(void)
             "       [ --os_patch_level <YYYY-MM-DD date> ]\n"
             "       [ --header_version <version number> ]\n"
             "       [ --hashtype <sha1(default)|sha256> ]\n"
+            "       [ --io <zerocopy(default)|rw|pipeline|parallel|uring|direct> ]\n"
+            "       [ --direct-io ]\n"
+            "       [ --reflink ]\n"
+            "       [ --diff-write ]\n"
+            "       [ --stats[=text|json] ]\n"
             "       [ --id ]\n"
-            "       -o|--output <filename>\n"
+            "       [ --id-cache <directory> ]\n"
+            "       [ --cache <directory> ] [ --cache-size <bytes>[K|M|G] ]\n"
+            "       [ --output-offset <bytes>[K|M|G] ] [ --output-limit <bytes>[K|M|G] ]\n"
+            "       -o|--output <filename|->\n"
+            "   or: mkbootimg --update <image> [ --kernel, --ramdisk, ... <filename> ]\n"
+            "       [ --cmdline, --board, --os_version, --base, ... ] [ --hashtype <sha1|sha256> ]\n"
+            "       [ --id-cache <directory> ] [ --id ]\n"
+            "   or: mkbootimg [ <default options> ] --batch <manifest|-> [ --jobs <n> ]\n"
+            "   or: mkbootimg [ <default options> ] --serve <socket> [ --jobs <n> ]\n"
             );
     return 1;
 }
 
 static unsigned char padding[131072] = { 0, };
 
-static void print_id(const uint8_t *id, size_t id_len)
+static void print_id(FILE *f, const uint8_t *id, size_t id_len)
 {
-    printf("0x");
+    fprintf(f, "0x");
     unsigned i = 0;
     for(i = 0; i < id_len; i++) {
-        printf("%02x", id[i]);
+        fprintf(f, "%02x", id[i]);
     }
-    printf("\n");
+    fprintf(f, "\n");
 }
 
-int write_padding(int fd, unsigned pagesize, unsigned itemsize)
+/* Pad an item out to the next page boundary. When sparse, the padding is
+ * skipped over and left as a hole, which reads back as zeros; the caller
+ * must extend the file with ftruncate() if it ends in padding. */
+int write_padding(int fd, unsigned pagesize, unsigned itemsize, bool sparse)
 {
     unsigned pagemask = pagesize - 1;
+    struct stats_timer t;
     ssize_t count;
+    int ret;
 
     if((itemsize & pagemask) == 0) {
         return 0;
@@ -108,435 +151,3329 @@ int write_padding(int fd, unsigned pagesize, unsigned itemsize)
 
     count = pagesize - (itemsize & pagemask);
 
-    if(write(fd, padding, count) != count) {
-        return -1;
+    t = stats_begin("padding");
+    if(sparse) {
+        ret = lseek(fd, count, SEEK_CUR) < 0 ? -1 : 0;
     } else {
-        return 0;
+        ret = write(fd, padding, count) != count ? -1 : 0;
     }
+    stats_end(&t, count);
+    return ret;
 }
 
-int parse_os_version(char *ver)
+const struct hash_name hash_names[] = {
+    { "sha1", HASH_SHA1 },
+    { "sha256", HASH_SHA256 },
+    { NULL, /* Sentinel */ },
+};
+
+enum hash_alg parse_hash_alg(char *name)
 {
-    int a = 0, b = 0, c = 0;
-    int i;
+    const struct hash_name *ptr = hash_names;
 
-    i = sscanf(ver, "%u.%u.%u", &a, &b, &c);
+    while(ptr->name) {
+        if(!strcmp(ptr->name, name))
+            return ptr->alg;
+        ptr++;
+    }
 
-    if((i >= 1) && (a < 128) && (b < 128) && (c < 128))
-        return (a << 14) | (b << 7) | c;
-    return 0;
+    return HASH_UNKNOWN;
 }
 
-int parse_os_patch_level(char *lvl)
+struct io_name {
+    const char *name;
+    enum io_method method;
+};
+
+const struct io_name io_names[] = {
+    { "rw", IO_RW },
+    { "zerocopy", IO_ZEROCOPY },
+    { "pipeline", IO_PIPELINE },
+    { "parallel", IO_PARALLEL },
+    { "uring", IO_URING },
+    { "direct", IO_DIRECT },
+    { NULL, /* Sentinel */ },
+};
+
+enum io_method parse_io_method(char *name)
 {
-    int y = 0, m = 0;
-    int i;
+    const struct io_name *ptr = io_names;
 
-    i = sscanf(lvl, "%u-%u", &y, &m);
-    y -= 2000;
+    while(ptr->name) {
+        if(!strcmp(ptr->name, name))
+            return ptr->method;
+        ptr++;
+    }
 
-    if((i == 2) && (y >= 0) && (y < 128) && (m > 0) && (m <= 12))
-        return (y << 4) | m;
-    return 0;
+    return IO_UNKNOWN;
 }
 
-enum hash_alg {
-    HASH_UNKNOWN = -1,
-    HASH_SHA1 = 0,
-    HASH_SHA256,
-};
+const char *io_method_name(enum io_method method)
+{
+    const struct io_name *ptr = io_names;
+
+    while(ptr->name) {
+        if(ptr->method == method)
+            return ptr->name;
+        ptr++;
+    }
+
+    return "unknown";
+}
 
-struct hash_name {
+struct compress_name {
     const char *name;
-    enum hash_alg alg;
+    enum compress_method method;
 };
 
-const struct hash_name hash_names[] = {
-    { "sha1", HASH_SHA1 },
-    { "sha256", HASH_SHA256 },
+const struct compress_name compress_names[] = {
+    { "none", COMPRESS_NONE },
+    { "gzip", COMPRESS_GZIP },
+    { "lz4", COMPRESS_LZ4 },
     { NULL, /* Sentinel */ },
 };
 
-enum hash_alg parse_hash_alg(char *name)
+enum compress_method parse_compress_method(char *name)
 {
-    const struct hash_name *ptr = hash_names;
+    const struct compress_name *ptr = compress_names;
 
     while(ptr->name) {
         if(!strcmp(ptr->name, name))
-            return ptr->alg;
+            return ptr->method;
         ptr++;
     }
 
-    return HASH_UNKNOWN;
+    return COMPRESS_UNKNOWN;
 }
 
-void generate_id_sha1(boot_img_hdr_v2 *hdr, void *kernel_data, void *ramdisk_data,
-                      void *second_data, void *dt_data, void *recovery_dtbo_data, void *dtb_data)
+const char *compress_method_name(enum compress_method method)
 {
-    SHA_CTX ctx;
-    const uint8_t *sha;
+    const struct compress_name *ptr = compress_names;
 
-    SHA_init(&ctx);
-    SHA_update(&ctx, kernel_data, hdr->kernel_size);
-    SHA_update(&ctx, &hdr->kernel_size, sizeof(hdr->kernel_size));
-    SHA_update(&ctx, ramdisk_data, hdr->ramdisk_size);
-    SHA_update(&ctx, &hdr->ramdisk_size, sizeof(hdr->ramdisk_size));
-    SHA_update(&ctx, second_data, hdr->second_size);
-    SHA_update(&ctx, &hdr->second_size, sizeof(hdr->second_size));
-    if(dt_data) {
-        SHA_update(&ctx, dt_data, hdr->dt_size);
-        SHA_update(&ctx, &hdr->dt_size, sizeof(hdr->dt_size));
-    } else if(hdr->header_version > 0) {
-        SHA_update(&ctx, recovery_dtbo_data, hdr->recovery_dtbo_size);
-        SHA_update(&ctx, &hdr->recovery_dtbo_size, sizeof(hdr->recovery_dtbo_size));
-        if(hdr->header_version > 1) {
-            SHA_update(&ctx, dtb_data, hdr->dtb_size);
-            SHA_update(&ctx, &hdr->dtb_size, sizeof(hdr->dtb_size));
-        }
+    while(ptr->name) {
+        if(ptr->method == method)
+            return ptr->name;
+        ptr++;
+    }
+
+    return "unknown";
+}
+
+/* In enum bootimg_segment order, as bootimg_format.h takes them. */
+enum segment_index {
+    SEG_KERNEL = 0,
+    SEG_RAMDISK,
+    SEG_SECOND,
+    SEG_DT,
+    SEG_RECOVERY_DTBO,
+    SEG_DTB,
+    SEG_COUNT,
+};
+
+/* One input of the image, in the order it is laid out after the header.
+ * The id covers the payload of every hashed segment followed by its size,
+ * which is the same order the segments are written in, so the hash can be
+ * updated while each payload streams through.
+ *
+ * A segment given as a list of files is a run of parts, one per file,
+ * placed back to back; only the last is padded out to a page and only it
+ * adds the size of the whole segment to the id, as if the files had been
+ * concatenated beforehand. */
+
+struct ramdisk_source;
+
+struct segment {
+    const char *name;
+    const char *fn;
+    int fd;          /* -1 when the segment is absent or made on the fly */
+    struct ramdisk_source *source;  /* made by produce_segment(), if set */
+    uint32_t size;
+    uint64_t offset; /* in the image, see plan_layout() */
+    uint32_t head;   /* bytes of the same segment in the parts before this */
+    bool more;       /* further parts of the same segment follow */
+    bool hashed;
+    bool prefetching;
+    pthread_t prefetcher;
+    bool failed;     /* the input could not be read back, see read_error() */
+    int error;       /* errno of that failure, 0 for a short read */
+};
+
+/* Add the size of the segment seg ends to the id. */
+static void hash_segment_size(HASH_CTX *ctx, const struct segment *seg)
+{
+    uint32_t size = seg->head + seg->size;
+
+    if(seg->hashed && !seg->more) {
+        bootimg_id_add_size(ctx, size);
     }
-    sha = SHA_final(&ctx);
-    memcpy(hdr->id, sha, SHA_DIGEST_SIZE > sizeof(hdr->id) ? sizeof(hdr->id) : SHA_DIGEST_SIZE);
 }
 
-void generate_id_sha256(boot_img_hdr_v2 *hdr, void *kernel_data, void *ramdisk_data,
-                        void *second_data, void *dt_data, void *recovery_dtbo_data, void *dtb_data)
+unsigned split_files(char *list, char **files, unsigned max)
 {
-    SHA256_CTX ctx;
-    const uint8_t *sha;
+    unsigned n = 0;
 
-    SHA256_init(&ctx);
-    SHA256_update(&ctx, kernel_data, hdr->kernel_size);
-    SHA256_update(&ctx, &hdr->kernel_size, sizeof(hdr->kernel_size));
-    SHA256_update(&ctx, ramdisk_data, hdr->ramdisk_size);
-    SHA256_update(&ctx, &hdr->ramdisk_size, sizeof(hdr->ramdisk_size));
-    SHA256_update(&ctx, second_data, hdr->second_size);
-    SHA256_update(&ctx, &hdr->second_size, sizeof(hdr->second_size));
-    if(dt_data) {
-        SHA256_update(&ctx, dt_data, hdr->dt_size);
-        SHA256_update(&ctx, &hdr->dt_size, sizeof(hdr->dt_size));
-    } else if(hdr->header_version > 0) {
-        SHA256_update(&ctx, recovery_dtbo_data, hdr->recovery_dtbo_size);
-        SHA256_update(&ctx, &hdr->recovery_dtbo_size, sizeof(hdr->recovery_dtbo_size));
-        if(hdr->header_version > 1) {
-            SHA256_update(&ctx, dtb_data, hdr->dtb_size);
-            SHA256_update(&ctx, &hdr->dtb_size, sizeof(hdr->dtb_size));
-        }
+    while(n < max) {
+        char *comma = strchr(list, ',');
+
+        if(comma) *comma = '\0';
+        if(*list == '\0') return 0;
+        files[n++] = list;
+        if(comma == NULL) return n;
+        list = comma + 1;
     }
-    sha = SHA256_final(&ctx);
-    memcpy(hdr->id, sha, SHA256_DIGEST_SIZE > sizeof(hdr->id) ? sizeof(hdr->id) : SHA256_DIGEST_SIZE);
+    return 0;
 }
 
-void generate_id(enum hash_alg alg, boot_img_hdr_v2 *hdr, void *kernel_data,
-                 void *ramdisk_data, void *second_data, void *dt_data, void *recovery_dtbo_data, void *dtb_data)
+int init_id(enum hash_alg alg, HASH_CTX *ctx)
 {
     switch(alg) {
         case HASH_SHA1:
-            generate_id_sha1(hdr, kernel_data, ramdisk_data, second_data, dt_data, recovery_dtbo_data, dtb_data);
-            break;
+            return bootimg_id_init(ctx, BOOTIMG_SHA1);
         case HASH_SHA256:
-            generate_id_sha256(hdr, kernel_data, ramdisk_data, second_data, dt_data, recovery_dtbo_data, dtb_data);
-            break;
+            return bootimg_id_init(ctx, BOOTIMG_SHA256);
         case HASH_UNKNOWN:
         default:
             fprintf(stderr, "Unknown hash type.\n");
+            return -1;
     }
 }
 
-int main(int argc, char **argv)
+/* Record that a segment's input could not be read. Inputs may be shared
+ * between builds, so they are only ever read with explicit offsets and
+ * failures are reported by the caller, which knows where the message
+ * should go. Returns -2 for the copy helpers below. */
+static int read_error(struct segment *seg, ssize_t count)
 {
-    boot_img_hdr_v2 hdr;
+    seg->failed = true;
+    seg->error = count < 0 ? errno : 0;
+    return -2;
+}
 
-    char *kernel_fn = NULL;
-    void *kernel_data = NULL;
-    char *ramdisk_fn = NULL;
-    void *ramdisk_data = NULL;
-    char *second_fn = NULL;
-    void *second_data = NULL;
-    char *dtb_fn = NULL;
-    void *dtb_data = NULL;
-    char *recovery_dtbo_fn = NULL;
-    void *recovery_dtbo_data = NULL;
-    char *cmdline = "";
-    char *bootimg = NULL;
-    char *board = "";
-    int os_version = 0;
-    int os_patch_level = 0;
-    int header_version = 0;
-    char *dt_fn = NULL;
-    void *dt_data = NULL;
-    uint32_t pagesize = 2048;
-    int fd;
-    uint32_t base           = 0x10000000U;
-    uint32_t kernel_offset  = 0x00008000U;
-    uint32_t ramdisk_offset = 0x01000000U;
-    uint32_t second_offset  = 0x00f00000U;
-    uint32_t tags_offset    = 0x00000100U;
-    uint32_t kernel_sz      = 0;
-    uint32_t ramdisk_sz     = 0;
-    uint32_t second_sz      = 0;
-    uint32_t dt_sz          = 0;
-    uint32_t rec_dtbo_sz    = 0;
-    uint64_t rec_dtbo_offset= 0;
-    uint32_t header_sz      = 0;
-    uint32_t dtb_sz         = 0;
-    uint64_t dtb_offset     = 0x01f00000U;
-
-    size_t cmdlen;
-    enum hash_alg hash_alg = HASH_SHA1;
+void finish_id(HASH_CTX *ctx, boot_img_hdr_v2 *hdr)
+{
+    bootimg_id_finish(ctx, (uint8_t *)hdr->id);
+}
 
-    argc--;
-    argv++;
+/* Copy a segment to fd in COPY_CHUNK_SIZE pieces, starting at byte start
+ * of the input and hashing as it goes. Returns -1 on a write error (errno
+ * set), -2 if the input could not be read back in full (recorded by
+ * read_error()). */
+static int copy_segment(int fd, struct segment *seg, uint32_t start,
+                        HASH_CTX *ctx, void *buf)
+{
+    uint32_t pos = start;
 
-    memset(&hdr, 0, sizeof(hdr));
+    while(pos < seg->size) {
+        uint32_t left = seg->size - pos;
+        ssize_t count = left < COPY_CHUNK_SIZE ? left : COPY_CHUNK_SIZE;
+        ssize_t n;
 
-    bool get_id = false;
-    while(argc > 0){
-        char *arg = argv[0];
-        if(!strcmp(arg, "--id")) {
-            get_id = true;
-            argc -= 1;
-            argv += 1;
-        } else if(argc >= 2) {
-            char *val = argv[1];
-            argc -= 2;
-            argv += 2;
-            if(!strcmp(arg, "--output") || !strcmp(arg, "-o")) {
-                bootimg = val;
-            } else if(!strcmp(arg, "--kernel")) {
-                kernel_fn = val;
-            } else if(!strcmp(arg, "--ramdisk")) {
-                ramdisk_fn = val;
-            } else if(!strcmp(arg, "--second")) {
-                second_fn = val;
-            } else if(!strcmp(arg, "--dtb")) {
-                dtb_fn = val;
-            } else if(!strcmp(arg, "--recovery_dtbo") || !strcmp(arg, "--recovery_acpio")) {
-                recovery_dtbo_fn = val;
-            } else if(!strcmp(arg, "--cmdline")) {
-                cmdline = val;
-            } else if(!strcmp(arg, "--base")) {
-                base = strtoul(val, 0, 16);
-            } else if(!strcmp(arg, "--kernel_offset")) {
-                kernel_offset = strtoul(val, 0, 16);
-            } else if(!strcmp(arg, "--ramdisk_offset")) {
-                ramdisk_offset = strtoul(val, 0, 16);
-            } else if(!strcmp(arg, "--second_offset")) {
-                second_offset = strtoul(val, 0, 16);
-            } else if(!strcmp(arg, "--tags_offset")) {
-                tags_offset = strtoul(val, 0, 16);
-            } else if(!strcmp(arg, "--dtb_offset")) {
-                dtb_offset = strtoul(val, 0, 16);
-            } else if(!strcmp(arg, "--board")) {
-                board = val;
-            } else if(!strcmp(arg,"--pagesize")) {
-                pagesize = strtoul(val, 0, 10);
-                if((pagesize != 2048) && (pagesize != 4096)
-                    && (pagesize != 8192) && (pagesize != 16384)
-                    && (pagesize != 32768) && (pagesize != 65536)
-                    && (pagesize != 131072)) {
-                    fprintf(stderr,"error: unsupported page size %d\n", pagesize);
-                    return -1;
-                }
-            } else if(!strcmp(arg, "--dt")) {
-                dt_fn = val;
-            } else if(!strcmp(arg, "--os_version")) {
-                os_version = parse_os_version(val);
-            } else if(!strcmp(arg, "--os_patch_level")) {
-                os_patch_level = parse_os_patch_level(val);
-            } else if(!strcmp(arg, "--header_version")) {
-                header_version = strtoul(val, 0, 10);
-            } else if(!strcmp(arg, "--hashtype")) {
-                hash_alg = parse_hash_alg(val);
-                if(hash_alg == HASH_UNKNOWN) {
-                    fprintf(stderr, "error: unknown hash algorithm '%s'\n", val);
-                    return -1;
-                }
-            } else {
-                return usage();
-            }
-        } else {
-            return usage();
+        n = pread(seg->fd, buf, count, pos);
+        if(n != count) {
+            return read_error(seg, n);
         }
+        if(ctx) {
+            HASH_update(ctx, buf, count);
+        }
+        if(write(fd, buf, count) != count) {
+            return -1;
+        }
+        pos += count;
     }
-    hdr.page_size = pagesize;
+    return 0;
+}
 
-    hdr.kernel_addr =  base + kernel_offset;
-    hdr.ramdisk_addr = base + ramdisk_offset;
-    hdr.second_addr =  base + second_offset;
-    hdr.tags_addr =    base + tags_offset;
+/* The ramdisk when it is made while it is written rather than read from a
+ * file: the archive of --ramdisk-dir, read in order as it is laid out, or
+ * the compressed stream of the ramdisk parts, archive included. A
+ * compressed ramdisk only has a size once it has been made. Only the
+ * sequential writers take such a segment, see build_image(). */
+struct ramdisk_source {
+    struct cpio_archive *archive;   /* of --ramdisk-dir, or NULL */
+    enum compress_method method;    /* COMPRESS_NONE for the archive as it is */
+    int level;
+    unsigned threads;
+    struct segment *parts;          /* compressed one after the other */
+    unsigned nparts;
+    bool made;                      /* once, so the size is known */
+    char msg[256];                  /* why making it failed */
+};
 
-    hdr.header_version = header_version;
-    hdr.os_version = (os_version << 11) | os_patch_level;
+static int read_archive(void *arg, void *buf, size_t len, uint64_t offset)
+{
+    return cpio_read(arg, buf, len, offset);
+}
 
-    if(bootimg == 0) {
-        fprintf(stderr,"error: no output filename specified\n");
-        return usage();
-    }
+/* Where produce_compressed() sends the stream, remembering whether it was
+ * emit that failed rather than the compression. */
+struct compress_target {
+    int (*emit)(void *arg, const void *buf, size_t len);
+    void *arg;
+    bool failed;
+    int error;
+};
 
-    if(kernel_fn == 0) {
-        fprintf(stderr,"error: no kernel image specified\n");
-        return usage();
-    }
+static int compress_emit(void *arg, const void *buf, size_t len)
+{
+    struct compress_target *c = arg;
 
-    if(strlen(board) >= BOOT_NAME_SIZE) {
-        fprintf(stderr,"error: board name too large\n");
-        return usage();
+    if(c->emit(c->arg, buf, len)) {
+        c->failed = true;
+        c->error = errno;
+        return -1;
     }
+    return 0;
+}
 
-    strcpy((char *)hdr.name, board);
-
-    memcpy(hdr.magic, BOOT_MAGIC, BOOT_MAGIC_SIZE);
+/* produce_segment() for a compressed ramdisk, which settles its size. It
+ * is made again by a second pass over a pipe and has to come out the same
+ * size, as the header already went out. */
+static int produce_compressed(struct segment *seg,
+                              int (*emit)(void *arg, const void *buf, size_t len),
+                              void *arg)
+{
+    struct ramdisk_source *src = seg->source;
+    struct compress_input in[SEG_MAX_PARTS];
+    struct compress_target target = { emit, arg, false, 0 };
+    uint64_t size;
+    char msg[200];
+    unsigned i;
 
-    cmdlen = strlen(cmdline);
-    if(cmdlen <= BOOT_ARGS_SIZE) {
-        strcpy((char *)hdr.cmdline, cmdline);
-    } else if(cmdlen <= BOOT_ARGS_SIZE + BOOT_EXTRA_ARGS_SIZE) {
-        /* exceeds the limits of the base command-line size, go for the extra */
-        memcpy(hdr.cmdline, cmdline, BOOT_ARGS_SIZE);
-        strcpy((char *)hdr.extra_cmdline, cmdline+BOOT_ARGS_SIZE);
+    for(i = 0; i < src->nparts; i++) {
+        in[i] = (struct compress_input) { src->parts[i].fd, src->parts[i].size };
+        if(src->parts[i].source) {
+            in[i].read = read_archive;
+            in[i].arg = src->archive;
+        }
+    }
+    if(compress_inputs(src->method, src->level, src->threads, in, src->nparts,
+                       compress_emit, &target, &size, msg, sizeof(msg))) {
+        if(target.failed) {
+            errno = target.error;
+            return -1;
+        }
+        if(src->archive && cpio_error(src->archive)[0]) {
+            snprintf(src->msg, sizeof(src->msg), "could not pack ramdisk '%s': %s",
+                     src->parts[src->nparts - 1].fn, cpio_error(src->archive));
+        } else {
+            snprintf(src->msg, sizeof(src->msg), "could not compress ramdisk: %s", msg);
+        }
+    } else if(size > UINT32_MAX) {
+        snprintf(src->msg, sizeof(src->msg), "could not compress ramdisk: too large");
+    } else if(src->made && size != seg->size) {
+        snprintf(src->msg, sizeof(src->msg), "ramdisk '%s' changed while it was written",
+                 seg->fn);
     } else {
-        fprintf(stderr,"error: kernel commandline too large\n");
-        return 1;
+        seg->size = size;
+        src->made = true;
+        return 0;
     }
+    seg->failed = true;
+    return -2;
+}
 
-    kernel_data = load_file(kernel_fn, &kernel_sz);
-    if(kernel_data == 0) {
-        fprintf(stderr,"error: could not load kernel '%s'\n", kernel_fn);
-        return 1;
+/* Make a segment that has a source from the start, handing it to emit in
+ * pieces of at most COPY_CHUNK_SIZE, or as they are compressed. Returns 0,
+ * -1 if emit failed (errno set) or -2 if making it did, with the reason in
+ * seg->source->msg. */
+static int produce_segment(struct segment *seg,
+                           int (*emit)(void *arg, const void *buf, size_t len),
+                           void *arg)
+{
+    struct ramdisk_source *src = seg->source;
+    uint32_t pos = 0;
+    uint8_t *buf;
+    int ret = 0;
+
+    if(src->method != COMPRESS_NONE) {
+        return produce_compressed(seg, emit, arg);
+    }
+    buf = malloc(COPY_CHUNK_SIZE);
+    if(buf == 0) {
+        return -1;
     }
-    hdr.kernel_size = kernel_sz;
+    while(pos < seg->size) {
+        uint32_t left = seg->size - pos;
+        uint32_t count = left < COPY_CHUNK_SIZE ? left : COPY_CHUNK_SIZE;
 
-    if(ramdisk_fn == NULL) {
-        ramdisk_data = 0;
-    } else {
-        ramdisk_data = load_file(ramdisk_fn, &ramdisk_sz);
-        if(ramdisk_data == 0) {
-            fprintf(stderr,"error: could not load ramdisk '%s'\n", ramdisk_fn);
-            return 1;
+        if(cpio_read(src->archive, buf, count, pos)) {
+            snprintf(src->msg, sizeof(src->msg), "could not pack ramdisk '%s': %s",
+                     seg->fn, cpio_error(src->archive));
+            seg->failed = true;
+            ret = -2;
+            break;
         }
+        if(emit(arg, buf, count)) {
+            ret = -1;
+            break;
+        }
+        pos += count;
     }
-    hdr.ramdisk_size = ramdisk_sz;
+    free(buf);
+    return ret;
+}
 
-    if(second_fn) {
-        second_data = load_file(second_fn, &second_sz);
-        if(second_data == 0) {
-            fprintf(stderr,"error: could not load secondstage '%s'\n", second_fn);
-            return 1;
-        }
+/* Where write_segments() sends a segment that is made on the fly. */
+struct write_target {
+    int fd;
+    HASH_CTX *ctx;  /* NULL if the segment is not hashed */
+};
+
+static int write_emit(void *arg, const void *buf, size_t len)
+{
+    struct write_target *w = arg;
+
+    if(w->ctx) {
+        HASH_update(w->ctx, buf, len);
     }
-    hdr.second_size = second_sz;
+    return write(w->fd, buf, len) != (ssize_t) len ? -1 : 0;
+}
 
-    if(header_version == 0) {
-        if(dt_fn) {
-            dt_data = load_file(dt_fn, &dt_sz);
-            if((dt_data == 0) || (dt_sz == 0)) {
-                fprintf(stderr,"error: could not load dt '%s'\n", dt_fn);
-                return 1;
-            }
-        }
-        hdr.dt_size = dt_sz; /* overrides hdr.header_version */
-    } else {
-        if(recovery_dtbo_fn) {
-            recovery_dtbo_data = load_file(recovery_dtbo_fn, &rec_dtbo_sz);
-            if((recovery_dtbo_data == 0) || (rec_dtbo_sz == 0)) {
-                fprintf(stderr,"error: could not load recovery dtbo '%s'\n", recovery_dtbo_fn);
-                return 1;
-            }
-            /* header occupies a page */
-            rec_dtbo_offset = pagesize * (1 + \
-                                          (kernel_sz + pagesize - 1) / pagesize + \
-                                          (ramdisk_sz + pagesize - 1) / pagesize + \
-                                          (second_sz + pagesize - 1) / pagesize);
+static int hash_emit(void *arg, const void *buf, size_t len)
+{
+    HASH_CTX *ctx = arg;
+
+    HASH_update(ctx, buf, len);
+    return 0;
+}
+
+/* Hash len bytes of a segment starting at off from a read-only mapping of
+ * the input, one window at a time. */
+static int hash_mapped(struct segment *seg, uint64_t off, uint32_t len, HASH_CTX *ctx)
+{
+    const uint32_t pagemask = sysconf(_SC_PAGESIZE) - 1;
+
+    while(len > 0) {
+        uint32_t window = len < MAP_WINDOW_SIZE ? len : MAP_WINDOW_SIZE;
+        uint32_t delta = off & pagemask;
+        uint8_t *map;
+
+        map = mmap(NULL, window + delta, PROT_READ, MAP_SHARED, seg->fd, off - delta);
+        if(map == MAP_FAILED) {
+            return read_error(seg, -1);
         }
-        if(header_version == 1) {
-            header_sz = 1648;
-        } else {
-            header_sz = sizeof(hdr);
+        madvise(map, window + delta, MADV_SEQUENTIAL);
+        HASH_update(ctx, map + delta, window);
+        munmap(map, window + delta);
+        off += window;
+        len -= window;
+    }
+    return 0;
+}
+
+int hash_file(int fd, const char *fn, uint32_t size, HASH_CTX *ctx)
+{
+    struct segment seg = { "input", fn, fd, 0 };
+
+    seg.size = size;
+    return hash_mapped(&seg, 0, size, ctx);
+}
+
+#ifdef __linux__
+static bool zerocopy_unsupported(int err)
+{
+    return err == EXDEV || err == EINVAL || err == ENOSYS ||
+           err == EOPNOTSUPP || err == EBADF;
+}
+
+/* Move a segment to fd from byte start onwards without passing it through
+ * user space, using copy_file_range() or, where that is not available for
+ * this pair of files, sendfile(). The id is hashed from a read-only
+ * mapping of the input. Returns 1 without having written or hashed
+ * anything if neither call works here, so the caller can fall back to
+ * copy_segment(); otherwise the same codes as copy_segment(). */
+static int splice_segment(int fd, struct segment *seg, uint32_t start, HASH_CTX *ctx)
+{
+    bool use_sendfile = false;
+    uint32_t off = start;
+
+    while(off < seg->size) {
+        uint32_t window = seg->size - off;
+        uint32_t done = 0;
+
+        if(window > MAP_WINDOW_SIZE) {
+            window = MAP_WINDOW_SIZE;
         }
-        if(header_version > 1) {
-            if(dtb_fn) {
-                dtb_data = load_file(dtb_fn, &dtb_sz);
-                if((dtb_data == 0) || (dtb_sz == 0)) {
-                    fprintf(stderr,"error: could not load dtb '%s'\n", dtb_fn);
+
+        while(done < window) {
+            off_t in_off = off + done;
+            ssize_t count;
+
+            if(!use_sendfile) {
+                count = copy_file_range(seg->fd, &in_off, fd, NULL, window - done, 0);
+                if(count < 0 && off + done == start && zerocopy_unsupported(errno)) {
+                    use_sendfile = true;
+                    continue;
+                }
+            } else {
+                count = sendfile(fd, seg->fd, &in_off, window - done);
+                if(count < 0 && off + done == start && zerocopy_unsupported(errno)) {
                     return 1;
                 }
             }
+            if(count < 0 && errno == EINTR) {
+                continue;
+            }
+            if(count < 0) {
+                return -1;
+            }
+            if(count == 0) {
+                return read_error(seg, 0);
+            }
+            done += count;
         }
+
+        if(ctx && hash_mapped(seg, off, window, ctx)) {
+            return -2;
+        }
+        off += window;
     }
-    hdr.recovery_dtbo_size = rec_dtbo_sz;
-    hdr.recovery_dtbo_offset = rec_dtbo_offset;
-    hdr.header_size = header_sz;
-    hdr.dtb_size = dtb_sz;
-    if(header_version > 1) {
-        hdr.dtb_addr = base + dtb_offset;
-    } else {
-        hdr.dtb_addr = 0;
-    }
+    return 0;
+}
 
-    /* put a hash of the contents in the header so boot images can be
-     * differentiated based on their first 2k */
-    generate_id(hash_alg, &hdr, kernel_data, ramdisk_data, second_data, dt_data, recovery_dtbo_data, dtb_data);
+/* Share the leading whole filesystem blocks of a segment with its input
+ * using FICLONERANGE, leaving the output positioned after them. Only the
+ * unaligned tail then has to be copied. Sets *cloned to the number of
+ * bytes shared, which is 0 if the filesystem cannot clone or the segment
+ * does not start on a block boundary of the output. */
+static int clone_segment(int fd, struct segment *seg, HASH_CTX *ctx, uint32_t *cloned)
+{
+    struct file_clone_range range;
+    struct stat st;
+    off_t pos;
+    uint32_t len;
 
-    fd = open(bootimg, O_CREAT | O_TRUNC | O_WRONLY, 0644);
-    if(fd < 0) {
-        fprintf(stderr,"error: could not create '%s'\n", bootimg);
-        return 1;
-    }
+    *cloned = 0;
 
-    if (header_version == 3) {
-        boot_img_hdr_v3 hdr_v3 = {
-            .header_size = sizeof(boot_img_hdr_v3),
-            .header_version = 3,
-            .kernel_size = hdr.kernel_size,
-            .os_version = hdr.os_version,
-            .ramdisk_size = hdr.ramdisk_size
-        };
-        memcpy(hdr_v3.magic, BOOT_MAGIC, BOOT_MAGIC_SIZE);
-        strcpy(hdr_v3.cmdline, hdr.cmdline);
-        
-        pagesize = 4096;
-        header_sz = sizeof(boot_img_hdr_v3);
-        if(write(fd, &hdr_v3, sizeof(hdr_v3)) != sizeof(hdr_v3)) goto fail;
-    } else {
-        if(write(fd, &hdr, sizeof(hdr)) != sizeof(hdr)) goto fail;
-    }
+    if(fstat(fd, &st) || st.st_blksize <= 0) return 0;
+    pos = lseek(fd, 0, SEEK_CUR);
+    if(pos < 0 || pos % st.st_blksize) return 0;
 
-    if(write_padding(fd, pagesize, header_sz)) goto fail;
+    len = seg->size - seg->size % st.st_blksize;
+    if(len == 0) return 0;
 
-    if(write(fd, kernel_data, hdr.kernel_size) != (ssize_t) hdr.kernel_size) goto fail;
-    if(write_padding(fd, pagesize, hdr.kernel_size)) goto fail;
+    range.src_fd = seg->fd;
+    range.src_offset = 0;
+    range.src_length = len;
+    range.dest_offset = pos;
+    if(ioctl(fd, FICLONERANGE, &range)) return 0;
 
-    if(write(fd, ramdisk_data, hdr.ramdisk_size) != (ssize_t) hdr.ramdisk_size) goto fail;
-    if(write_padding(fd, pagesize, hdr.ramdisk_size)) goto fail;
+    if(lseek(fd, pos + len, SEEK_SET) != pos + len) return -1;
+    if(ctx && hash_mapped(seg, 0, len, ctx)) return -2;
 
-    if(second_data) {
-        if(write(fd, second_data, hdr.second_size) != (ssize_t) hdr.second_size) goto fail;
-        if(write_padding(fd, pagesize, hdr.second_size)) goto fail;
-    }
+    *cloned = len;
+    return 0;
+}
+#else
+static int splice_segment(int fd, struct segment *seg, uint32_t start, HASH_CTX *ctx)
+{
+    return 1;
+}
 
-    if(dt_data) {
-        if(write(fd, dt_data, hdr.dt_size) != (ssize_t) hdr.dt_size) goto fail;
-        if(write_padding(fd, pagesize, hdr.dt_size)) goto fail;
-    } else {
-        if(recovery_dtbo_data) {
-            if(write(fd, recovery_dtbo_data, hdr.recovery_dtbo_size) != (ssize_t) hdr.recovery_dtbo_size) goto fail;
-            if(write_padding(fd, pagesize, hdr.recovery_dtbo_size)) goto fail;
-        }
-        if(dtb_data) {
-            if(write(fd, dtb_data, hdr.dtb_size) != (ssize_t) hdr.dtb_size) goto fail;
-            if(write_padding(fd, pagesize, hdr.dtb_size)) goto fail;
-        }
-    }
+static int clone_segment(int fd, struct segment *seg, HASH_CTX *ctx, uint32_t *cloned)
+{
+    *cloned = 0;
+    return 0;
+}
+#endif
 
-    if(get_id) {
-        print_id((uint8_t *)hdr.id, sizeof(hdr.id));
-    }
+/* The id always starts with the kernel and its size, and the kernel is
+ * usually the largest input and the one that changes least. The hash
+ * state right after it is saved per file so later builds resume from
+ * there instead of hashing it again. The kernel is either a file of its
+ * own or, for --update, a region of an existing image, hence src. An
+ * entry is only used while the file's identity and timestamps, the
+ * region, and a hash of its first and last ID_SAMPLE_SIZE bytes all
+ * still match, and only if the file's timestamps are older than the entry
+ * itself: a file changed within the same clock tick as the build that
+ * hashed it keeps its timestamps, so such an entry could describe
+ * contents the file no longer has. The key is taken before the kernel is
+ * hashed, so a change while hashing makes the entry miss too. */
+#define ID_CACHE_MAGIC "mkbootimg id cache 2"
+#define ID_SAMPLE_SIZE (64 * 1024)
+
+struct id_cache_entry {
+    char magic[sizeof(ID_CACHE_MAGIC)];
+    uint32_t alg;
+    uint64_t dev;
+    uint64_t ino;
+    uint64_t size;
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+    int64_t ctime_sec;
+    int64_t ctime_nsec;
+    uint64_t src;
+    uint32_t len;
+    uint8_t sample[SHA256_DIGEST_SIZE];
+    uint32_t midstate_len;  /* the state after the kernel and its size */
+    uint8_t midstate[SHA256_MIDSTATE_SIZE];
+};
+
+static int id_cache_key(struct segment *seg, uint64_t src, enum hash_alg alg,
+                        struct id_cache_entry *e)
+{
+    HASH_CTX ctx;
+    struct stat st;
+    uint32_t len = seg->size < ID_SAMPLE_SIZE ? seg->size : ID_SAMPLE_SIZE;
+
+    if(fstat(seg->fd, &st)) return -1;
+
+    memset(e, 0, sizeof(*e));
+    memcpy(e->magic, ID_CACHE_MAGIC, sizeof(e->magic));
+    e->alg = alg;
+    e->dev = st.st_dev;
+    e->ino = st.st_ino;
+    e->size = st.st_size;
+    e->mtime_sec = st.st_mtim.tv_sec;
+    e->mtime_nsec = st.st_mtim.tv_nsec;
+    e->ctime_sec = st.st_ctim.tv_sec;
+    e->ctime_nsec = st.st_ctim.tv_nsec;
+    e->src = src;
+    e->len = seg->size;
+
+    if(init_id(alg, &ctx)) return -1;
+    if(hash_mapped(seg, src, len, &ctx)) return -1;
+    if(seg->size > ID_SAMPLE_SIZE &&
+       hash_mapped(seg, src + seg->size - len, len, &ctx)) return -1;
+    memcpy(e->sample, HASH_final(&ctx), HASH_size(&ctx));
     return 0;
+}
 
-fail:
-    unlink(bootimg);
+static void id_cache_path(char *path, size_t len, const char *dir,
+                          const struct id_cache_entry *e)
+{
+    snprintf(path, len, "%s/%s-%llx-%llx", dir, hash_names[e->alg].name,
+             (unsigned long long) e->dev, (unsigned long long) e->ino);
+}
+
+/* Whether the file e was keyed from could have changed after the entry
+ * written at written without its timestamps showing it. */
+static bool id_cache_racy(const struct id_cache_entry *e, const struct timespec *written)
+{
+    return e->mtime_sec > written->tv_sec ||
+           (e->mtime_sec == written->tv_sec && e->mtime_nsec >= written->tv_nsec) ||
+           e->ctime_sec > written->tv_sec ||
+           (e->ctime_sec == written->tv_sec && e->ctime_nsec >= written->tv_nsec);
+}
+
+/* Set ctx to the saved state for the kernel want was keyed from. Returns
+ * 0, or -1 if there is no valid entry. */
+static int id_cache_load(const char *dir, const struct id_cache_entry *want,
+                         HASH_CTX *ctx)
+{
+    struct id_cache_entry have;
+    char path[PATH_MAX];
+    struct stat st;
+    ssize_t n;
+    int fd;
+
+    id_cache_path(path, sizeof(path), dir, want);
+
+    fd = open(path, O_RDONLY);
+    if(fd < 0) return -1;
+    n = read(fd, &have, sizeof(have));
+    if(fstat(fd, &st)) n = -1;
     close(fd);
-    fprintf(stderr,"error: failed writing '%s': %s\n", bootimg,
-            strerror(errno));
-    return 1;
+
+    if(n != sizeof(have) ||
+       memcmp(&have, want, offsetof(struct id_cache_entry, midstate_len)) ||
+       id_cache_racy(want, &st.st_mtim)) {
+        return -1;
+    }
+    return want->alg == HASH_SHA1 ? SHA_import(ctx, have.midstate, have.midstate_len)
+                                  : SHA256_import(ctx, have.midstate, have.midstate_len);
+}
+
+/* Save ctx, which must cover exactly the kernel e was keyed from and its
+ * size. Failing to is not an error; the next build just hashes again. */
+static void id_cache_save(const char *dir, struct id_cache_entry *e, const HASH_CTX *ctx)
+{
+    char path[PATH_MAX];
+    char tmp[PATH_MAX + 8];
+    int fd;
+
+    id_cache_path(path, sizeof(path), dir, e);
+    e->midstate_len = e->alg == HASH_SHA1 ? SHA_export(ctx, e->midstate)
+                                          : SHA256_export(ctx, e->midstate);
+
+    /* written aside and renamed over, so readers never see half an entry */
+    snprintf(tmp, sizeof(tmp), "%s.XXXXXX", path);
+    fd = mkstemp(tmp);
+    if(fd < 0) return;
+    if(write(fd, e, sizeof(*e)) != sizeof(*e) || close(fd)) {
+        unlink(tmp);
+        return;
+    }
+    if(rename(tmp, path)) unlink(tmp);
+}
+
+/* id_cache_save() for the kernel at src as it is now, for a kernel this
+ * build has just written itself. The entry has to be newer than the
+ * kernel to be used, so this first waits, for a few milliseconds at most,
+ * for the clock files are stamped with to move past the kernel's. */
+static void id_cache_store(const char *dir, struct segment *kernel, uint64_t src,
+                           enum hash_alg alg, const HASH_CTX *ctx)
+{
+    static const struct timespec tick = { 0, 1000000 };
+    struct id_cache_entry e;
+    struct timespec now;
+    int i;
+
+    if(id_cache_key(kernel, src, alg, &e)) return;
+    for(i = 0; i < 20; i++) {
+        clock_gettime(CLOCK_REALTIME_COARSE, &now);
+        if(!id_cache_racy(&e, &now)) break;
+        nanosleep(&tick, NULL);
+    }
+    id_cache_save(dir, &e, ctx);
+}
+
+/* Leave ctx covering the kernel and its size, from the cache in dir if
+ * it has a valid entry and by hashing the kernel otherwise, in which
+ * case the entry is (re)written. Returns the codes of hash_mapped(). */
+static int resume_kernel_id(const char *dir, struct segment *kernel, uint64_t src,
+                            enum hash_alg alg, HASH_CTX *ctx)
+{
+    struct id_cache_entry e;
+    bool keyed = id_cache_key(kernel, src, alg, &e) == 0;
+    int ret;
+
+    if(keyed && id_cache_load(dir, &e, ctx) == 0) return 0;
+
+    if(init_id(alg, ctx)) return -1;
+    ret = hash_mapped(kernel, src, kernel->size, ctx);
+    if(ret) return ret;
+    bootimg_id_add_size(ctx, kernel->size);
+
+    if(keyed) id_cache_save(dir, &e, ctx);
+    return 0;
+}
+
+static void *prefetch_segment(void *arg)
+{
+    struct segment *seg = arg;
+
+#ifdef __linux__
+    posix_fadvise(seg->fd, 0, seg->size, POSIX_FADV_SEQUENTIAL);
+    readahead(seg->fd, 0, seg->size);
+#elif defined(POSIX_FADV_WILLNEED)
+    posix_fadvise(seg->fd, 0, seg->size, POSIX_FADV_WILLNEED);
+#endif
+    return NULL;
+}
+
+/* Pull every input into the page cache at once, one thread per segment.
+ * readahead() can block on submission, so issuing it from the main thread
+ * would still serialize inputs that live on different devices or behind a
+ * network-backed overlay. The segments are then copied in order as usual,
+ * mostly from cache. */
+static void start_prefetch(struct segment *segs, unsigned nsegs)
+{
+    unsigned i;
+
+    for(i = 0; i < nsegs; i++) {
+        struct segment *seg = &segs[i];
+
+        if(seg->fd >= 0 && seg->size > 0) {
+            seg->prefetching = !pthread_create(&seg->prefetcher, NULL,
+                                               prefetch_segment, seg);
+        }
+    }
+}
+
+static void finish_prefetch(struct segment *segs, unsigned nsegs)
+{
+    unsigned i;
+
+    for(i = 0; i < nsegs; i++) {
+        if(segs[i].prefetching) {
+            pthread_join(segs[i].prefetcher, NULL);
+            segs[i].prefetching = false;
+        }
+    }
+}
+
+/* Write every segment in order with the selected per-segment method,
+ * padding each one and folding the sizes into the id. Returns the same
+ * codes as copy_segment(). */
+static int write_segments(int fd, struct segment *segs, unsigned nsegs,
+                          unsigned pagesize, bool sparse, HASH_CTX *ctx,
+                          enum io_method io_method, bool reflink)
+{
+    void *buf;
+    unsigned i;
+    int ret = 0;
+
+    buf = malloc(COPY_CHUNK_SIZE);
+    if(buf == 0) {
+        return -1;
+    }
+
+    for(i = 0; i < nsegs && ret == 0; i++) {
+        struct segment *seg = &segs[i];
+
+        if(seg->fd >= 0 || seg->source) {
+            HASH_CTX *seg_ctx = seg->hashed ? ctx : NULL;
+            uint32_t start = 0;
+            struct stats_timer t;
+            char phase[32];
+
+            snprintf(phase, sizeof(phase), "write %s", seg->name);
+            t = stats_begin(phase);
+            if(seg->source) {
+                struct write_target target = { fd, seg_ctx };
+
+                ret = produce_segment(seg, write_emit, &target);
+                start = seg->size;
+            } else if(reflink) {
+                ret = clone_segment(fd, seg, seg_ctx, &start);
+            }
+            if(ret == 0 && start < seg->size) {
+                ret = 1;
+                if(io_method == IO_ZEROCOPY) {
+                    ret = splice_segment(fd, seg, start, seg_ctx);
+                }
+                if(ret == 1) {
+                    ret = copy_segment(fd, seg, start, seg_ctx, buf);
+                }
+            }
+            stats_end(&t, seg->size);
+            if(ret == 0 && !seg->more &&
+               write_padding(fd, pagesize, seg->head + seg->size, sparse)) {
+                ret = -1;
+            }
+        }
+        if(ret == 0) {
+            hash_segment_size(ctx, seg);
+        }
+    }
+
+    free(buf);
+    return ret;
+}
+
+/* The size of each segment across its parts and whether it is present,
+ * segs holding one run of parts per segment. */
+static void segment_sizes(const struct segment *segs, unsigned nsegs,
+                          uint32_t *sizes, bool *present)
+{
+    unsigned i, n = 0;
+
+    for(i = 0; i < nsegs && n < SEG_COUNT; i++) {
+        sizes[n] = segs[i].head + segs[i].size;
+        present[n] = segs[i].fd >= 0 || segs[i].source;
+        if(!segs[i].more) n++;
+    }
+}
+
+/* Lay the segments out after the header page as bootimg_layout() does,
+ * the parts of a segment back to back, and return the size of the whole
+ * image. The image itself starts at byte start of the output, which is
+ * where the offsets count from. Every offset follows from the sizes
+ * alone, so this can run before any payload is read. With hdr, its
+ * segment sizes and recovery dtbo offset are set to match. */
+static uint64_t plan_layout(struct segment *segs, unsigned nsegs, unsigned pagesize,
+                            uint64_t start, boot_img_hdr_v2 *hdr, int header_version)
+{
+    uint32_t sizes[SEG_COUNT];
+    bool present[SEG_COUNT];
+    uint64_t offsets[SEG_COUNT];
+    uint64_t image_sz;
+    unsigned i, n = 0;
+
+    segment_sizes(segs, nsegs, sizes, present);
+    image_sz = bootimg_layout(sizes, present, pagesize, offsets);
+    for(i = 0; i < nsegs && n < SEG_COUNT; i++) {
+        segs[i].offset = start + offsets[n] + segs[i].head;
+        if(!segs[i].more) n++;
+    }
+    if(hdr) {
+        bootimg_set_header_sizes(hdr, header_version, sizes, present, offsets);
+    }
+    return image_sz;
+}
+
+struct segment_writer {
+    int fd;
+    struct segment *seg;
+    unsigned pagesize;
+    bool sparse;
+    bool running;
+    pthread_t thread;
+    int ret;         /* as returned by copy_segment() */
+    int saved_errno;
+};
+
+/* Write one segment and its padding at its planned offset with pwrite(),
+ * or copy_file_range() with an explicit output offset where possible, so
+ * that segments can be written concurrently. The payload is read from
+ * byte src of the input onwards, which is 0 unless the input is another
+ * image. */
+static int write_segment_at(int fd, struct segment *seg, uint64_t src,
+                            unsigned pagesize, bool sparse)
+{
+    unsigned pagemask = pagesize - 1;
+    uint32_t pos = 0;
+    uint8_t *buf;
+
+#ifdef __linux__
+    while(pos < seg->size) {
+        off_t in_off = src + pos;
+        off_t out_off = seg->offset + pos;
+        ssize_t count;
+
+        count = copy_file_range(seg->fd, &in_off, fd, &out_off, seg->size - pos, 0);
+        if(count < 0 && pos == 0 && zerocopy_unsupported(errno)) {
+            break;
+        }
+        if(count < 0 && errno == EINTR) {
+            continue;
+        }
+        if(count < 0) {
+            return -1;
+        }
+        if(count == 0) {
+            return read_error(seg, 0);
+        }
+        pos += count;
+    }
+#endif
+
+    if(pos < seg->size) {
+        buf = malloc(COPY_CHUNK_SIZE);
+        if(buf == 0) {
+            return -1;
+        }
+        while(pos < seg->size) {
+            uint32_t left = seg->size - pos;
+            ssize_t count = left < COPY_CHUNK_SIZE ? left : COPY_CHUNK_SIZE;
+
+            ssize_t n = pread(seg->fd, buf, count, src + pos);
+            if(n != count) {
+                free(buf);
+                return read_error(seg, n);
+            }
+            if(pwrite(fd, buf, count, seg->offset + pos) != count) {
+                free(buf);
+                return -1;
+            }
+            pos += count;
+        }
+        free(buf);
+    }
+
+    if(!sparse && !seg->more && ((seg->head + seg->size) & pagemask)) {
+        ssize_t count = pagesize - ((seg->head + seg->size) & pagemask);
+        if(pwrite(fd, padding, count, seg->offset + seg->size) != count) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static void *segment_writer(void *arg)
+{
+    struct segment_writer *w = arg;
+
+    w->ret = write_segment_at(w->fd, w->seg, 0, w->pagesize, w->sparse);
+    w->saved_errno = errno;
+    return NULL;
+}
+
+/* Same contract as write_segments(), for segments already placed by
+ * plan_layout(): each present segment is written by its own thread while
+ * the calling thread hashes the inputs in order. */
+static int parallel_segments(int fd, struct segment *segs, unsigned nsegs,
+                             unsigned pagesize, bool sparse, HASH_CTX *ctx)
+{
+    struct segment_writer writers[nsegs];
+    unsigned i;
+    int ret = 0;
+
+    for(i = 0; i < nsegs; i++) {
+        struct segment_writer *w = &writers[i];
+
+        memset(w, 0, sizeof(*w));
+        w->fd = fd;
+        w->seg = &segs[i];
+        w->pagesize = pagesize;
+        w->sparse = sparse;
+        if(segs[i].fd < 0) continue;
+        w->running = !pthread_create(&w->thread, NULL, segment_writer, w);
+        if(!w->running) {
+            /* no thread to spare, write it from here */
+            segment_writer(w);
+        }
+    }
+
+    for(i = 0; i < nsegs && ret == 0; i++) {
+        struct segment *seg = &segs[i];
+
+        if(!seg->hashed) continue;
+        if(seg->fd >= 0) {
+            ret = hash_mapped(seg, 0, seg->size, ctx);
+        }
+        hash_segment_size(ctx, seg);
+    }
+
+    for(i = 0; i < nsegs; i++) {
+        struct segment_writer *w = &writers[i];
+
+        if(w->running) {
+            pthread_join(w->thread, NULL);
+        }
+        if(ret == 0 && w->ret != 0) {
+            ret = w->ret;
+            errno = w->saved_errno;
+        }
+    }
+    return ret;
+}
+
+#ifdef HAVE_IO_URING
+/*
+ * io_uring backend, driven through the raw system calls so no extra
+ * library is needed. Each chunk is a READ_FIXED into one of a small set
+ * of registered buffers linked to a WRITE_FIXED at the chunk's planned
+ * offset in the image, so the kernel starts the write as soon as the read
+ * completes. The id is hashed from the same buffer once its read is in,
+ * in chunk order; a buffer is reused only after it has been hashed and
+ * written.
+ */
+#define URING_CHUNK_SIZE (512 * 1024)
+#define URING_DEPTH 8
+#define URING_ENTRIES 32     /* two per chunk plus one padding write per segment */
+#define URING_PADDING ((uint64_t)-1)
+
+struct uring {
+    int fd;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_ring, *cq_ring;
+    size_t sq_ring_sz, cq_ring_sz, sqes_sz;
+    unsigned pending;        /* queued but not yet submitted */
+};
+
+struct uring_job {
+    unsigned seg;
+    uint32_t pos;
+    uint32_t len;
+    bool read_done;
+    bool write_done;
+};
+
+static int uring_init(struct uring *r, unsigned entries)
+{
+    struct io_uring_params p;
+
+    memset(r, 0, sizeof(*r));
+    memset(&p, 0, sizeof(p));
+    r->fd = syscall(__NR_io_uring_setup, entries, &p);
+    if(r->fd < 0) return -1;
+
+    r->sq_ring_sz = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    r->cq_ring_sz = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    r->sqes_sz = p.sq_entries * sizeof(struct io_uring_sqe);
+
+    r->sq_ring = mmap(NULL, r->sq_ring_sz, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+    r->cq_ring = mmap(NULL, r->cq_ring_sz, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+    r->sqes = mmap(NULL, r->sqes_sz, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+    if(r->sq_ring == MAP_FAILED || r->cq_ring == MAP_FAILED || r->sqes == MAP_FAILED) {
+        if(r->sq_ring != MAP_FAILED) munmap(r->sq_ring, r->sq_ring_sz);
+        if(r->cq_ring != MAP_FAILED) munmap(r->cq_ring, r->cq_ring_sz);
+        if(r->sqes != MAP_FAILED) munmap(r->sqes, r->sqes_sz);
+        close(r->fd);
+        return -1;
+    }
+
+    r->sq_head = (unsigned *)((char *)r->sq_ring + p.sq_off.head);
+    r->sq_tail = (unsigned *)((char *)r->sq_ring + p.sq_off.tail);
+    r->sq_mask = (unsigned *)((char *)r->sq_ring + p.sq_off.ring_mask);
+    r->sq_array = (unsigned *)((char *)r->sq_ring + p.sq_off.array);
+    r->cq_head = (unsigned *)((char *)r->cq_ring + p.cq_off.head);
+    r->cq_tail = (unsigned *)((char *)r->cq_ring + p.cq_off.tail);
+    r->cq_mask = (unsigned *)((char *)r->cq_ring + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe *)((char *)r->cq_ring + p.cq_off.cqes);
+    return 0;
+}
+
+static void uring_exit(struct uring *r)
+{
+    munmap(r->sqes, r->sqes_sz);
+    munmap(r->cq_ring, r->cq_ring_sz);
+    munmap(r->sq_ring, r->sq_ring_sz);
+    close(r->fd);
+}
+
+static struct io_uring_sqe *uring_sqe(struct uring *r)
+{
+    unsigned tail = *r->sq_tail + r->pending;
+    unsigned index = tail & *r->sq_mask;
+    struct io_uring_sqe *sqe = &r->sqes[index];
+
+    r->sq_array[index] = index;
+    r->pending++;
+    memset(sqe, 0, sizeof(*sqe));
+    return sqe;
+}
+
+/* Publish queued entries and wait for at least wait completions. */
+static int uring_submit(struct uring *r, unsigned wait)
+{
+    unsigned flags = wait ? IORING_ENTER_GETEVENTS : 0;
+    unsigned count = r->pending;
+
+    __atomic_store_n(r->sq_tail, *r->sq_tail + count, __ATOMIC_RELEASE);
+    r->pending = 0;
+    while(syscall(__NR_io_uring_enter, r->fd, count, wait, flags, NULL, 0) < 0) {
+        if(errno != EINTR) return -1;
+        count = 0;
+    }
+    return 0;
+}
+
+static void uring_prep(struct io_uring_sqe *sqe, int op, int fd, void *addr,
+                       uint32_t len, uint64_t off, unsigned buf_index,
+                       uint64_t user_data)
+{
+    sqe->opcode = op;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)(uintptr_t)addr;
+    sqe->len = len;
+    sqe->off = off;
+    sqe->buf_index = buf_index;
+    sqe->user_data = user_data;
+}
+
+/* Same contract as write_segments() for segments placed by plan_layout(),
+ * except that 1 is returned without touching the output if io_uring is
+ * not available here, so the caller can fall back to write(). */
+static int uring_segments(int fd, struct segment *segs, unsigned nsegs,
+                          unsigned pagesize, bool sparse, HASH_CTX *ctx)
+{
+    const size_t align = sysconf(_SC_PAGESIZE);
+    const unsigned pagemask = pagesize - 1;
+    struct iovec iov[URING_DEPTH + 1];
+    struct uring_job jobs[URING_DEPTH];
+    struct uring r;
+    unsigned long issued = 0, hashed = 0, retired = 0;
+    unsigned inflight = 0;
+    unsigned seg = 0, hash_seg = 0;
+    uint32_t pos = 0;
+    int ret = 0;
+    unsigned i;
+
+    if(uring_init(&r, URING_ENTRIES)) return 1;
+
+    memset(iov, 0, sizeof(iov));
+    for(i = 0; i < URING_DEPTH; i++) {
+        if(posix_memalign(&iov[i].iov_base, align, URING_CHUNK_SIZE)) {
+            ret = -1;
+            goto out;
+        }
+        iov[i].iov_len = URING_CHUNK_SIZE;
+    }
+    iov[URING_DEPTH].iov_base = padding;
+    iov[URING_DEPTH].iov_len = sizeof(padding);
+
+    if(syscall(__NR_io_uring_register, r.fd, IORING_REGISTER_BUFFERS,
+               iov, URING_DEPTH + 1) < 0) {
+        ret = 1;
+        goto out;
+    }
+
+    while(ret == 0 || inflight > 0) {
+        /* queue reads while buffers are free */
+        while(ret == 0 && seg < nsegs && issued - retired < URING_DEPTH) {
+            struct segment *s = &segs[seg];
+            uint32_t left = s->fd >= 0 ? s->size - pos : 0;
+            unsigned slot = issued % URING_DEPTH;
+            struct uring_job *job = &jobs[slot];
+            struct io_uring_sqe *sqe;
+
+            if(left == 0) {
+                uint32_t total = s->head + s->size;
+
+                if(s->fd >= 0 && !s->more && !sparse && (total & pagemask)) {
+                    uring_prep(uring_sqe(&r), IORING_OP_WRITE_FIXED, fd, padding,
+                               pagesize - (total & pagemask),
+                               s->offset + s->size, URING_DEPTH, URING_PADDING);
+                    inflight++;
+                }
+                seg++;
+                pos = 0;
+                continue;
+            }
+
+            job->seg = seg;
+            job->pos = pos;
+            job->len = left < URING_CHUNK_SIZE ? left : URING_CHUNK_SIZE;
+            job->read_done = false;
+            job->write_done = false;
+
+            sqe = uring_sqe(&r);
+            uring_prep(sqe, IORING_OP_READ_FIXED, s->fd, iov[slot].iov_base,
+                       job->len, pos, slot, (uint64_t)issued << 1);
+            sqe->flags |= IOSQE_IO_LINK;
+            uring_prep(uring_sqe(&r), IORING_OP_WRITE_FIXED, fd, iov[slot].iov_base,
+                       job->len, s->offset + pos, slot, (uint64_t)issued << 1 | 1);
+            inflight += 2;
+
+            pos += job->len;
+            issued++;
+        }
+
+        if(inflight == 0) break;
+
+        if(uring_submit(&r, 1)) {
+            if(ret == 0) ret = -1;
+            break;
+        }
+
+        /* reap completions */
+        {
+            unsigned head = *r.cq_head;
+            unsigned tail = __atomic_load_n(r.cq_tail, __ATOMIC_ACQUIRE);
+
+            for(; head != tail; head++) {
+                struct io_uring_cqe *cqe = &r.cqes[head & *r.cq_mask];
+                struct uring_job *job;
+
+                inflight--;
+                if(cqe->user_data == URING_PADDING) {
+                    if(cqe->res < 0 && ret == 0) {
+                        errno = -cqe->res;
+                        ret = -1;
+                    }
+                    continue;
+                }
+
+                job = &jobs[(cqe->user_data >> 1) % URING_DEPTH];
+                if(cqe->user_data & 1) {
+                    job->write_done = true;
+                    if(ret == 0 && cqe->res == -ECANCELED) continue;
+                    if(ret == 0 && cqe->res != (int) job->len) {
+                        errno = cqe->res < 0 ? -cqe->res : EIO;
+                        ret = -1;
+                    }
+                } else {
+                    job->read_done = true;
+                    if(ret == 0 && cqe->res != (int) job->len) {
+                        errno = -cqe->res;
+                        ret = read_error(&segs[job->seg], cqe->res < 0 ? -1 : 0);
+                    }
+                }
+            }
+            __atomic_store_n(r.cq_head, head, __ATOMIC_RELEASE);
+        }
+
+        /* hash in chunk order, then recycle buffers that are done */
+        while(ret == 0 && hashed < issued && jobs[hashed % URING_DEPTH].read_done) {
+            struct uring_job *job = &jobs[hashed % URING_DEPTH];
+            struct segment *s = &segs[job->seg];
+
+            for(; hash_seg < job->seg; hash_seg++) {
+                hash_segment_size(ctx, &segs[hash_seg]);
+            }
+            if(s->hashed) {
+                HASH_update(ctx, iov[hashed % URING_DEPTH].iov_base, job->len);
+                if(job->pos + job->len == s->size) {
+                    hash_segment_size(ctx, s);
+                }
+            }
+            if(job->pos + job->len == s->size) {
+                hash_seg++;
+            }
+            hashed++;
+        }
+        while(retired < hashed && jobs[retired % URING_DEPTH].write_done) {
+            retired++;
+        }
+
+        if(ret == 0 && seg == nsegs && retired == issued && inflight == 0) break;
+    }
+
+    for(; ret == 0 && hash_seg < nsegs; hash_seg++) {
+        hash_segment_size(ctx, &segs[hash_seg]);
+    }
+
+out:
+    uring_exit(&r);
+    for(i = 0; i < URING_DEPTH; i++) {
+        free(iov[i].iov_base);
+    }
+    return ret;
+}
+#else
+static int uring_segments(int fd, struct segment *segs, unsigned nsegs,
+                          unsigned pagesize, bool sparse, HASH_CTX *ctx)
+{
+    return 1;
+}
+#endif
+
+/*
+ * O_DIRECT output: the image is staged, header page and padding
+ * included, in a page-aligned buffer that is flushed whenever it fills,
+ * so every direct write starts at a multiple of DIRECT_BUFFER_SIZE in
+ * the image. Only the final partial buffer may not be block aligned; it
+ * is written through the page cache after O_DIRECT is cleared, as is the
+ * header once the id is known.
+ */
+#define DIRECT_BUFFER_SIZE (1024 * 1024)
+
+struct direct_writer {
+    int fd;
+    uint8_t *buf;
+    uint32_t used;
+};
+
+static int direct_flush(struct direct_writer *w)
+{
+    if(w->used == DIRECT_BUFFER_SIZE) {
+        if(write(w->fd, w->buf, w->used) != (ssize_t) w->used) return -1;
+        w->used = 0;
+    }
+    return 0;
+}
+
+static int direct_zeros(struct direct_writer *w, uint32_t len)
+{
+    while(len > 0) {
+        uint32_t count = DIRECT_BUFFER_SIZE - w->used;
+
+        if(count > len) count = len;
+        memset(w->buf + w->used, 0, count);
+        w->used += count;
+        len -= count;
+        if(direct_flush(w)) return -1;
+    }
+    return 0;
+}
+
+/* Same contract as write_segments(), except that the header page is
+ * reserved here as well, since the output was opened with O_DIRECT. */
+static int direct_segments(int fd, struct segment *segs, unsigned nsegs,
+                           unsigned pagesize, HASH_CTX *ctx)
+{
+    const unsigned pagemask = pagesize - 1;
+    struct direct_writer w;
+    unsigned i;
+    int flags;
+    int ret = 0;
+
+    w.fd = fd;
+    w.used = 0;
+    if(posix_memalign((void **)&w.buf, sysconf(_SC_PAGESIZE), DIRECT_BUFFER_SIZE)) {
+        return -1;
+    }
+
+    if(direct_zeros(&w, pagesize)) ret = -1;
+
+    for(i = 0; i < nsegs && ret == 0; i++) {
+        struct segment *seg = &segs[i];
+        uint32_t left = seg->size;
+
+        if(seg->fd < 0) left = 0;
+
+        while(ret == 0 && left > 0) {
+            uint32_t count = DIRECT_BUFFER_SIZE - w.used;
+            ssize_t n;
+
+            if(count > left) count = left;
+            n = pread(seg->fd, w.buf + w.used, count, seg->size - left);
+            if(n != (ssize_t) count) {
+                ret = read_error(seg, n);
+                break;
+            }
+            if(seg->hashed) {
+                HASH_update(ctx, w.buf + w.used, count);
+            }
+            w.used += count;
+            left -= count;
+            if(direct_flush(&w)) ret = -1;
+        }
+        if(ret == 0 && seg->fd >= 0 && !seg->more &&
+           ((seg->head + seg->size) & pagemask)) {
+            if(direct_zeros(&w, pagesize - ((seg->head + seg->size) & pagemask))) ret = -1;
+        }
+        if(ret == 0) {
+            hash_segment_size(ctx, seg);
+        }
+    }
+
+    /* the tail, and the header written later, go through the page cache */
+    flags = fcntl(fd, F_GETFL);
+    if(ret == 0 && (flags < 0 || fcntl(fd, F_SETFL, flags & ~O_DIRECT))) ret = -1;
+    if(ret == 0 && w.used && write(fd, w.buf, w.used) != (ssize_t) w.used) ret = -1;
+
+    free(w.buf);
+    return ret;
+}
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+ * Three-stage pipeline: a reader thread fills a ring of page-aligned
+ * chunks, a hasher thread folds them into the id in segment order and the
+ * calling thread writes them out, so reading, hashing and writing overlap.
+ * Each stage owns the slots between its own counter and the one of the
+ * stage before it; the reader may run at most PIPELINE_DEPTH slots ahead
+ * of the writer.
+ */
+#define PIPELINE_DEPTH 8
+
+enum pipeline_stage {
+    STAGE_READ = 0,
+    STAGE_HASH,
+    STAGE_WRITE,
+    STAGE_COUNT,
+};
+
+struct pipeline_slot {
+    uint8_t *data;
+    uint32_t len;
+    unsigned seg;
+    bool end;        /* last chunk of segment seg */
+};
+
+struct pipeline {
+    struct segment *segs;
+    unsigned nsegs;
+    HASH_CTX *ctx;
+
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    struct pipeline_slot slots[PIPELINE_DEPTH];
+    unsigned long done[STAGE_COUNT];
+    int error;       /* first failure, as returned by copy_segment() */
+    int saved_errno;
+
+    uint64_t busy_ns[STAGE_COUNT];
+};
+
+static void pipeline_fail(struct pipeline *p, int error)
+{
+    pthread_mutex_lock(&p->lock);
+    if(p->error == 0) {
+        p->error = error;
+        p->saved_errno = errno;
+    }
+    pthread_cond_broadcast(&p->cond);
+    pthread_mutex_unlock(&p->lock);
+}
+
+/* Wait for the next slot of a stage, or return NULL once any stage failed. */
+static struct pipeline_slot *pipeline_acquire(struct pipeline *p, enum pipeline_stage stage)
+{
+    struct pipeline_slot *slot = NULL;
+
+    pthread_mutex_lock(&p->lock);
+    for(;;) {
+        unsigned long next = p->done[stage];
+        bool ready;
+
+        if(p->error) break;
+        if(stage == STAGE_READ) {
+            ready = next - p->done[STAGE_WRITE] < PIPELINE_DEPTH;
+        } else {
+            ready = next < p->done[stage - 1];
+        }
+        if(ready) {
+            slot = &p->slots[next % PIPELINE_DEPTH];
+            break;
+        }
+        pthread_cond_wait(&p->cond, &p->lock);
+    }
+    pthread_mutex_unlock(&p->lock);
+    return slot;
+}
+
+static void pipeline_release(struct pipeline *p, enum pipeline_stage stage)
+{
+    pthread_mutex_lock(&p->lock);
+    p->done[stage]++;
+    pthread_cond_broadcast(&p->cond);
+    pthread_mutex_unlock(&p->lock);
+}
+
+/* Every segment produces at least one slot, an empty one if the segment
+ * is absent, so the later stages see each segment end in order. */
+static void *pipeline_reader(void *arg)
+{
+    struct pipeline *p = arg;
+    unsigned i;
+
+    for(i = 0; i < p->nsegs; i++) {
+        struct segment *seg = &p->segs[i];
+        uint32_t left = seg->fd >= 0 ? seg->size : 0;
+
+        do {
+            struct pipeline_slot *slot = pipeline_acquire(p, STAGE_READ);
+            uint32_t count = left < COPY_CHUNK_SIZE ? left : COPY_CHUNK_SIZE;
+            uint64_t start = now_ns();
+
+            if(slot == NULL) return NULL;
+            if(count) {
+                ssize_t n = pread(seg->fd, slot->data, count, seg->size - left);
+
+                if(n != (ssize_t) count) {
+                    pipeline_fail(p, read_error(seg, n));
+                    return NULL;
+                }
+            }
+            p->busy_ns[STAGE_READ] += now_ns() - start;
+
+            left -= count;
+            slot->len = count;
+            slot->seg = i;
+            slot->end = left == 0;
+            pipeline_release(p, STAGE_READ);
+        } while(left > 0);
+    }
+    return NULL;
+}
+
+static void *pipeline_hasher(void *arg)
+{
+    struct pipeline *p = arg;
+    bool finished = false;
+
+    while(!finished) {
+        struct pipeline_slot *slot = pipeline_acquire(p, STAGE_HASH);
+        struct segment *seg;
+        uint64_t start = now_ns();
+
+        if(slot == NULL) return NULL;
+        seg = &p->segs[slot->seg];
+        if(seg->hashed) {
+            HASH_update(p->ctx, slot->data, slot->len);
+            if(slot->end) {
+                hash_segment_size(p->ctx, seg);
+            }
+        }
+        finished = slot->end && slot->seg == p->nsegs - 1;
+        p->busy_ns[STAGE_HASH] += now_ns() - start;
+        pipeline_release(p, STAGE_HASH);
+    }
+    return NULL;
+}
+
+/* Same contract as write_segments(), with the writer stage run on the
+ * calling thread. Each stage's busy time goes to the stats. */
+static int pipeline_segments(int fd, struct segment *segs, unsigned nsegs,
+                             unsigned pagesize, bool sparse, HASH_CTX *ctx)
+{
+    const size_t align = sysconf(_SC_PAGESIZE);
+    struct pipeline p;
+    pthread_t reader, hasher;
+    bool finished = false;
+    unsigned i;
+    int ret;
+
+    memset(&p, 0, sizeof(p));
+    p.segs = segs;
+    p.nsegs = nsegs;
+    p.ctx = ctx;
+    pthread_mutex_init(&p.lock, NULL);
+    pthread_cond_init(&p.cond, NULL);
+
+    for(i = 0; i < PIPELINE_DEPTH; i++) {
+        void *data;
+        if(posix_memalign(&data, align, COPY_CHUNK_SIZE)) {
+            ret = -1;
+            goto out;
+        }
+        p.slots[i].data = data;
+    }
+
+    if(pthread_create(&reader, NULL, pipeline_reader, &p)) {
+        ret = -1;
+        goto out;
+    }
+    if(pthread_create(&hasher, NULL, pipeline_hasher, &p)) {
+        pipeline_fail(&p, -1);
+        pthread_join(reader, NULL);
+        ret = -1;
+        goto out;
+    }
+
+    while(!finished) {
+        struct pipeline_slot *slot = pipeline_acquire(&p, STAGE_WRITE);
+        struct segment *seg;
+        uint64_t start = now_ns();
+
+        if(slot == NULL) break;
+        seg = &segs[slot->seg];
+        if(slot->len && write(fd, slot->data, slot->len) != (ssize_t) slot->len) {
+            pipeline_fail(&p, -1);
+            break;
+        }
+        if(slot->end && seg->fd >= 0 && !seg->more &&
+           write_padding(fd, pagesize, seg->head + seg->size, sparse)) {
+            pipeline_fail(&p, -1);
+            break;
+        }
+        finished = slot->end && slot->seg == nsegs - 1;
+        p.busy_ns[STAGE_WRITE] += now_ns() - start;
+        pipeline_release(&p, STAGE_WRITE);
+    }
+
+    pthread_join(reader, NULL);
+    pthread_join(hasher, NULL);
+
+    ret = p.error;
+    errno = p.saved_errno;
+
+    stats_add("pipeline read", p.busy_ns[STAGE_READ], 0);
+    stats_add("pipeline hash", p.busy_ns[STAGE_HASH], 0);
+    stats_add("pipeline write", p.busy_ns[STAGE_WRITE], 0);
+
+out:
+    for(i = 0; i < PIPELINE_DEPTH; i++) {
+        free(p.slots[i].data);
+    }
+    pthread_cond_destroy(&p.cond);
+    pthread_mutex_destroy(&p.lock);
+    return ret;
+}
+
+static void default_opts(struct build_opts *o)
+{
+    memset(o, 0, sizeof(*o));
+    o->stdout_fd = STDOUT_FILENO;
+    o->cmdline = "";
+    o->board = "";
+    o->base           = 0x10000000U;
+    o->kernel_offset  = 0x00008000U;
+    o->ramdisk_offset = 0x01000000U;
+    o->second_offset  = 0x00f00000U;
+    o->tags_offset    = 0x00000100U;
+    o->dtb_offset     = 0x01f00000U;
+    o->pagesize = 2048;
+    o->hash_alg = HASH_SHA1;
+    o->io_method = IO_ZEROCOPY;
+    o->cache_size = CACHE_DEFAULT_SIZE;
+    o->compress_level = -1;
+    if(getenv("SOURCE_DATE_EPOCH")) {
+        o->ramdisk_mtime = strtoull(getenv("SOURCE_DATE_EPOCH"), 0, 10);
+    }
+}
+
+/* A byte count, decimal or 0x hex, with an optional K, M or G suffix. */
+static int parse_size(const char *val, uint64_t *size)
+{
+    char *end;
+
+    *size = strtoull(val, &end, 0);
+    if(*end == 'K' || *end == 'k') *size <<= 10, end++;
+    else if(*end == 'M' || *end == 'm') *size <<= 20, end++;
+    else if(*end == 'G' || *end == 'g') *size <<= 30, end++;
+    return (end == val || *end) ? -1 : 0;
+}
+
+int parse_opts(int argc, char **argv, struct build_opts *o,
+               char *err, size_t errlen)
+{
+    err[0] = '\0';
+
+    while(argc > 0){
+        char *arg = argv[0];
+        if(!strcmp(arg, "--id")) {
+            o->get_id = true;
+            argc -= 1;
+            argv += 1;
+        } else if(!strcmp(arg, "--reflink")) {
+            o->reflink = true;
+            o->set |= OPT_WRITE;
+            argc -= 1;
+            argv += 1;
+        } else if(!strcmp(arg, "--diff-write")) {
+            o->diff_write = true;
+            o->set |= OPT_WRITE;
+            argc -= 1;
+            argv += 1;
+        } else if(!strcmp(arg, "--direct-io")) {
+            o->direct_io = true;
+            o->set |= OPT_WRITE;
+            argc -= 1;
+            argv += 1;
+        } else if(!strcmp(arg, "--stats") || !strcmp(arg, "--timing")) {
+            o->stats = STATS_TEXT;
+            argc -= 1;
+            argv += 1;
+        } else if(!strncmp(arg, "--stats=", 8)) {
+            o->stats = stats_parse_format(arg + 8);
+            if(o->stats == STATS_OFF) {
+                snprintf(err, errlen, "unknown stats format '%s'", arg + 8);
+                return -1;
+            }
+            argc -= 1;
+            argv += 1;
+        } else if(argc >= 2) {
+            char *val = argv[1];
+            argc -= 2;
+            argv += 2;
+            if(!strcmp(arg, "--output") || !strcmp(arg, "-o")) {
+                o->output = val;
+            } else if(!strcmp(arg, "--kernel")) {
+                o->kernel_fn = val;
+                o->set |= OPT_INPUTS;
+            } else if(!strcmp(arg, "--ramdisk")) {
+                o->ramdisk_fn = val;
+                o->set |= OPT_INPUTS;
+            } else if(!strcmp(arg, "--ramdisk-dir")) {
+                o->ramdisk_dir = val;
+                o->set |= OPT_INPUTS;
+            } else if(!strcmp(arg, "--ramdisk-compress")) {
+                o->ramdisk_compress = parse_compress_method(val);
+                if(o->ramdisk_compress == COMPRESS_UNKNOWN) {
+                    snprintf(err, errlen, "unknown compression '%s'", val);
+                    return -1;
+                }
+                o->set |= OPT_INPUTS;
+            } else if(!strcmp(arg, "--compress-level")) {
+                char *end;
+
+                o->compress_level = strtol(val, &end, 10);
+                if(*end || o->compress_level < 1 || o->compress_level > 9) {
+                    snprintf(err, errlen, "invalid compression level '%s'", val);
+                    return -1;
+                }
+            } else if(!strcmp(arg, "--compress-threads")) {
+                char *end;
+                unsigned long n = strtoul(val, &end, 10);
+
+                if(*end || end == val || n == 0 || n > UINT_MAX) {
+                    snprintf(err, errlen, "invalid thread count '%s'", val);
+                    return -1;
+                }
+                o->compress_threads = n;
+            } else if(!strcmp(arg, "--second")) {
+                o->second_fn = val;
+                o->set |= OPT_INPUTS;
+            } else if(!strcmp(arg, "--dtb")) {
+                o->dtb_fn = val;
+                o->set |= OPT_INPUTS;
+            } else if(!strcmp(arg, "--recovery_dtbo") || !strcmp(arg, "--recovery_acpio")) {
+                o->recovery_dtbo_fn = val;
+                o->set |= OPT_INPUTS;
+            } else if(!strcmp(arg, "--cmdline")) {
+                o->cmdline = val;
+                o->set |= OPT_CMDLINE;
+            } else if(!strcmp(arg, "--base")) {
+                o->base = strtoul(val, 0, 16);
+                o->set |= OPT_ADDRESSES;
+            } else if(!strcmp(arg, "--kernel_offset")) {
+                o->kernel_offset = strtoul(val, 0, 16);
+                o->set |= OPT_ADDRESSES;
+            } else if(!strcmp(arg, "--ramdisk_offset")) {
+                o->ramdisk_offset = strtoul(val, 0, 16);
+                o->set |= OPT_ADDRESSES;
+            } else if(!strcmp(arg, "--second_offset")) {
+                o->second_offset = strtoul(val, 0, 16);
+                o->set |= OPT_ADDRESSES;
+            } else if(!strcmp(arg, "--tags_offset")) {
+                o->tags_offset = strtoul(val, 0, 16);
+                o->set |= OPT_ADDRESSES;
+            } else if(!strcmp(arg, "--dtb_offset")) {
+                o->dtb_offset = strtoul(val, 0, 16);
+                o->set |= OPT_ADDRESSES;
+            } else if(!strcmp(arg, "--board")) {
+                o->board = val;
+                o->set |= OPT_BOARD;
+            } else if(!strcmp(arg,"--pagesize")) {
+                uint32_t pagesize = strtoul(val, 0, 10);
+                if((pagesize != 2048) && (pagesize != 4096)
+                    && (pagesize != 8192) && (pagesize != 16384)
+                    && (pagesize != 32768) && (pagesize != 65536)
+                    && (pagesize != 131072)) {
+                    snprintf(err, errlen, "unsupported page size %d", pagesize);
+                    return -1;
+                }
+                o->pagesize = pagesize;
+                o->set |= OPT_FORMAT;
+            } else if(!strcmp(arg, "--dt")) {
+                o->dt_fn = val;
+                o->set |= OPT_INPUTS;
+            } else if(!strcmp(arg, "--os_version")) {
+                o->os_version = bootimg_parse_os_version(val);
+                o->set |= OPT_OS_VERSION;
+            } else if(!strcmp(arg, "--os_patch_level")) {
+                o->os_patch_level = bootimg_parse_os_patch_level(val);
+                o->set |= OPT_OS_PATCH_LEVEL;
+            } else if(!strcmp(arg, "--header_version")) {
+                o->header_version = strtoul(val, 0, 10);
+                o->set |= OPT_FORMAT;
+            } else if(!strcmp(arg, "--hashtype")) {
+                o->hash_alg = parse_hash_alg(val);
+                if(o->hash_alg == HASH_UNKNOWN) {
+                    snprintf(err, errlen, "unknown hash algorithm '%s'", val);
+                    return -1;
+                }
+                o->set |= OPT_HASHTYPE;
+            } else if(!strcmp(arg, "--io")) {
+                o->io_set = true;
+                o->set |= OPT_WRITE;
+                o->io_method = parse_io_method(val);
+                if(o->io_method == IO_UNKNOWN) {
+                    snprintf(err, errlen, "unknown io method '%s'", val);
+                    return -1;
+                }
+            } else if(!strcmp(arg, "--id-cache")) {
+                o->id_cache = val;
+            } else if(!strcmp(arg, "--cache")) {
+                o->cache = val;
+            } else if(!strcmp(arg, "--cache-size")) {
+                if(parse_size(val, &o->cache_size)) {
+                    snprintf(err, errlen, "invalid cache size '%s'", val);
+                    return -1;
+                }
+            } else if(!strcmp(arg, "--output-offset")) {
+                if(parse_size(val, &o->output_offset)) {
+                    snprintf(err, errlen, "invalid output offset '%s'", val);
+                    return -1;
+                }
+                o->output_offset_set = true;
+                o->set |= OPT_WRITE;
+            } else if(!strcmp(arg, "--output-limit")) {
+                if(parse_size(val, &o->output_limit) || o->output_limit == 0) {
+                    snprintf(err, errlen, "invalid output limit '%s'", val);
+                    return -1;
+                }
+            } else if(!strcmp(arg, "--update")) {
+                o->update = val;
+            } else if(!strcmp(arg, "--serve")) {
+                o->serve = val;
+            } else if(!strcmp(arg, "--batch")) {
+                o->batch = val;
+            } else if(!strcmp(arg, "--jobs")) {
+                o->jobs = strtoul(val, 0, 10);
+                if(o->jobs == 0) {
+                    snprintf(err, errlen, "invalid job count '%s'", val);
+                    return -1;
+                }
+            } else {
+                return -1;
+            }
+        } else {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int check_opts(struct build_opts *o, char *err, size_t errlen)
+{
+    /* both are left at their defaults when nothing is compressed */
+    if(o->ramdisk_compress == COMPRESS_NONE &&
+       (o->compress_level >= 0 || o->compress_threads)) {
+        snprintf(err, errlen, "%s needs --ramdisk-compress",
+                 o->compress_level >= 0 ? "--compress-level" : "--compress-threads");
+        return -1;
+    }
+
+    if(o->update) {
+        if(o->output) {
+            snprintf(err, errlen, "--update cannot be combined with --output");
+            return 1;
+        }
+        if(o->cache) {
+            snprintf(err, errlen, "--update cannot be combined with --cache");
+            return 1;
+        }
+        if(o->set & (OPT_FORMAT | OPT_WRITE)) {
+            snprintf(err, errlen, "--update cannot change the page size, "
+                     "header version or how the image is written");
+            return 1;
+        }
+        if(strlen(o->board) >= BOOT_NAME_SIZE) {
+            snprintf(err, errlen, "board name too large");
+            return 1;
+        }
+        if(strlen(o->cmdline) > BOOTIMG_CMDLINE_MAX) {
+            snprintf(err, errlen, "kernel commandline too large");
+            return -1;
+        }
+        if((o->kernel_fn && strchr(o->kernel_fn, ',')) ||
+           (o->ramdisk_fn && strchr(o->ramdisk_fn, ',')) ||
+           (o->second_fn && strchr(o->second_fn, ',')) ||
+           (o->dt_fn && strchr(o->dt_fn, ',')) ||
+           (o->dtb_fn && strchr(o->dtb_fn, ',')) ||
+           (o->recovery_dtbo_fn && strchr(o->recovery_dtbo_fn, ','))) {
+            snprintf(err, errlen, "--update takes a single file per segment");
+            return -1;
+        }
+        if(o->ramdisk_dir) {
+            snprintf(err, errlen, "--update cannot be combined with --ramdisk-dir");
+            return -1;
+        }
+        if(o->ramdisk_compress != COMPRESS_NONE) {
+            snprintf(err, errlen, "--update cannot be combined with --ramdisk-compress");
+            return -1;
+        }
+        return 0;
+    }
+
+    if(o->direct_io) {
+        if(o->io_set && o->io_method != IO_DIRECT) {
+            snprintf(err, errlen, "--direct-io cannot be combined with --io %s",
+                     io_method_name(o->io_method));
+            return -1;
+        }
+        o->io_method = IO_DIRECT;
+    }
+
+    if(o->ramdisk_compress == COMPRESS_LZ4 && o->compress_level >= 0) {
+        snprintf(err, errlen, "lz4 has no compression levels");
+        return -1;
+    }
+
+    if(o->output == 0) {
+        snprintf(err, errlen, "no output filename specified");
+        return 1;
+    }
+
+    if(o->kernel_fn == 0) {
+        snprintf(err, errlen, "no kernel image specified");
+        return 1;
+    }
+
+    if(strlen(o->board) >= BOOT_NAME_SIZE) {
+        snprintf(err, errlen, "board name too large");
+        return 1;
+    }
+
+    if(strlen(o->cmdline) > BOOTIMG_CMDLINE_MAX) {
+        snprintf(err, errlen, "kernel commandline too large");
+        return -1;
+    }
+
+    if(o->reflink && o->io_method != IO_RW && o->io_method != IO_ZEROCOPY) {
+        snprintf(err, errlen, "--reflink cannot be combined with --io %s",
+                 io_method_name(o->io_method));
+        return -1;
+    }
+
+    if(o->diff_write) {
+        if(o->io_set || o->direct_io || o->reflink) {
+            snprintf(err, errlen, "--diff-write cannot be combined with "
+                     "--io, --direct-io or --reflink");
+            return -1;
+        }
+        if(o->cache) {
+            snprintf(err, errlen, "--diff-write cannot be combined with --cache");
+            return -1;
+        }
+        if(!strcmp(o->output, "-")) {
+            snprintf(err, errlen, "--diff-write needs a seekable output");
+            return -1;
+        }
+    }
+
+    if(o->output_offset_set) {
+        if(o->cache) {
+            snprintf(err, errlen, "--output-offset cannot be combined with --cache");
+            return -1;
+        }
+        if(!strcmp(o->output, "-")) {
+            snprintf(err, errlen, "--output-offset needs a seekable output");
+            return -1;
+        }
+        if(o->io_method == IO_DIRECT && (o->output_offset & 4095)) {
+            snprintf(err, errlen, "--output-offset must be a multiple of 4096 "
+                     "with direct I/O");
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* Inputs shared between images, by a batch or by a server. Each distinct
+ * file, by path or by device and inode, is opened once and prefetched
+ * once; the builds then read it concurrently with pread() through the
+ * one fd. A file that changes on disk is noticed by its size and
+ * timestamps and opened afresh, while builds still using the old one
+ * keep it until they let go. The hash state after a file used as a
+ * kernel is kept with it, so later builds skip hashing the kernel.
+ * Unused files are closed, least recently used first, once the cache
+ * holds more than its limit. */
+#define INPUT_CACHE_MAX_FILES 256
+
+struct input {
+    char *fn;
+    dev_t dev;
+    ino_t ino;
+    struct timespec mtime;
+    struct timespec ctime;
+    struct segment seg;     /* fd, size and the prefetch thread */
+    unsigned refs;
+    bool stale;             /* changed on disk, only kept for its users */
+    uint64_t used;
+    bool have_id[2];        /* per enum hash_alg */
+    HASH_CTX id[2];         /* the id state after this file as the kernel */
+    struct input *next;     /* on a dropped list, see input_detach() */
+};
+
+void input_cache_init(struct input_cache *c, uint64_t limit)
+{
+    pthread_mutex_init(&c->lock, NULL);
+    c->inputs = NULL;
+    c->count = 0;
+    c->alloc = 0;
+    c->bytes = 0;
+    c->limit = limit;
+    c->clock = 0;
+}
+
+/* Take an input out of the cache onto the dropped list, to be freed with
+ * input_release() once the lock is let go: waiting for its prefetch
+ * thread must not hold up the other builds. Called with the lock held. */
+static void input_detach(struct input_cache *c, unsigned i, struct input **dropped)
+{
+    struct input *in = c->inputs[i];
+
+    c->bytes -= in->seg.size;
+    c->inputs[i] = c->inputs[--c->count];
+    in->next = *dropped;
+    *dropped = in;
+}
+
+static void input_release(struct input *dropped)
+{
+    while(dropped) {
+        struct input *in = dropped;
+
+        dropped = in->next;
+        finish_prefetch(&in->seg, 1);
+        close(in->seg.fd);
+        free(in->fn);
+        free(in);
+    }
+}
+
+void input_cache_destroy(struct input_cache *c)
+{
+    struct input *dropped = NULL;
+
+    while(c->count > 0) {
+        input_detach(c, c->count - 1, &dropped);
+    }
+    input_release(dropped);
+    free(c->inputs);
+    pthread_mutex_destroy(&c->lock);
+}
+
+static bool input_current(const struct input *in, const struct stat *st)
+{
+    return in->dev == st->st_dev && in->ino == st->st_ino &&
+           (uint64_t) in->seg.size == (uint64_t) st->st_size &&
+           in->mtime.tv_sec == st->st_mtim.tv_sec &&
+           in->mtime.tv_nsec == st->st_mtim.tv_nsec &&
+           in->ctime.tv_sec == st->st_ctim.tv_sec &&
+           in->ctime.tv_nsec == st->st_ctim.tv_nsec;
+}
+
+/* Called with the lock held. */
+static void input_cache_trim(struct input_cache *c, struct input **dropped)
+{
+    while(c->limit && (c->bytes > c->limit || c->count > INPUT_CACHE_MAX_FILES)) {
+        unsigned i, lru = c->count;
+
+        for(i = 0; i < c->count; i++) {
+            if(c->inputs[i]->refs == 0 &&
+               (lru == c->count || c->inputs[i]->used < c->inputs[lru]->used)) {
+                lru = i;
+            }
+        }
+        if(lru == c->count) break;      /* everything is in use */
+        input_detach(c, lru, dropped);
+    }
+}
+
+/* Like open_file(), but the fd belongs to the cache. It must not be
+ * closed or have its offset relied upon, and must be handed back with
+ * input_cache_close() once the build is done with it. */
+static int input_cache_open(struct input_cache *c, const char *fn, unsigned *_sz)
+{
+    struct input *in = NULL;
+    struct input *dropped = NULL;
+    struct stat st;
+    unsigned i;
+    unsigned sz;
+    int fd = -1;
+
+    pthread_mutex_lock(&c->lock);
+
+    if(stat(fn, &st) == 0) {
+        for(i = 0; i < c->count; i++) {
+            struct input *cand = c->inputs[i];
+
+            if(cand->stale || strcmp(cand->fn, fn)) continue;
+            if(input_current(cand, &st)) {
+                in = cand;
+                goto found;
+            }
+            cand->stale = true;
+        }
+    }
+
+    fd = open_file(fn, &sz);
+    if(fd < 0) goto out;
+    if(fstat(fd, &st)) {
+        close(fd);
+        fd = -1;
+        goto out;
+    }
+
+    /* the same file under another name shares the first fd */
+    for(i = 0; i < c->count; i++) {
+        if(!c->inputs[i]->stale && input_current(c->inputs[i], &st)) {
+            close(fd);
+            in = c->inputs[i];
+            goto found;
+        }
+    }
+
+    if(c->count == c->alloc) {
+        unsigned alloc = c->alloc ? c->alloc * 2 : 16;
+        struct input **inputs = realloc(c->inputs, alloc * sizeof(*inputs));
+
+        if(inputs == NULL) goto oops;
+        c->inputs = inputs;
+        c->alloc = alloc;
+    }
+    in = calloc(1, sizeof(*in));
+    if(in == NULL) goto oops;
+    in->fn = strdup(fn);
+    if(in->fn == NULL) {
+        free(in);
+        goto oops;
+    }
+    in->dev = st.st_dev;
+    in->ino = st.st_ino;
+    in->mtime = st.st_mtim;
+    in->ctime = st.st_ctim;
+    in->seg.name = in->fn;
+    in->seg.fn = in->fn;
+    in->seg.fd = fd;
+    in->seg.size = sz;
+    c->inputs[c->count++] = in;
+    c->bytes += sz;
+    start_prefetch(&in->seg, 1);
+
+found:
+    in->refs++;
+    in->used = ++c->clock;
+    fd = in->seg.fd;
+    if(_sz) *_sz = in->seg.size;
+    input_cache_trim(c, &dropped);
+out:
+    pthread_mutex_unlock(&c->lock);
+    input_release(dropped);
+    return fd;
+
+oops:
+    close(fd);
+    pthread_mutex_unlock(&c->lock);
+    return -1;
+}
+
+/* Called with the lock held. */
+static struct input *input_find(struct input_cache *c, int fd)
+{
+    unsigned i;
+
+    for(i = 0; i < c->count; i++) {
+        if(c->inputs[i]->seg.fd == fd) return c->inputs[i];
+    }
+    return NULL;
+}
+
+static void input_cache_close(struct input_cache *c, int fd)
+{
+    struct input *in;
+    struct input *dropped = NULL;
+    unsigned i;
+
+    pthread_mutex_lock(&c->lock);
+    in = input_find(c, fd);
+    if(in && --in->refs == 0) {
+        for(i = 0; i < c->count && c->inputs[i] != in; i++)
+            ;
+        if(in->stale) input_detach(c, i, &dropped);
+        else input_cache_trim(c, &dropped);
+    }
+    pthread_mutex_unlock(&c->lock);
+    input_release(dropped);
+}
+
+/* Fetch or save the id state after the file behind fd, used as the
+ * kernel, and its size. */
+static int input_cache_load_id(struct input_cache *c, int fd, enum hash_alg alg,
+                               HASH_CTX *ctx)
+{
+    struct input *in;
+    int ret = -1;
+
+    pthread_mutex_lock(&c->lock);
+    in = input_find(c, fd);
+    if(in && in->have_id[alg]) {
+        *ctx = in->id[alg];
+        ret = 0;
+    }
+    pthread_mutex_unlock(&c->lock);
+    return ret;
+}
+
+static void input_cache_store_id(struct input_cache *c, int fd, enum hash_alg alg,
+                                 const HASH_CTX *ctx)
+{
+    struct input *in;
+
+    pthread_mutex_lock(&c->lock);
+    in = input_find(c, fd);
+    if(in) {
+        in->id[alg] = *ctx;
+        in->have_id[alg] = true;
+    }
+    pthread_mutex_unlock(&c->lock);
+}
+
+/* An existing image, as described by its header. The segments carry the
+ * sizes and offsets the header implies, and the image's own fd for those
+ * that are present. */
+struct boot_image {
+    int fd;
+    unsigned version;
+    uint32_t pagesize;
+    union {
+        boot_img_hdr_v2 v2;     /* also v0 and v1, which it extends */
+        boot_img_hdr_v3 v3;
+    } hdr;
+    struct segment segs[SEG_COUNT];
+    uint64_t size;
+};
+
+/* Header versions above this are taken to be a v0 dt_size, the same
+ * guess unpackbootimg makes. */
+#define HEADER_VERSION_MAX 4
+
+/* Open an existing image and check that its header is one we can write
+ * and that the file holds everything the header describes. Returns 0,
+ * or -1 with a message in err. */
+static int open_image(const char *fn, int flags, struct boot_image *img,
+                      char *err, size_t errlen)
+{
+    boot_img_hdr_v2 *hdr = &img->hdr.v2;
+    uint32_t sizes[SEG_COUNT] = { 0, };
+    off_t end;
+    unsigned i;
+
+    memset(img, 0, sizeof(*img));
+    img->fd = open(fn, flags);
+    if(img->fd < 0) {
+        snprintf(err, errlen, "could not open '%s': %s", fn, strerror(errno));
+        return -1;
+    }
+
+    if(pread(img->fd, &img->hdr, sizeof(img->hdr), 0) != sizeof(img->hdr) ||
+       memcmp(hdr->magic, BOOT_MAGIC, BOOT_MAGIC_SIZE)) {
+        snprintf(err, errlen, "'%s' is not a boot image", fn);
+        goto fail;
+    }
+
+    /* header_version is at the same offset in every version */
+    img->version = hdr->header_version > HEADER_VERSION_MAX ? 0 : hdr->header_version;
+    if(img->version == 3) {
+        img->pagesize = 4096;
+        sizes[SEG_KERNEL] = img->hdr.v3.kernel_size;
+        sizes[SEG_RAMDISK] = img->hdr.v3.ramdisk_size;
+    } else if(img->version < 3) {
+        img->pagesize = hdr->page_size;
+        sizes[SEG_KERNEL] = hdr->kernel_size;
+        sizes[SEG_RAMDISK] = hdr->ramdisk_size;
+        sizes[SEG_SECOND] = hdr->second_size;
+        if(img->version == 0 && hdr->dt_size > HEADER_VERSION_MAX) {
+            sizes[SEG_DT] = hdr->dt_size;
+        }
+        if(img->version > 0) {
+            sizes[SEG_RECOVERY_DTBO] = hdr->recovery_dtbo_size;
+        }
+        if(img->version > 1) {
+            sizes[SEG_DTB] = hdr->dtb_size;
+        }
+    } else {
+        snprintf(err, errlen, "'%s' has unsupported header version %u", fn, img->version);
+        goto fail;
+    }
+
+    if(img->pagesize < 2048 || img->pagesize > 131072 ||
+       (img->pagesize & (img->pagesize - 1))) {
+        snprintf(err, errlen, "'%s' has invalid page size %u", fn, img->pagesize);
+        goto fail;
+    }
+
+    img->segs[SEG_KERNEL].name = "kernel";
+    img->segs[SEG_RAMDISK].name = "ramdisk";
+    img->segs[SEG_SECOND].name = "secondstage";
+    img->segs[SEG_DT].name = "dt";
+    img->segs[SEG_RECOVERY_DTBO].name = "recovery dtbo";
+    img->segs[SEG_DTB].name = "dtb";
+    for(i = 0; i < SEG_COUNT; i++) {
+        img->segs[i].fn = fn;
+        img->segs[i].size = sizes[i];
+        img->segs[i].fd = sizes[i] ? img->fd : -1;
+    }
+    img->size = plan_layout(img->segs, SEG_COUNT, img->pagesize, 0, NULL, 0);
+
+    if(img->version > 0 && img->version < 3 && hdr->recovery_dtbo_size &&
+       hdr->recovery_dtbo_offset != img->segs[SEG_RECOVERY_DTBO].offset) {
+        snprintf(err, errlen, "'%s' has an unexpected recovery dtbo offset", fn);
+        goto fail;
+    }
+
+    /* lseek() rather than fstat() so block devices report their size */
+    end = lseek(img->fd, 0, SEEK_END);
+    if(end < 0 || (uint64_t) end < img->size) {
+        snprintf(err, errlen, "'%s' is truncated", fn);
+        goto fail;
+    }
+    return 0;
+
+fail:
+    close(img->fd);
+    img->fd = -1;
+    return -1;
+}
+
+/* Detect the id hash of an existing image the way unpackbootimg does:
+ * SHA-1 leaves the tail of the id zero, allowing for variants with a
+ * 20 byte board name. */
+static enum hash_alg image_hash_alg(const boot_img_hdr_v2 *hdr)
+{
+    const uint8_t *id = (const uint8_t *) hdr->id;
+    unsigned i;
+
+    for(i = SHA_DIGEST_SIZE + 4; i < SHA256_DIGEST_SIZE; i++) {
+        if(id[i]) return HASH_SHA256;
+    }
+    return HASH_SHA1;
+}
+
+/* Write the segments of an image whose layout changed to a new file next
+ * to it, then rename that over the old one. Segments that were not
+ * replaced are copied straight from the old image, at offset src[i]. */
+static int rebuild_image(const char *fn, struct boot_image *img,
+                         struct segment *segs, const uint64_t *src,
+                         const void *hdr, size_t hdr_sz, uint64_t image_sz,
+                         char *err, size_t errlen)
+{
+    char tmp[PATH_MAX + 8];
+    struct stat st;
+    unsigned i;
+    int ret = 0;
+    int fd;
+
+    if(fstat(img->fd, &st) || !S_ISREG(st.st_mode)) {
+        snprintf(err, errlen, "'%s' is not a regular file, and its layout "
+                 "has to change", fn);
+        return -1;
+    }
+
+    snprintf(tmp, sizeof(tmp), "%s.XXXXXX", fn);
+    fd = mkstemp(tmp);
+    if(fd < 0) {
+        snprintf(err, errlen, "could not create '%s': %s", tmp, strerror(errno));
+        return -1;
+    }
+
+    for(i = 0; i < SEG_COUNT && ret == 0; i++) {
+        if(segs[i].fd >= 0) {
+            ret = write_segment_at(fd, &segs[i], src[i], img->pagesize, true);
+        }
+    }
+    if(ret == 0 && (fchmod(fd, st.st_mode & 07777) ||
+                    ftruncate(fd, image_sz) ||
+                    pwrite(fd, hdr, hdr_sz, 0) != (ssize_t) hdr_sz)) {
+        ret = -1;
+    }
+    if(ret == -2) {
+        for(i = 0; i < SEG_COUNT && !segs[i].failed; i++)
+            ;
+        snprintf(err, errlen, "could not read %s '%s': %s",
+                 segs[i].name, segs[i].fn,
+                 segs[i].error ? strerror(segs[i].error) : "unexpected end of file");
+    } else if(ret) {
+        snprintf(err, errlen, "failed writing '%s': %s", tmp, strerror(errno));
+    }
+    if(close(fd) && ret == 0) {
+        snprintf(err, errlen, "failed writing '%s': %s", tmp, strerror(errno));
+        ret = -1;
+    }
+    if(ret == 0 && rename(tmp, fn)) {
+        snprintf(err, errlen, "could not replace '%s': %s", fn, strerror(errno));
+        ret = -1;
+    }
+    if(ret) unlink(tmp);
+    return ret;
+}
+
+/* Change an existing image in place. Header-only fields (cmdline, board,
+ * os version and load addresses) are not covered by the id, so changing
+ * just those rewrites just the header. Replaced segments that still
+ * take the same number of pages are written over the old ones, and the
+ * id is recomputed from the new inputs and the rest of the image,
+ * resuming after the kernel from --id-cache where possible. If the
+ * layout has to move, the image is rebuilt into a new file instead. */
+int update_image(const struct build_opts *o, struct build_result *res)
+{
+    struct boot_image img;
+    boot_img_hdr_v2 *hdr = &img.hdr.v2;
+    const char *inputs[SEG_COUNT] = {
+        [SEG_KERNEL] = o->kernel_fn,
+        [SEG_RAMDISK] = o->ramdisk_fn,
+        [SEG_SECOND] = o->second_fn,
+        [SEG_DT] = o->dt_fn,
+        [SEG_RECOVERY_DTBO] = o->recovery_dtbo_fn,
+        [SEG_DTB] = o->dtb_fn,
+    };
+    struct segment segs[SEG_COUNT];
+    uint64_t src[SEG_COUNT];
+    bool replaced = false;
+    bool in_place = true;
+    enum hash_alg alg;
+    HASH_CTX ctx;
+    HASH_CTX after_kernel;
+    uint64_t image_sz;
+    uint32_t os_version;
+    struct stat st;
+    size_t hdr_sz;
+    unsigned i;
+    int ret = 1;
+
+    res->error[0] = '\0';
+    if(open_image(o->update, O_RDWR, &img, res->error, sizeof(res->error))) {
+        return 1;
+    }
+    memcpy(segs, img.segs, sizeof(segs));
+    for(i = 0; i < SEG_COUNT; i++) {
+        src[i] = img.segs[i].offset;
+    }
+
+    /* open the replacements; a segment keeps its place if it still
+     * covers the same number of pages */
+    for(i = 0; i < SEG_COUNT; i++) {
+        struct segment *seg = &segs[i];
+        uint32_t old_pages = (seg->size + img.pagesize - 1) / img.pagesize;
+        bool allowed;
+
+        if(inputs[i] == NULL) continue;
+
+        allowed = i == SEG_KERNEL || i == SEG_RAMDISK ||
+                  (img.version < 3 && i == SEG_SECOND) ||
+                  (img.version == 0 && i == SEG_DT) ||
+                  (img.version == 1 && i == SEG_RECOVERY_DTBO) ||
+                  (img.version == 2 && (i == SEG_RECOVERY_DTBO || i == SEG_DTB));
+        if(!allowed) {
+            snprintf(res->error, sizeof(res->error),
+                     "header version %u has no %s", img.version, seg->name);
+            goto out;
+        }
+
+        seg->fn = inputs[i];
+        seg->fd = open_file(inputs[i], &seg->size);
+        if(seg->fd < 0 || (i >= SEG_DT && seg->size == 0)) {
+            snprintf(res->error, sizeof(res->error),
+                     "could not load %s '%s'", seg->name, inputs[i]);
+            goto out;
+        }
+        src[i] = 0;
+        replaced = true;
+        if((seg->size + img.pagesize - 1) / img.pagesize != old_pages) {
+            in_place = false;
+        }
+    }
+
+    /* an image hardlinked from elsewhere gets a file of its own rather
+     * than changing every link */
+    if(fstat(img.fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_nlink > 1) {
+        in_place = false;
+    }
+
+    if(img.version == 3) {
+        if(o->set & (OPT_BOARD | OPT_ADDRESSES)) {
+            snprintf(res->error, sizeof(res->error),
+                     "header version 3 has no board name or load addresses");
+            goto out;
+        }
+        if(o->set & OPT_CMDLINE) {
+            memset(img.hdr.v3.cmdline, 0, sizeof(img.hdr.v3.cmdline));
+            strncpy((char *)img.hdr.v3.cmdline, o->cmdline, sizeof(img.hdr.v3.cmdline));
+        }
+        img.hdr.v3.kernel_size = segs[SEG_KERNEL].size;
+        img.hdr.v3.ramdisk_size = segs[SEG_RAMDISK].size;
+        os_version = img.hdr.v3.os_version;
+        hdr_sz = sizeof(img.hdr.v3);
+    } else {
+        if(o->set & OPT_CMDLINE) {
+            bootimg_set_header_cmdline(hdr, o->cmdline);
+        }
+        if(o->set & OPT_BOARD) {
+            memset(hdr->name, 0, sizeof(hdr->name));
+            strcpy((char *)hdr->name, o->board);
+        }
+        /* addresses are recomputed as a fresh build with these options
+         * would, defaults included */
+        if(o->set & OPT_ADDRESSES) {
+            hdr->kernel_addr =  o->base + o->kernel_offset;
+            hdr->ramdisk_addr = o->base + o->ramdisk_offset;
+            hdr->second_addr =  o->base + o->second_offset;
+            hdr->tags_addr =    o->base + o->tags_offset;
+            if(img.version > 1) {
+                hdr->dtb_addr = o->base + o->dtb_offset;
+            }
+        }
+        hdr->kernel_size = segs[SEG_KERNEL].size;
+        hdr->ramdisk_size = segs[SEG_RAMDISK].size;
+        hdr->second_size = segs[SEG_SECOND].size;
+        if(img.version == 0 && segs[SEG_DT].fd >= 0) {
+            hdr->dt_size = segs[SEG_DT].size;
+        }
+        if(img.version > 0) {
+            hdr->recovery_dtbo_size = segs[SEG_RECOVERY_DTBO].size;
+        }
+        if(img.version > 1) {
+            hdr->dtb_size = segs[SEG_DTB].size;
+        }
+        os_version = hdr->os_version;
+        hdr_sz = img.version == 0 ? sizeof(boot_img_hdr_v0) :
+                 img.version == 1 ? sizeof(boot_img_hdr_v1) : sizeof(boot_img_hdr_v2);
+    }
+
+    if(o->set & OPT_OS_VERSION) {
+        os_version = (o->os_version << 11) | (os_version & 0x7ff);
+    }
+    if(o->set & OPT_OS_PATCH_LEVEL) {
+        os_version = (os_version & ~0x7ffU) | o->os_patch_level;
+    }
+    if(img.version == 3) {
+        img.hdr.v3.os_version = os_version;
+    } else {
+        hdr->os_version = os_version;
+    }
+
+    image_sz = plan_layout(segs, SEG_COUNT, img.pagesize, 0, NULL, 0);
+    if(img.version > 0 && img.version < 3 && segs[SEG_RECOVERY_DTBO].fd >= 0) {
+        hdr->recovery_dtbo_offset = segs[SEG_RECOVERY_DTBO].offset;
+    }
+
+    /* v3 headers carry no id; for the others, hash exactly what a fresh
+     * build of the result would */
+    ret = 0;
+    if(replaced && img.version < 3) {
+        bool has_dt = segs[SEG_DT].fd >= 0;
+
+        for(i = 0; i < SEG_COUNT; i++) {
+            segs[i].hashed = bootimg_segment_hashed(i, img.version, has_dt);
+        }
+
+        alg = o->set & OPT_HASHTYPE ? o->hash_alg : image_hash_alg(hdr);
+        if(o->id_cache) {
+            ret = resume_kernel_id(o->id_cache, &segs[SEG_KERNEL], src[SEG_KERNEL],
+                                   alg, &ctx);
+        } else if((ret = init_id(alg, &ctx)) == 0) {
+            ret = hash_mapped(&segs[SEG_KERNEL], src[SEG_KERNEL],
+                              segs[SEG_KERNEL].size, &ctx);
+            bootimg_id_add_size(&ctx, segs[SEG_KERNEL].size);
+        }
+        after_kernel = ctx;
+        for(i = SEG_KERNEL + 1; i < SEG_COUNT && ret == 0; i++) {
+            if(!segs[i].hashed) continue;
+            if(segs[i].fd >= 0) {
+                ret = hash_mapped(&segs[i], src[i], segs[i].size, &ctx);
+            }
+            bootimg_id_add_size(&ctx, segs[i].size);
+        }
+        if(ret == -2) {
+            for(i = 0; i < SEG_COUNT && !segs[i].failed; i++)
+                ;
+            snprintf(res->error, sizeof(res->error), "could not read %s '%s': %s",
+                     segs[i].name, segs[i].fn,
+                     segs[i].error ? strerror(segs[i].error) : "unexpected end of file");
+            goto out;
+        }
+        if(ret) {
+            snprintf(res->error, sizeof(res->error), "could not compute the id");
+            goto out;
+        }
+        finish_id(&ctx, hdr);
+    }
+
+    if(!in_place) {
+        ret = rebuild_image(o->update, &img, segs, src, &img.hdr, hdr_sz, image_sz,
+                            res->error, sizeof(res->error));
+        if(ret) goto out;
+    } else {
+        /* zeros go over the old tail of each replaced segment's last page */
+        for(i = 0; i < SEG_COUNT && ret == 0; i++) {
+            if(inputs[i] && segs[i].fd >= 0) {
+                ret = write_segment_at(img.fd, &segs[i], 0, img.pagesize, false);
+            }
+        }
+        if(ret == 0 && pwrite(img.fd, &img.hdr, hdr_sz, 0) != (ssize_t) hdr_sz) {
+            ret = -1;
+        }
+        if(ret) {
+            snprintf(res->error, sizeof(res->error), "failed writing '%s': %s",
+                     o->update, strerror(errno));
+            goto out;
+        }
+    }
+
+    /* the image's kernel is now where the next update will find it */
+    if(o->id_cache && replaced && img.version < 3) {
+        struct segment kernel = segs[SEG_KERNEL];
+        int fd = open(o->update, O_RDONLY);
+
+        if(fd >= 0) {
+            kernel.fd = fd;
+            id_cache_store(o->id_cache, &kernel, kernel.offset, alg, &after_kernel);
+            close(fd);
+        }
+    }
+
+    memset(res->id, 0, sizeof(res->id));
+    if(img.version < 3) {
+        memcpy(res->id, hdr->id, sizeof(hdr->id));
+    }
+    ret = 0;
+
+out:
+    for(i = 0; i < SEG_COUNT; i++) {
+        if(inputs[i] && segs[i].fd >= 0) close(segs[i].fd);
+    }
+    if(close(img.fd) && ret == 0) {
+        snprintf(res->error, sizeof(res->error), "failed writing '%s': %s",
+                 o->update, strerror(errno));
+        ret = 1;
+    }
+    return ret ? 1 : 0;
+}
+
+/* Write the header. Seekable outputs get it at offset, the start of the
+ * image, over the reserved header page; a stream gets it at its current
+ * position followed by the padding. */
+static int write_header(int fd, boot_img_hdr_v2 *hdr, int header_version,
+                        const char *cmdline, unsigned pagesize, uint64_t offset,
+                        bool stream)
+{
+    uint8_t data[sizeof(boot_img_hdr_v2)];
+    size_t size = bootimg_format_header(hdr, header_version, cmdline, data);
+
+    if(!stream) {
+        return pwrite(fd, data, size, offset) == (ssize_t) size ? 0 : -1;
+    }
+    if(write(fd, data, size) != (ssize_t) size) return -1;
+    return write_padding(fd, pagesize, size, false);
+}
+
+/* --diff-write: every page is compared with what the output already holds
+ * there and only those that differ are written, which saves time and
+ * flash wear when reflashing a device or refreshing an image file that
+ * mostly stayed the same. */
+struct diff_writer {
+    int fd;
+    unsigned pagesize;
+    uint8_t *old;       /* COPY_CHUNK_SIZE of the output */
+    uint64_t written;
+};
+
+/* Write len bytes at off, both page aligned and len at most
+ * COPY_CHUNK_SIZE, leaving alone the pages that already match. Past the
+ * end of the output everything differs. */
+static int diff_write(struct diff_writer *w, const uint8_t *data, size_t len,
+                      uint64_t off)
+{
+    const size_t pagesize = w->pagesize;
+    ssize_t have = pread(w->fd, w->old, len, off);
+    size_t pos = 0;
+
+    if(have < 0) return -1;
+
+    while(pos < len) {
+        size_t start;
+
+        while(pos < len && pos + pagesize <= (size_t)have &&
+              !memcmp(data + pos, w->old + pos, pagesize)) {
+            pos += pagesize;
+        }
+        start = pos;
+        while(pos < len && (pos + pagesize > (size_t)have ||
+              memcmp(data + pos, w->old + pos, pagesize))) {
+            pos += pagesize;
+        }
+        while(start < pos) {
+            ssize_t count = pwrite(w->fd, data + start, pos - start, off + start);
+
+            if(count < 0 && errno == EINTR) continue;
+            if(count <= 0) return -1;
+            w->written += count;
+            start += count;
+        }
+    }
+    return 0;
+}
+
+/* A chunk of diff_segments() being gathered, and where it goes. */
+struct diff_chunk {
+    struct diff_writer *w;
+    uint8_t *buf;       /* COPY_CHUNK_SIZE */
+    uint32_t used;
+    uint64_t out;
+    HASH_CTX *ctx;      /* for diff_emit(), NULL if the segment is not hashed */
+};
+
+/* Write the chunk out once it is full. */
+static int diff_flush(struct diff_chunk *c)
+{
+    if(c->used < COPY_CHUNK_SIZE) return 0;
+    if(diff_write(c->w, c->buf, c->used, c->out)) return -1;
+    c->out += c->used;
+    c->used = 0;
+    return 0;
+}
+
+static int diff_emit(void *arg, const void *buf, size_t len)
+{
+    struct diff_chunk *c = arg;
+    const uint8_t *data = buf;
+
+    if(c->ctx) {
+        HASH_update(c->ctx, data, len);
+    }
+    while(len > 0) {
+        size_t count = COPY_CHUNK_SIZE - c->used;
+
+        if(count > len) count = len;
+        memcpy(c->buf + c->used, data, count);
+        c->used += count;
+        data += count;
+        len -= count;
+        if(diff_flush(c)) return -1;
+    }
+    return 0;
+}
+
+/* Same contract as write_segments(), through diff_write(). Each segment
+ * is gathered into chunks that are a whole number of pages from its start,
+ * across the files of a multi-file segment, the last chunk padded out with
+ * zeros. */
+static int diff_segments(struct diff_writer *w, struct segment *segs,
+                         unsigned nsegs, HASH_CTX *ctx)
+{
+    const uint32_t pagemask = w->pagesize - 1;
+    struct diff_chunk c = { w, NULL, 0, segs[0].offset, NULL };
+    unsigned i;
+    int ret = 0;
+
+    c.buf = malloc(COPY_CHUNK_SIZE);
+    if(c.buf == 0) {
+        return -1;
+    }
+
+    for(i = 0; i < nsegs && ret == 0; i++) {
+        struct segment *seg = &segs[i];
+        uint32_t pos = 0;
+
+        if(seg->source) {
+            c.ctx = seg->hashed ? ctx : NULL;
+            ret = produce_segment(seg, diff_emit, &c);
+        } else if(seg->fd < 0) {
+            hash_segment_size(ctx, seg);
+            continue;
+        }
+        while(ret == 0 && pos < seg->size && seg->fd >= 0) {
+            uint32_t left = seg->size - pos;
+            uint32_t count = COPY_CHUNK_SIZE - c.used;
+            ssize_t n;
+
+            if(count > left) count = left;
+            n = pread(seg->fd, c.buf + c.used, count, pos);
+            if(n != count) {
+                ret = read_error(seg, n);
+                break;
+            }
+            if(seg->hashed) {
+                HASH_update(ctx, c.buf + c.used, count);
+            }
+            c.used += count;
+            pos += count;
+            ret = diff_flush(&c);
+        }
+        /* the segments follow one another, so the next starts where
+         * this one's padding ends */
+        if(ret == 0 && !seg->more && c.used > 0) {
+            uint32_t padded = (c.used + pagemask) & ~pagemask;
+
+            memset(c.buf + c.used, 0, padded - c.used);
+            if(diff_write(w, c.buf, padded, c.out)) {
+                ret = -1;
+            }
+            c.out += padded;
+            c.used = 0;
+        }
+        if(ret == 0) {
+            hash_segment_size(ctx, seg);
+        }
+    }
+
+    free(c.buf);
+    return ret;
+}
+
+/* The header page, at offset, through diff_write(). */
+static int diff_header(struct diff_writer *w, boot_img_hdr_v2 *hdr,
+                       int header_version, const char *cmdline, uint64_t offset)
+{
+    uint8_t *page = calloc(1, w->pagesize);
+    int ret;
+
+    if(page == NULL) return -1;
+    bootimg_format_header(hdr, header_version, cmdline, page);
+    ret = diff_write(w, page, w->pagesize, offset);
+    free(page);
+    return ret;
+}
+
+static bool ramdisk_made(const struct segment *segs, unsigned nsegs)
+{
+    unsigned i;
+
+    for(i = 0; i < nsegs; i++) {
+        if(segs[i].source) return true;
+    }
+    return false;
+}
+
+/* Build the image described by o, which must have passed check_opts().
+ * Inputs come from the cache if one is given and are opened, prefetched
+ * and closed here otherwise. Returns 0 with the id in res, or 1 with a
+ * message in res->error; a partial output file is removed. */
+int build_image(const struct build_opts *o, struct input_cache *inputs,
+                struct build_result *res)
+{
+    boot_img_hdr_v2 hdr;
+
+    static const char *const names[SEG_COUNT] = {
+        "kernel", "ramdisk", "secondstage", "dt", "recovery dtbo", "dtb",
+    };
+    const char *files[SEG_COUNT] = {
+        [SEG_KERNEL] = o->kernel_fn,
+        [SEG_RAMDISK] = o->ramdisk_fn,
+        [SEG_SECOND] = o->second_fn,
+        [SEG_DT] = o->header_version == 0 ? o->dt_fn : NULL,
+        [SEG_RECOVERY_DTBO] = o->header_version > 0 ? o->recovery_dtbo_fn : NULL,
+        [SEG_DTB] = o->header_version > 1 ? o->dtb_fn : NULL,
+    };
+    char *lists[SEG_COUNT] = { NULL, };
+    uint32_t sizes[SEG_COUNT] = { 0, };
+    unsigned first[SEG_COUNT + 1];  /* each segment's first part in segs */
+    struct segment ramdisk_parts[SEG_MAX_PARTS];   /* when compressed */
+    struct ramdisk_source source;
+    int header_version = o->header_version;
+    uint32_t pagesize = o->pagesize;
+    const struct bootimg_params params = {
+        header_version, pagesize,
+        { o->base, o->kernel_offset, o->ramdisk_offset, o->second_offset,
+          o->tags_offset, o->dtb_offset },
+        (o->os_version << 11) | o->os_patch_level, o->board, o->cmdline,
+    };
+    int fd = -1;
+    bool has_dt;
+
+    enum io_method io_method = o->io_method;
+    struct segment segs[SEG_MAX_PARTS];
+    struct segment *kernel = &segs[0];
+    unsigned nsegs = 0;
+    uint64_t image_sz;
+    HASH_CTX ctx;
+    struct stat st;
+    bool sparse = false;
+    bool stream = false;
+    struct diff_writer diff = { -1, 0, NULL, 0 };
+    const uint64_t start = o->output_offset;
+    struct stats_timer t;
+    int ret = 1;
+    unsigned i, j;
+
+    memset(segs, 0, sizeof(segs));
+    memset(&source, 0, sizeof(source));
+    res->error[0] = '\0';
+    res->written = 0;
+
+    bootimg_init_header(&hdr, &params);
+
+#define OPEN_INPUT(fn, sz) \
+    (inputs ? input_cache_open(inputs, fn, sz) : open_file(fn, sz))
+
+    /* every segment takes at least one part, an absent one with no fd */
+    for(i = 0; i < SEG_COUNT; i++) {
+        bool pack = i == SEG_RAMDISK && o->ramdisk_dir;
+        char *parts[SEG_MAX_PARTS];
+        unsigned n = 0;
+
+        first[i] = nsegs;
+        if(files[i]) {
+            lists[i] = strdup(files[i]);
+            n = lists[i] ? split_files(lists[i], parts,
+                                       SEG_MAX_PARTS - nsegs - (SEG_COUNT - 1 - i) - pack) : 0;
+            if(n == 0) {
+                snprintf(res->error, sizeof(res->error),
+                         "invalid %s file list '%s'", names[i], files[i]);
+                goto out;
+            }
+        }
+        if(n == 0 && !pack) {
+            segs[nsegs++] = (struct segment) { names[i], NULL, -1, 0 };
+            continue;
+        }
+        for(j = 0; j < n; j++) {
+            struct segment *seg = &segs[nsegs++];
+
+            *seg = (struct segment) { names[i], parts[j], -1, 0 };
+            seg->head = sizes[i];
+            seg->more = j + 1 < n || pack;
+            t = stats_begin("open inputs");
+            seg->fd = OPEN_INPUT(parts[j], &seg->size);
+            stats_end(&t, 0);
+            if(seg->fd < 0) {
+                snprintf(res->error, sizeof(res->error),
+                         "could not load %s '%s'", names[i], parts[j]);
+                goto out;
+            }
+            if(seg->size > UINT32_MAX - sizes[i]) {
+                snprintf(res->error, sizeof(res->error),
+                         "could not load %s '%s': too large", names[i], parts[j]);
+                goto out;
+            }
+            sizes[i] += seg->size;
+        }
+        /* the packed tree goes last, so --ramdisk can carry a base ramdisk
+         * that it overlays */
+        if(pack) {
+            struct segment *seg = &segs[nsegs++];
+            uint64_t size;
+            char msg[200];
+
+            *seg = (struct segment) { names[i], o->ramdisk_dir, -1, 0 };
+            seg->head = sizes[i];
+            /* only scanned here, and packed as it is written */
+            t = stats_begin("pack ramdisk");
+            source.archive = cpio_open_dir(o->ramdisk_dir, o->ramdisk_mtime, 0,
+                                           &size, msg, sizeof(msg));
+            stats_end(&t, 0);
+            if(source.archive == NULL) {
+                snprintf(res->error, sizeof(res->error),
+                         "could not pack ramdisk '%s': %s", o->ramdisk_dir, msg);
+                goto out;
+            }
+            if(size > UINT32_MAX - sizes[i]) {
+                snprintf(res->error, sizeof(res->error),
+                         "could not pack ramdisk '%s': too large", o->ramdisk_dir);
+                goto out;
+            }
+            seg->source = &source;
+            seg->size = size;
+            sizes[i] += seg->size;
+        }
+        /* the compressed stream stands in for every part, made as it is
+         * written; its size is 0 until then and laid out again after */
+        if(i == SEG_RAMDISK && o->ramdisk_compress != COMPRESS_NONE && sizes[i] > 0) {
+            struct segment *seg;
+
+            source.method = o->ramdisk_compress;
+            source.level = o->compress_level;
+            source.threads = o->compress_threads;
+            source.nparts = nsegs - first[i];
+            source.parts = ramdisk_parts;
+            memcpy(ramdisk_parts, &segs[first[i]], source.nparts * sizeof(*segs));
+            nsegs = first[i];
+            seg = &segs[nsegs++];
+            *seg = (struct segment) { names[i], files[i] ? files[i] : o->ramdisk_dir,
+                                      -1, &source };
+            sizes[i] = 0;
+        }
+        /* only the kernel, ramdisk and second stage may be empty */
+        if(i >= SEG_DT && sizes[i] == 0) {
+            snprintf(res->error, sizeof(res->error),
+                     "could not load %s '%s'", names[i], files[i]);
+            goto out;
+        }
+    }
+    first[SEG_COUNT] = nsegs;
+#undef OPEN_INPUT
+
+    has_dt = segs[first[SEG_DT]].fd >= 0;
+    for(i = 0; i < SEG_COUNT; i++) {
+        for(j = first[i]; j < first[i + 1]; j++) {
+            segs[j].hashed = bootimg_segment_hashed(i, header_version, has_dt);
+        }
+    }
+
+    pagesize = bootimg_layout_pagesize(header_version, pagesize);
+    image_sz = plan_layout(segs, nsegs, pagesize, start, &hdr, header_version);
+
+    /* a partition is only so big, and that is known before reading a byte,
+     * bar a compressed ramdisk, which is checked again once it is made */
+    if(o->output_limit && image_sz > o->output_limit) {
+        snprintf(res->error, sizeof(res->error),
+                 "image of %llu bytes exceeds the output limit of %llu bytes",
+                 (unsigned long long)image_sz, (unsigned long long)o->output_limit);
+        goto out;
+    }
+
+    /* put a hash of the contents in the header so boot images can be
+     * differentiated based on their first 2k */
+    if(init_id(o->hash_alg, &ctx)) {
+        snprintf(res->error, sizeof(res->error), "could not initialise the id hash");
+        goto out;
+    }
+
+    /* shared inputs are prefetched once, by the cache */
+    if(inputs == NULL) {
+        start_prefetch(segs, nsegs);
+        start_prefetch(ramdisk_parts, source.nparts);
+    }
+
+    /* resume the id after the kernel where it has been hashed before;
+     * shared inputs are likely to be built with again, so hash the
+     * kernel up front to make that possible. Only a kernel from a single
+     * file has a hash state of its own. */
+    if(kernel->more) {
+        /* hashed along with the rest */
+    } else if(inputs && input_cache_load_id(inputs, kernel->fd, o->hash_alg, &ctx) == 0) {
+        kernel->hashed = false;
+    } else if(o->id_cache || inputs) {
+        /* not ret, which has to stay 1 for the failures below */
+        int err;
+
+        t = stats_begin("id");
+        if(o->id_cache) {
+            err = resume_kernel_id(o->id_cache, kernel, 0, o->hash_alg, &ctx);
+        } else {
+            err = hash_mapped(kernel, 0, kernel->size, &ctx);
+            if(err == 0) bootimg_id_add_size(&ctx, kernel->size);
+        }
+        stats_end(&t, kernel->size);
+        if(err == -2) goto unreadable;
+        if(err) {
+            snprintf(res->error, sizeof(res->error), "could not hash kernel '%s'",
+                     o->kernel_fn);
+            goto out;
+        }
+        if(inputs) input_cache_store_id(inputs, kernel->fd, o->hash_alg, &ctx);
+        kernel->hashed = false;
+    }
+
+    /* the archive of --ramdisk-dir and a compressed ramdisk are made as
+     * they are written, in order, which only the sequential writers do */
+    if(ramdisk_made(segs, nsegs) && io_method != IO_RW && io_method != IO_ZEROCOPY) {
+        if(o->io_set || o->direct_io) {
+            fprintf(stderr,"warning: a packed or compressed ramdisk is written "
+                    "with --io zerocopy\n");
+        }
+        io_method = IO_ZEROCOPY;
+    }
+
+    t = stats_begin("open output");
+    if(!strcmp(o->output, "-")) {
+        fd = dup(o->stdout_fd);
+    } else if(o->diff_write || o->output_offset_set) {
+        /* what is already there is the point, or has to be kept */
+        fd = open(o->output, (o->output_offset_set ? 0 : O_CREAT) |
+                  (o->diff_write ? O_RDWR : O_WRONLY) |
+                  (io_method == IO_DIRECT ? O_DIRECT : 0), 0644);
+        if(fd < 0 && errno == EINVAL && io_method == IO_DIRECT) {
+            fprintf(stderr,"warning: '%s' does not support O_DIRECT, "
+                    "writing through the page cache\n", o->output);
+            fd = open(o->output, O_WRONLY);
+        }
+    } else if(io_method == IO_DIRECT) {
+        fd = open(o->output, O_CREAT | O_TRUNC | O_WRONLY | O_DIRECT, 0644);
+        if(fd < 0 && errno == EINVAL) {
+            fprintf(stderr,"warning: '%s' does not support O_DIRECT, "
+                    "writing through the page cache\n", o->output);
+            fd = open(o->output, O_CREAT | O_TRUNC | O_WRONLY, 0644);
+        }
+    } else {
+        fd = open(o->output, O_CREAT | O_TRUNC | O_WRONLY, 0644);
+    }
+    stats_end(&t, 0);
+    if(fd < 0) {
+        snprintf(res->error, sizeof(res->error), "could not %s '%s'",
+                 o->output_offset_set ? "open" : "create", o->output);
+        goto out;
+    }
+
+    /* padding can be left as holes in a regular file, but block devices
+     * and the like need real zeros written over whatever was there */
+    if(fstat(fd, &st)) goto fail;
+    /* holes would leave whatever was around the image in place */
+    sparse = S_ISREG(st.st_mode) && !o->output_offset_set;
+
+    /* a pipe or socket has to start with the header, so the id comes
+     * from a hash-only pass over the inputs and everything is then
+     * written out in order */
+    if(lseek(fd, 0, SEEK_CUR) < 0 && errno == ESPIPE) {
+        if(o->diff_write || o->output_offset_set) {
+            snprintf(res->error, sizeof(res->error), "%s needs a seekable output",
+                     o->diff_write ? "--diff-write" : "--output-offset");
+            goto cleanup;
+        }
+        stream = true;
+        if(io_method != IO_RW && io_method != IO_ZEROCOPY) {
+            if(o->io_set || o->direct_io) {
+                fprintf(stderr,"warning: '%s' is not seekable, writing it with "
+                        "--io zerocopy\n", o->output);
+            }
+            io_method = IO_ZEROCOPY;
+        }
+        for(i = 0; i < nsegs; i++) {
+            if(!segs[i].hashed) continue;
+            t = stats_begin("id");
+            if(segs[i].source) {
+                ret = produce_segment(&segs[i], hash_emit, &ctx);
+            } else {
+                ret = segs[i].fd >= 0 && hash_mapped(&segs[i], 0, segs[i].size, &ctx);
+            }
+            stats_end(&t, segs[i].size);
+            if(ret) goto unreadable;
+            hash_segment_size(&ctx, &segs[i]);
+            segs[i].hashed = false;
+        }
+        if(source.method != COMPRESS_NONE) {
+            image_sz = plan_layout(segs, nsegs, pagesize, start, &hdr, header_version);
+            if(o->output_limit && image_sz > o->output_limit) goto too_large;
+        }
+        finish_id(&ctx, &hdr);
+        t = stats_begin("header");
+        ret = write_header(fd, &hdr, header_version, o->cmdline, pagesize, 0, true);
+        stats_end(&t, pagesize);
+        if(ret) goto fail;
+    }
+
+    /* reserve the header page; the header itself is written last, once
+     * the id is known */
+    if(!stream && start && lseek(fd, start, SEEK_SET) != (off_t) start) goto fail;
+    if(stream) {
+        /* already written */
+    } else if(o->diff_write) {
+        /* compared last, like any other page */
+        diff.fd = fd;
+        diff.pagesize = pagesize;
+        diff.old = malloc(COPY_CHUNK_SIZE);
+        if(diff.old == NULL) goto fail;
+    } else if(io_method == IO_DIRECT) {
+        /* staged along with the segments */
+    } else if(sparse) {
+        if(lseek(fd, pagesize, SEEK_SET) != pagesize) goto fail;
+    } else {
+        if(write(fd, padding, pagesize) != (ssize_t) pagesize) goto fail;
+    }
+
+    if(!o->diff_write && (io_method == IO_RW || io_method == IO_ZEROCOPY)) {
+        t.phase = -1;   /* these time each segment themselves */
+    } else {
+        t = stats_begin(o->diff_write ? "diff-write" : "write");
+    }
+    if(o->diff_write) {
+        ret = diff_segments(&diff, segs, nsegs, &ctx);
+    } else if(io_method == IO_PIPELINE) {
+        ret = pipeline_segments(fd, segs, nsegs, pagesize, sparse, &ctx);
+    } else if(io_method == IO_PARALLEL) {
+        ret = parallel_segments(fd, segs, nsegs, pagesize, sparse, &ctx);
+    } else if(io_method == IO_DIRECT) {
+        ret = direct_segments(fd, segs, nsegs, pagesize, &ctx);
+    } else if(io_method == IO_URING) {
+        ret = uring_segments(fd, segs, nsegs, pagesize, sparse, &ctx);
+        if(ret == 1) {
+            /* io_uring unavailable, nothing written yet */
+            io_method = IO_RW;
+            ret = write_segments(fd, segs, nsegs, pagesize, sparse, &ctx,
+                                 io_method, false);
+        }
+    } else {
+        ret = write_segments(fd, segs, nsegs, pagesize, sparse, &ctx,
+                             io_method, o->reflink && !stream);
+    }
+    if(ret == 0 && !stream && source.method != COMPRESS_NONE) {
+        image_sz = plan_layout(segs, nsegs, pagesize, start, &hdr, header_version);
+    }
+    stats_end(&t, image_sz - start - pagesize);
+    if(ret == -2) goto unreadable;
+    if(ret) goto fail;
+    if(o->output_limit && image_sz > o->output_limit) goto too_large;
+
+    if(sparse && ftruncate(fd, image_sz)) goto fail;
+
+    t = stats_begin("header");
+    if(o->diff_write) {
+        finish_id(&ctx, &hdr);
+        ret = diff_header(&diff, &hdr, header_version, o->cmdline, start);
+    } else if(!stream) {
+        finish_id(&ctx, &hdr);
+        ret = write_header(fd, &hdr, header_version, o->cmdline, pagesize, start, false);
+    }
+    stats_end(&t, stream ? 0 : pagesize);
+    if(ret) goto fail;
+
+    t = stats_begin("close");
+    ret = close(fd);
+    stats_end(&t, 0);
+    fd = -1;
+    if(ret) goto fail;
+
+    memcpy(res->id, hdr.id, sizeof(res->id));
+    res->size = image_sz;
+    res->written = diff.written;
+    goto out;
+
+unreadable:
+    for(i = 0; i < nsegs && !segs[i].failed; i++)
+        ;
+    if(i < nsegs && segs[i].source) {
+        snprintf(res->error, sizeof(res->error), "%s", segs[i].source->msg);
+    } else if(i < nsegs) {
+        snprintf(res->error, sizeof(res->error), "could not read %s '%s': %s",
+                 segs[i].name, segs[i].fn,
+                 segs[i].error ? strerror(segs[i].error) : "unexpected end of file");
+    }
+    goto cleanup;
+too_large:
+    snprintf(res->error, sizeof(res->error),
+             "image of %llu bytes exceeds the output limit of %llu bytes",
+             (unsigned long long)image_sz, (unsigned long long)o->output_limit);
+    goto cleanup;
+fail:
+    snprintf(res->error, sizeof(res->error), "failed writing '%s': %s",
+             o->output, strerror(errno));
+cleanup:
+    /* only a regular file is ours to remove; never unlink a device node,
+     * nor an existing image that --diff-write was updating */
+    if(sparse && strcmp(o->output, "-") && !o->diff_write) {
+        unlink(o->output);
+    }
+    ret = 1;
+out:
+    if(fd >= 0) close(fd);
+    free(diff.old);
+    if(inputs == NULL) {
+        finish_prefetch(segs, nsegs);
+        finish_prefetch(ramdisk_parts, source.nparts);
+    }
+    for(i = 0; i < nsegs + source.nparts; i++) {
+        int in = i < nsegs ? segs[i].fd : ramdisk_parts[i - nsegs].fd;
+
+        if(in < 0) continue;
+        if(inputs) {
+            input_cache_close(inputs, in);
+        } else {
+            close(in);
+        }
+    }
+    cpio_close(source.archive);
+    for(i = 0; i < SEG_COUNT; i++) {
+        free(lists[i]);
+    }
+    return ret;
+}
+
+int main(int argc, char **argv)
+{
+    struct build_opts opts;
+    struct build_result res;
+    char err[256];
+    int ret;
+
+    argc--;
+    argv++;
+
+    default_opts(&opts);
+    if(parse_opts(argc, argv, &opts, err, sizeof(err))) {
+        if(err[0] == '\0') {
+            return usage();
+        }
+        fprintf(stderr,"error: %s\n", err);
+        return -1;
+    }
+
+    if(opts.batch || opts.serve) {
+        long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+
+        if(opts.jobs == 0) {
+            opts.jobs = ncpu > 0 ? ncpu : 1;
+        }
+        if(opts.batch && opts.serve) {
+            fprintf(stderr,"error: --batch cannot be combined with --serve\n");
+            return 1;
+        }
+        if(opts.serve) {
+            if(opts.stats) {
+                fprintf(stderr,"error: --stats cannot be combined with --serve\n");
+                return 1;
+            }
+            return run_server(&opts, opts.serve, opts.jobs);
+        }
+        /* the whole batch, with the builds' phases added together */
+        if(opts.stats) stats_start(opts.stats);
+        ret = run_batch(&opts, opts.batch, opts.jobs);
+        stats_report("mkbootimg");
+        return ret;
+    }
+
+    ret = check_opts(&opts, err, sizeof(err));
+    if(ret) {
+        fprintf(stderr,"error: %s\n", err);
+        return ret > 0 ? usage() : 1;
+    }
+
+    if(opts.stats) stats_start(opts.stats);
+    if(opts.update) {
+        struct stats_timer t = stats_begin("update");
+
+        ret = update_image(&opts, &res);
+        stats_end(&t, 0);
+    } else if(opts.cache) {
+        ret = cached_build_image(&opts, NULL, &res);
+    } else {
+        ret = build_image(&opts, NULL, &res);
+    }
+    stats_report("mkbootimg");
+    if(ret) {
+        fprintf(stderr,"error: %s\n", res.error);
+        return 1;
+    }
+
+    if(opts.get_id) {
+        /* keep an image written to stdout intact */
+        print_id(opts.output && !strcmp(opts.output, "-") ? stderr : stdout,
+                 res.id, sizeof(res.id));
+    }
+    if(opts.diff_write) {
+        fprintf(stderr, "%s: rewrote %llu of %llu bytes\n", opts.output,
+                (unsigned long long)res.written, (unsigned long long)res.size);
+    }
+    return 0;
 }
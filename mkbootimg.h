@@ -0,0 +1,186 @@
+/*
+ * Copyright (C) 2007 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "mincrypt/sha.h"
+#include "compress.h"
+#include "stats.h"
+
+/* What mkbootimg.c shares with the modes built on top of it, --cache
+ * (cache.c), --batch (batch.c) and --serve (server.c): the options one
+ * image is built from, the builders that take them and the few file
+ * helpers those modes need too. */
+
+enum hash_alg {
+    HASH_UNKNOWN = -1,
+    HASH_SHA1 = 0,
+    HASH_SHA256,
+};
+
+struct hash_name {
+    const char *name;
+    enum hash_alg alg;
+};
+
+extern const struct hash_name hash_names[];
+
+enum io_method {
+    IO_UNKNOWN = -1,
+    IO_RW = 0,
+    IO_ZEROCOPY,
+    IO_PIPELINE,
+    IO_PARALLEL,
+    IO_URING,
+    IO_DIRECT,
+};
+
+#define SEG_MAX_PARTS 64    /* files in one image, across all segments */
+
+/* Which kinds of option were given, for modes that change only what was
+ * asked for. */
+enum opt_flag {
+    OPT_CMDLINE = 1 << 0,
+    OPT_BOARD = 1 << 1,
+    OPT_OS_VERSION = 1 << 2,
+    OPT_OS_PATCH_LEVEL = 1 << 3,
+    OPT_ADDRESSES = 1 << 4,     /* --base or any --*_offset */
+    OPT_INPUTS = 1 << 5,        /* --kernel, --ramdisk and the like */
+    OPT_FORMAT = 1 << 6,        /* --pagesize, --header_version */
+    OPT_HASHTYPE = 1 << 7,
+    OPT_WRITE = 1 << 8,         /* --io, --direct-io, --reflink, --diff-write,
+                                 * --output-offset */
+};
+
+/* Everything one image is built from. The command line fills one of
+ * these; in batch mode each manifest line is parsed on top of a copy of
+ * the command line's. */
+struct build_opts {
+    char *output;
+    int stdout_fd;          /* what an output of "-" writes to */
+    char *kernel_fn;
+    char *ramdisk_fn;
+    char *ramdisk_dir;      /* packed as cpio after any --ramdisk files */
+    uint64_t ramdisk_mtime; /* of every entry packed, SOURCE_DATE_EPOCH or 0 */
+    enum compress_method ramdisk_compress;
+    int compress_level;     /* -1 for the method's default */
+    unsigned compress_threads;  /* 0 for one per CPU */
+    char *second_fn;
+    char *dt_fn;
+    char *dtb_fn;
+    char *recovery_dtbo_fn;
+    char *cmdline;
+    char *board;
+    uint32_t base;
+    uint32_t kernel_offset;
+    uint32_t ramdisk_offset;
+    uint32_t second_offset;
+    uint32_t tags_offset;
+    uint64_t dtb_offset;
+    uint32_t pagesize;
+    int os_version;
+    int os_patch_level;
+    int header_version;
+    enum hash_alg hash_alg;
+    enum io_method io_method;
+    bool io_set;
+    bool direct_io;
+    bool reflink;
+    bool diff_write;
+    enum stats_format stats;
+    bool get_id;
+    char *id_cache;
+    char *cache;
+    uint64_t cache_size;
+    uint64_t output_offset;     /* into an existing file, not truncated */
+    bool output_offset_set;
+    uint64_t output_limit;      /* 0 for none */
+    char *update;
+    char *serve;
+    char *batch;
+    unsigned jobs;
+    unsigned set;           /* enum opt_flag */
+};
+
+struct input;
+
+/* Inputs shared between the images of a batch or a server, see
+ * mkbootimg.c. */
+struct input_cache {
+    pthread_mutex_t lock;
+    struct input **inputs;
+    unsigned count;
+    unsigned alloc;
+    uint64_t bytes;
+    uint64_t limit;         /* 0 for no limit */
+    uint64_t clock;
+};
+
+struct build_result {
+    uint8_t id[32];
+    uint64_t size;          /* of the image */
+    uint64_t written;       /* bytes rewritten by --diff-write */
+    char error[256];
+};
+
+/* An existing image, as described by its header. The segments carry the
+ * sizes and offsets the header implies, and the image's own fd for those
+ * that are present. */
+
+/* Open fn for reading and return its fd, with its size in *_sz, or -1 if
+ * it cannot be opened or is 4 GiB or more. */
+int open_file(const char *fn, unsigned *_sz);
+
+/* Split a comma separated list of files in place into at most max names.
+ * Returns how many there are, or 0 if there are more or one is empty. */
+unsigned split_files(char *list, char **files, unsigned max);
+
+/* Add the first size bytes of the file open at fd, called fn, to ctx.
+ * Returns 0, or -1 if it could not be read. */
+int hash_file(int fd, const char *fn, uint32_t size, HASH_CTX *ctx);
+
+const char *compress_method_name(enum compress_method method);
+
+/* Parse arguments into o, on top of whatever it already holds. Returns 0,
+ * or -1 with a message in err; an empty message means the arguments were
+ * malformed and usage should be shown. Nothing is checked for
+ * completeness here, see check_opts(). */
+int parse_opts(int argc, char **argv, struct build_opts *o,
+               char *err, size_t errlen);
+
+/* Check that o describes an image that can be built, resolving
+ * --direct-io into the io method. Returns 0, or with a message in err
+ * 1 if usage should follow it and -1 if not. */
+int check_opts(struct build_opts *o, char *err, size_t errlen);
+
+/* limit is in bytes of open inputs, 0 for none. */
+void input_cache_init(struct input_cache *c, uint64_t limit);
+void input_cache_destroy(struct input_cache *c);
+
+/* Build the image o describes, which must have passed check_opts(), taking
+ * inputs from the cache if one is given. Returns 0, or 1 with a message in
+ * res->error. */
+int build_image(const struct build_opts *o, struct input_cache *inputs,
+                struct build_result *res);
+
+/* Change the existing image o->update in place as far as possible; see
+ * the comment at its definition. Returns like build_image(). */
+int update_image(const struct build_opts *o, struct build_result *res);
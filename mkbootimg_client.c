@@ -0,0 +1,96 @@
+/*
+ * Copyright (C) 2007 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <limits.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "serve.h"
+
+/* Forwards a mkbootimg command line to a running mkbootimg --serve and
+ * reports its result as if mkbootimg itself had run. */
+
+int usage(void)
+{
+    fprintf(stderr,"usage: mkbootimg-client [ --socket <path> ] <mkbootimg arguments>\n"
+            "       the socket defaults to $MKBOOTIMG_SOCKET\n");
+    return 1;
+}
+
+int main(int argc, char **argv)
+{
+    struct sockaddr_un addr;
+    const char *sock = getenv("MKBOOTIMG_SOCKET");
+    char cwd[PATH_MAX];
+    char **reply;
+    uint32_t status, count;
+    int fd;
+
+    argc--;
+    argv++;
+
+    if(argc >= 2 && !strcmp(argv[0], "--socket")) {
+        sock = argv[1];
+        argc -= 2;
+        argv += 2;
+    }
+    if(sock == NULL || argc == 0) {
+        return usage();
+    }
+    if(strlen(sock) >= sizeof(addr.sun_path)) {
+        fprintf(stderr,"error: socket path too long\n");
+        return 1;
+    }
+    if(getcwd(cwd, sizeof(cwd)) == NULL) {
+        fprintf(stderr,"error: could not get the working directory: %s\n",
+                strerror(errno));
+        return 1;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, sock);
+
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(fd < 0 || connect(fd, (struct sockaddr *)&addr, sizeof(addr))) {
+        fprintf(stderr,"error: could not connect to '%s': %s\n", sock, strerror(errno));
+        return 1;
+    }
+
+    /* the working directory goes first, in the slot argv[-1] had */
+    argv[-1] = cwd;
+    if(serve_send(fd, SERVE_MAGIC, argv - 1, argc + 1) ||
+       serve_send_fd(fd, STDOUT_FILENO)) {
+        fprintf(stderr,"error: could not send request: %s\n", strerror(errno));
+        return 1;
+    }
+
+    reply = serve_recv(fd, &status, &count);
+    if(reply == NULL || count != 2) {
+        fprintf(stderr,"error: no reply from '%s'\n", sock);
+        return 1;
+    }
+    fputs(reply[0], stdout);
+    fputs(reply[1], stderr);
+    free(reply);
+    close(fd);
+    return status;
+}
@@ -0,0 +1,189 @@
+/*
+ * Copyright (C) 2007 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/socket.h>
+
+#include "serve.h"
+
+static int write_full(int fd, const void *buf, size_t len)
+{
+    const char *p = buf;
+
+    while(len > 0) {
+        ssize_t n = write(fd, p, len);
+
+        if(n < 0 && errno == EINTR) continue;
+        if(n <= 0) return -1;
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static int read_full(int fd, void *buf, size_t len)
+{
+    char *p = buf;
+
+    while(len > 0) {
+        ssize_t n = read(fd, p, len);
+
+        if(n < 0 && errno == EINTR) continue;
+        if(n == 0) errno = EPIPE;
+        if(n <= 0) return -1;
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+int serve_send(int fd, uint32_t head, char *const *strs, uint32_t count)
+{
+    uint32_t i;
+
+    if(write_full(fd, &head, sizeof(head)) ||
+       write_full(fd, &count, sizeof(count))) {
+        return -1;
+    }
+    for(i = 0; i < count; i++) {
+        uint32_t len = strlen(strs[i]);
+
+        if(write_full(fd, &len, sizeof(len)) || write_full(fd, strs[i], len)) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+char **serve_recv(int fd, uint32_t *head, uint32_t *count)
+{
+    uint32_t lens[SERVE_MAX_STRINGS];
+    size_t total = 0;
+    char **strs;
+    char *p;
+    uint32_t i;
+
+    if(read_full(fd, head, sizeof(*head)) ||
+       read_full(fd, count, sizeof(*count))) {
+        return NULL;
+    }
+    if(*count > SERVE_MAX_STRINGS) {
+        errno = EMSGSIZE;
+        return NULL;
+    }
+
+    /* lengths are interleaved with the data, so grow as they come */
+    strs = malloc((*count + 1) * sizeof(char *));
+    if(strs == NULL) return NULL;
+    for(i = 0; i < *count; i++) {
+        char **grown;
+
+        if(read_full(fd, &lens[i], sizeof(lens[i]))) goto fail;
+        if(lens[i] > SERVE_MAX_LENGTH) {
+            errno = EMSGSIZE;
+            goto fail;
+        }
+        grown = realloc(strs, (*count + 1) * sizeof(char *) + total + lens[i] + 1);
+        if(grown == NULL) goto fail;
+        strs = grown;
+        p = (char *)(strs + *count + 1) + total;
+        if(read_full(fd, p, lens[i])) goto fail;
+        p[lens[i]] = '\0';
+        total += lens[i] + 1;
+    }
+
+    /* only now is the block where it will stay */
+    p = (char *)(strs + *count + 1);
+    for(i = 0; i < *count; i++) {
+        strs[i] = p;
+        p += lens[i] + 1;
+    }
+    strs[*count] = NULL;
+    return strs;
+
+fail:
+    free(strs);
+    return NULL;
+}
+
+int serve_send_fd(int sock, int fd)
+{
+    char byte = 0;
+    struct iovec iov = { &byte, 1 };
+    union {
+        struct cmsghdr hdr;
+        char buf[CMSG_SPACE(sizeof(int))];
+    } control;
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+
+    memset(&msg, 0, sizeof(msg));
+    memset(&control, 0, sizeof(control));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+
+    for(;;) {
+        ssize_t n = sendmsg(sock, &msg, 0);
+
+        if(n < 0 && errno == EINTR) continue;
+        return n == 1 ? 0 : -1;
+    }
+}
+
+int serve_recv_fd(int sock)
+{
+    char byte;
+    struct iovec iov = { &byte, 1 };
+    union {
+        struct cmsghdr hdr;
+        char buf[CMSG_SPACE(sizeof(int))];
+    } control;
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+    ssize_t n;
+    int fd;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+
+    do {
+        n = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+    } while(n < 0 && errno == EINTR);
+    if(n == 0) errno = EPIPE;
+    if(n <= 0) return -1;
+
+    cmsg = CMSG_FIRSTHDR(&msg);
+    if(cmsg == NULL || cmsg->cmsg_level != SOL_SOCKET ||
+       cmsg->cmsg_type != SCM_RIGHTS || cmsg->cmsg_len != CMSG_LEN(sizeof(int))) {
+        errno = EBADMSG;
+        return -1;
+    }
+    memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+    return fd;
+}
@@ -0,0 +1,50 @@
+/*
+ * Copyright (C) 2007 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+/* The protocol between mkbootimg --serve and mkbootimg-client, over a
+ * Unix stream socket, one request per connection. Both messages are a
+ * header word followed by a count of strings, each a length and that
+ * many bytes, all in host byte order.
+ *
+ * request:  SERVE_MAGIC, then the client's working directory followed
+ *           by the mkbootimg arguments, then the client's stdout passed
+ *           with serve_send_fd(), which "-o -" writes to
+ * response: the exit status, then what the command would have written
+ *           to stdout and to stderr
+ */
+#define SERVE_MAGIC 0x4d4b4249 /* "MKBI" */
+#define SERVE_MAX_STRINGS 1024
+#define SERVE_MAX_LENGTH (1024 * 1024)
+
+/* Send head and count strings. Returns 0, or -1 with errno set. */
+int serve_send(int fd, uint32_t head, char *const *strs, uint32_t count);
+
+/* Receive a message. The strings are NUL terminated and returned in one
+ * allocation to be released with free(). Returns NULL on a short or
+ * oversized message, with errno set. */
+char **serve_recv(int fd, uint32_t *head, uint32_t *count);
+
+/* Pass the descriptor fd along with a single byte. Returns 0, or -1 with
+ * errno set. */
+int serve_send_fd(int sock, int fd);
+
+/* Receive a descriptor sent with serve_send_fd(), close-on-exec. Returns
+ * it, or -1 with errno set. */
+int serve_recv_fd(int sock);
@@ -0,0 +1,258 @@
+/*
+ * Copyright (C) 2007 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+
+#include "mkbootimg.h"
+#include "cache.h"
+#include "serve.h"
+#include "server.h"
+
+/* The input cache of a server keeps about this much open and warm. */
+#define SERVE_INPUT_CACHE_SIZE (1ULL << 30)
+
+struct server {
+    const struct build_opts *defaults;
+    struct input_cache inputs;
+    int fd;
+};
+
+static const char *serve_socket;
+
+static void serve_exit(int sig)
+{
+    unlink(serve_socket);
+    _exit(128 + sig);
+}
+
+/* p made absolute against cwd, or each of its files if it is a comma
+ * separated list; "-" for stdout stays as it is. Returns a new string,
+ * or NULL if out of memory. */
+static char *serve_path(const char *cwd, const char *p, bool list)
+{
+    size_t parts = 1;
+    const char *q;
+    char *abs, *dst;
+
+    if(!strcmp(p, "-")) return strdup(p);
+    for(q = p; list && (q = strchr(q, ',')); q++) {
+        parts++;
+    }
+    abs = malloc(strlen(p) + parts * (strlen(cwd) + 1) + 1);
+    if(abs == NULL) return NULL;
+
+    dst = abs;
+    for(;;) {
+        size_t n = list ? strcspn(p, ",") : strlen(p);
+
+        if(p[0] != '/') dst += sprintf(dst, "%s/", cwd);
+        memcpy(dst, p, n);
+        dst += n;
+        p += n;
+        if(*p != ',') break;
+        *dst++ = *p++;
+    }
+    *dst = '\0';
+    return abs;
+}
+
+/* Run one request as the command line would, leaving what it would have
+ * printed in out and err. Paths are relative to the client's cwd, and
+ * an output of "-" is the client's stdout, passed as stdout_fd. */
+static int serve_request(struct server *srv, char **strs, uint32_t count,
+                         int stdout_fd, char *out, size_t outlen,
+                         char *err, size_t errlen)
+{
+    struct build_opts opts = *srv->defaults;
+    struct build_result res;
+    char *owned[11] = { NULL, };
+    char **paths[11] = {
+        &opts.output, &opts.kernel_fn, &opts.ramdisk_fn, &opts.second_fn,
+        &opts.dt_fn, &opts.dtb_fn, &opts.recovery_dtbo_fn, &opts.id_cache,
+        &opts.cache, &opts.update, &opts.ramdisk_dir,
+    };
+    const char *cwd = strs[0];
+    char msg[256];
+    unsigned i;
+    int ret = 1;
+
+    out[0] = '\0';
+    err[0] = '\0';
+    opts.output = NULL;
+    opts.stdout_fd = stdout_fd;
+    opts.set = 0;
+    opts.serve = NULL;
+
+    if(parse_opts(count - 1, strs + 1, &opts, msg, sizeof(msg))) {
+        snprintf(err, errlen, "error: %s\n", msg[0] ? msg : "malformed arguments");
+        return 1;
+    }
+    if(opts.batch || opts.serve || opts.stats) {
+        snprintf(err, errlen, "error: --batch, --serve and --stats cannot be forwarded\n");
+        return 1;
+    }
+
+    for(i = 0; i < 11; i++) {
+        char *p = *paths[i];
+
+        if(p == NULL) continue;
+        /* the inputs may be lists of files */
+        owned[i] = serve_path(cwd, p, i >= 1 && i <= 6);
+        if(owned[i] == NULL) {
+            snprintf(err, errlen, "error: out of memory\n");
+            goto out;
+        }
+        *paths[i] = owned[i];
+    }
+
+    if(check_opts(&opts, msg, sizeof(msg))) {
+        snprintf(err, errlen, "error: %s\n", msg);
+        goto out;
+    }
+
+    if(opts.update) {
+        ret = update_image(&opts, &res);
+    } else if(opts.cache) {
+        ret = cached_build_image(&opts, &srv->inputs, &res);
+    } else {
+        ret = build_image(&opts, &srv->inputs, &res);
+    }
+    if(ret) {
+        snprintf(err, errlen, "error: %s\n", res.error);
+    } else if(opts.get_id) {
+        /* keep an image written to stdout intact */
+        char *id = opts.output && !strcmp(opts.output, "-") ? err : out;
+        size_t idlen = id == err ? errlen : outlen;
+        size_t len = snprintf(id, idlen, "0x");
+
+        for(i = 0; i < sizeof(res.id) && len < idlen; i++) {
+            len += snprintf(id + len, idlen - len, "%02x", res.id[i]);
+        }
+        if(len < idlen) {
+            snprintf(id + len, idlen - len, "\n");
+        }
+    }
+
+out:
+    for(i = 0; i < 11; i++) {
+        free(owned[i]);
+    }
+    return ret;
+}
+
+static void *serve_worker(void *arg)
+{
+    struct server *srv = arg;
+
+    for(;;) {
+        char out[128], err[512];
+        char *reply[2] = { out, err };
+        uint32_t magic, count;
+        char **strs;
+        int status;
+        int fd, stdout_fd;
+
+        fd = accept(srv->fd, NULL, NULL);
+        if(fd < 0) {
+            if(errno == EINTR || errno == ECONNABORTED) continue;
+            fprintf(stderr,"error: accept failed: %s\n", strerror(errno));
+            return NULL;
+        }
+
+        strs = serve_recv(fd, &magic, &count);
+        if(strs == NULL || magic != SERVE_MAGIC || count < 1 ||
+           (stdout_fd = serve_recv_fd(fd)) < 0) {
+            free(strs);
+            close(fd);
+            continue;
+        }
+        status = serve_request(srv, strs, count, stdout_fd, out, sizeof(out),
+                               err, sizeof(err));
+        free(strs);
+        close(stdout_fd);
+
+        serve_send(fd, status, reply, 2);
+        close(fd);
+    }
+    return NULL;
+}
+
+int run_server(const struct build_opts *defaults, const char *path,
+               unsigned jobs)
+{
+    struct sockaddr_un addr;
+    struct server srv;
+    struct stat st;
+    bool bound = false;
+    unsigned i;
+
+    if(strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr,"error: socket path too long\n");
+        return 1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+
+    /* a socket left behind by a server that was killed */
+    if(lstat(path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+        unlink(path);
+    }
+
+    srv.defaults = defaults;
+    srv.fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(srv.fd >= 0) {
+        /* only the owner may connect, from the moment the socket exists;
+         * no other thread is running yet to see the umask */
+        mode_t mask = umask(0177);
+
+        bound = bind(srv.fd, (struct sockaddr *)&addr, sizeof(addr)) == 0;
+        umask(mask);
+    }
+    if(!bound || listen(srv.fd, 128)) {
+        fprintf(stderr,"error: could not listen on '%s': %s\n", path, strerror(errno));
+        return 1;
+    }
+
+    serve_socket = path;
+    signal(SIGINT, serve_exit);
+    signal(SIGTERM, serve_exit);
+    signal(SIGPIPE, SIG_IGN);
+
+    input_cache_init(&srv.inputs, SERVE_INPUT_CACHE_SIZE);
+
+    for(i = 1; i < jobs; i++) {
+        pthread_t thread;
+
+        if(pthread_create(&thread, NULL, serve_worker, &srv) == 0) {
+            pthread_detach(thread);
+        }
+    }
+    serve_worker(&srv);
+
+    unlink(path);
+    return 1;
+}
@@ -0,0 +1,29 @@
+/*
+ * Copyright (C) 2007 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#pragma once
+
+#include "mkbootimg.h"
+
+/* Listen on a Unix socket and build what mkbootimg-client sends, on a
+ * pool of jobs threads, each accepting connections of its own. The
+ * options given along with --serve are the defaults of every request,
+ * as with --batch. Inputs stay open and prefetched between requests in
+ * a bounded cache, together with the id state after each kernel. Runs
+ * until killed, removing the socket on SIGINT or SIGTERM. */
+int run_server(const struct build_opts *defaults, const char *path,
+               unsigned jobs);
@@ -0,0 +1,277 @@
+/*
+ * Copyright (C) 2007 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+
+#include "stats.h"
+
+#define STATS_MAX_PHASES 64
+#define STATS_NAME_SIZE 48
+
+struct phase {
+    char name[STATS_NAME_SIZE];
+    uint64_t count;
+    uint64_t wall_ns;
+    uint64_t cpu_ns;
+    uint64_t bytes;
+};
+
+/* /proc/self/io, by the names it uses */
+struct proc_io {
+    uint64_t rchar;
+    uint64_t wchar;
+    uint64_t syscr;
+    uint64_t syscw;
+    uint64_t read_bytes;
+    uint64_t write_bytes;
+};
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static enum stats_format format;
+static uint64_t start_ns;
+static struct phase phases[STATS_MAX_PHASES];
+static unsigned nphases;
+
+static const struct {
+    const char *name;
+    enum stats_format format;
+} format_names[] = {
+    { "text", STATS_TEXT },
+    { "json", STATS_JSON },
+    { NULL, /* Sentinel */ },
+};
+
+enum stats_format stats_parse_format(const char *name)
+{
+    unsigned i;
+
+    for(i = 0; format_names[i].name; i++) {
+        if(!strcmp(format_names[i].name, name))
+            return format_names[i].format;
+    }
+    return STATS_OFF;
+}
+
+static uint64_t clock_ns(clockid_t clock)
+{
+    struct timespec ts;
+
+    clock_gettime(clock, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static uint64_t timeval_ns(const struct timeval *tv)
+{
+    return (uint64_t)tv->tv_sec * 1000000000ULL + tv->tv_usec * 1000ULL;
+}
+
+void stats_start(enum stats_format f)
+{
+    start_ns = clock_ns(CLOCK_MONOTONIC);
+    __atomic_store_n(&format, f, __ATOMIC_RELEASE);
+}
+
+/* The slot for name, added if new; called with the lock held. */
+static int find_phase(const char *name)
+{
+    unsigned i;
+
+    for(i = 0; i < nphases; i++) {
+        if(!strncmp(phases[i].name, name, STATS_NAME_SIZE - 1))
+            return i;
+    }
+    if(nphases == STATS_MAX_PHASES) return -1;
+    snprintf(phases[nphases].name, STATS_NAME_SIZE, "%s", name);
+    return nphases++;
+}
+
+struct stats_timer stats_begin(const char *phase)
+{
+    struct stats_timer t = { -1, 0, 0 };
+
+    if(__atomic_load_n(&format, __ATOMIC_ACQUIRE) == STATS_OFF) return t;
+    pthread_mutex_lock(&lock);
+    t.phase = find_phase(phase);
+    pthread_mutex_unlock(&lock);
+    t.wall_ns = clock_ns(CLOCK_MONOTONIC);
+    t.cpu_ns = clock_ns(CLOCK_PROCESS_CPUTIME_ID);
+    return t;
+}
+
+void stats_end(struct stats_timer *t, uint64_t bytes)
+{
+    uint64_t wall, cpu;
+
+    if(t->phase < 0) return;
+    wall = clock_ns(CLOCK_MONOTONIC) - t->wall_ns;
+    cpu = clock_ns(CLOCK_PROCESS_CPUTIME_ID) - t->cpu_ns;
+    pthread_mutex_lock(&lock);
+    phases[t->phase].count++;
+    phases[t->phase].wall_ns += wall;
+    phases[t->phase].cpu_ns += cpu;
+    phases[t->phase].bytes += bytes;
+    pthread_mutex_unlock(&lock);
+    t->phase = -1;
+}
+
+void stats_add(const char *phase, uint64_t wall_ns, uint64_t bytes)
+{
+    int i;
+
+    if(__atomic_load_n(&format, __ATOMIC_ACQUIRE) == STATS_OFF) return;
+    pthread_mutex_lock(&lock);
+    i = find_phase(phase);
+    if(i >= 0) {
+        phases[i].count++;
+        phases[i].wall_ns += wall_ns;
+        phases[i].bytes += bytes;
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+static bool read_proc_io(struct proc_io *io)
+{
+    FILE *f = fopen("/proc/self/io", "r");
+    char key[32];
+    unsigned long long val;
+    unsigned found = 0;
+
+    if(f == NULL) return false;
+    memset(io, 0, sizeof(*io));
+    while(fscanf(f, "%31[^:]: %llu\n", key, &val) == 2) {
+        uint64_t *field = !strcmp(key, "rchar") ? &io->rchar :
+                          !strcmp(key, "wchar") ? &io->wchar :
+                          !strcmp(key, "syscr") ? &io->syscr :
+                          !strcmp(key, "syscw") ? &io->syscw :
+                          !strcmp(key, "read_bytes") ? &io->read_bytes :
+                          !strcmp(key, "write_bytes") ? &io->write_bytes : NULL;
+
+        if(field) {
+            *field = val;
+            found++;
+        }
+    }
+    fclose(f);
+    return found == 6;
+}
+
+static void print_text(const char *tool, uint64_t wall, const struct rusage *ru,
+                       const struct proc_io *io)
+{
+    unsigned i;
+
+    fprintf(stderr, "%s: %-24s %8s %10s %10s %14s\n",
+            tool, "phase", "count", "wall", "cpu", "bytes");
+    for(i = 0; i < nphases; i++) {
+        const struct phase *p = &phases[i];
+
+        fprintf(stderr, "%s: %-24s %8llu %9.3fs %9.3fs %14llu\n", tool, p->name,
+                (unsigned long long)p->count, p->wall_ns / 1e9, p->cpu_ns / 1e9,
+                (unsigned long long)p->bytes);
+    }
+    fprintf(stderr, "%s: wall %.3fs user %.3fs sys %.3fs peak rss %ld KiB\n", tool,
+            wall / 1e9, timeval_ns(&ru->ru_utime) / 1e9,
+            timeval_ns(&ru->ru_stime) / 1e9, ru->ru_maxrss);
+    if(io) {
+        fprintf(stderr, "%s: read %llu bytes in %llu syscalls, wrote %llu bytes "
+                "in %llu syscalls, storage read %llu wrote %llu bytes\n", tool,
+                (unsigned long long)io->rchar, (unsigned long long)io->syscr,
+                (unsigned long long)io->wchar, (unsigned long long)io->syscw,
+                (unsigned long long)io->read_bytes,
+                (unsigned long long)io->write_bytes);
+    }
+}
+
+/* Phase names are ours, but keep the output valid whatever they hold. */
+static void print_json_name(const char *s)
+{
+    fputc('"', stderr);
+    for(; *s; s++) {
+        unsigned char c = *s;
+
+        if(c == '"' || c == '\\') {
+            fprintf(stderr, "\\%c", c);
+        } else if(c < 0x20) {
+            fprintf(stderr, "\\u%04x", c);
+        } else {
+            fputc(c, stderr);
+        }
+    }
+    fputc('"', stderr);
+}
+
+static void print_json(const char *tool, uint64_t wall, const struct rusage *ru,
+                       const struct proc_io *io)
+{
+    unsigned i;
+
+    fprintf(stderr, "{\"tool\":");
+    print_json_name(tool);
+    fprintf(stderr, ",\"wall_ns\":%llu,\"user_ns\":%llu,\"sys_ns\":%llu,"
+            "\"peak_rss_kb\":%ld", (unsigned long long)wall,
+            (unsigned long long)timeval_ns(&ru->ru_utime),
+            (unsigned long long)timeval_ns(&ru->ru_stime), ru->ru_maxrss);
+    if(io) {
+        fprintf(stderr, ",\"io\":{\"rchar\":%llu,\"wchar\":%llu,\"syscr\":%llu,"
+                "\"syscw\":%llu,\"read_bytes\":%llu,\"write_bytes\":%llu}",
+                (unsigned long long)io->rchar, (unsigned long long)io->wchar,
+                (unsigned long long)io->syscr, (unsigned long long)io->syscw,
+                (unsigned long long)io->read_bytes,
+                (unsigned long long)io->write_bytes);
+    } else {
+        fprintf(stderr, ",\"io\":null");
+    }
+    fprintf(stderr, ",\"phases\":[");
+    for(i = 0; i < nphases; i++) {
+        const struct phase *p = &phases[i];
+
+        fprintf(stderr, "%s{\"name\":", i ? "," : "");
+        print_json_name(p->name);
+        fprintf(stderr, ",\"count\":%llu,\"wall_ns\":%llu,\"cpu_ns\":%llu,"
+                "\"bytes\":%llu}", (unsigned long long)p->count,
+                (unsigned long long)p->wall_ns, (unsigned long long)p->cpu_ns,
+                (unsigned long long)p->bytes);
+    }
+    fprintf(stderr, "]}\n");
+}
+
+void stats_report(const char *tool)
+{
+    uint64_t wall;
+    struct rusage ru;
+    struct proc_io io;
+    bool have_io;
+
+    if(format == STATS_OFF) return;
+    wall = clock_ns(CLOCK_MONOTONIC) - start_ns;
+    getrusage(RUSAGE_SELF, &ru);
+    have_io = read_proc_io(&io);
+
+    pthread_mutex_lock(&lock);
+    if(format == STATS_JSON) {
+        print_json(tool, wall, &ru, have_io ? &io : NULL);
+    } else {
+        print_text(tool, wall, &ru, have_io ? &io : NULL);
+    }
+    pthread_mutex_unlock(&lock);
+}
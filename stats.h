@@ -0,0 +1,55 @@
+/*
+ * Copyright (C) 2007 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+/* Where a run's time goes, for --stats. Phases are named; timing one
+ * that was seen before adds to it, so a phase entered once per input or
+ * per page of padding reports its count and totals. Wall time is the
+ * calling thread's, from stats_begin() to stats_end(), and CPU time the
+ * whole process's over the same span, so it covers any worker threads
+ * the phase starts. Phases that overlap, like padding inside a write or
+ * the concurrent builds of a batch, each count the shared time.
+ *
+ * The report adds the run's totals: wall time, user and system CPU time,
+ * peak RSS and, where /proc/self/io exists, bytes read and written and
+ * the read and write syscalls issued. All calls are cheap no-ops until
+ * stats_start(), and safe from any thread. */
+enum stats_format {
+    STATS_OFF = 0,
+    STATS_TEXT,
+    STATS_JSON,
+};
+
+struct stats_timer {
+    int phase;          /* -1 when stats are off */
+    uint64_t wall_ns;
+    uint64_t cpu_ns;
+};
+
+/* Parse the argument of --stats=<format>. */
+enum stats_format stats_parse_format(const char *name);
+
+void stats_start(enum stats_format format);
+struct stats_timer stats_begin(const char *phase);
+void stats_end(struct stats_timer *t, uint64_t bytes);
+/* Add time measured some other way, such as a pipeline stage's. */
+void stats_add(const char *phase, uint64_t wall_ns, uint64_t bytes);
+
+/* Print the report to stderr, as text or one line of JSON. */
+void stats_report(const char *tool);
@@ -13,6 +13,7 @@
 #include "mincrypt/sha.h"
 #include "mincrypt/sha256.h"
 #include "bootimg.h"
+#include "stats.h"
 
 typedef unsigned char byte;
 
@@ -21,6 +22,7 @@ int read_padding(FILE *f, unsigned itemsize, int pagesize)
     byte *buf = (byte *)malloc(sizeof(byte) * pagesize);
     unsigned pagemask = pagesize - 1;
     unsigned count;
+    struct stats_timer t;
 
     if((itemsize & pagemask) == 0) {
         free(buf);
@@ -29,17 +31,43 @@ int read_padding(FILE *f, unsigned itemsize, int pagesize)
 
     count = pagesize - (itemsize & pagemask);
 
+    t = stats_begin("padding");
     if(fread(buf, count, 1, f)){};
+    stats_end(&t, count);
     free(buf);
     return count;
 }
 
 void write_string_to_file(const char *file, const char *string)
 {
+    struct stats_timer t = stats_begin("write metadata");
     FILE *f = fopen(file, "w");
     fwrite(string, strlen(string), 1, f);
     fwrite("\n", 1, 1, f);
     fclose(f);
+    stats_end(&t, strlen(string) + 1);
+}
+
+/* Copy the next size bytes of f to a new file, timing the read and the
+ * write separately. */
+void extract_file(FILE *f, const char *file, unsigned size, const char *name)
+{
+    char phase[32];
+    struct stats_timer t;
+    byte *data = (byte *)malloc(size);
+
+    snprintf(phase, sizeof(phase), "read %s", name);
+    t = stats_begin(phase);
+    if(fread(data, size, 1, f)){};
+    stats_end(&t, size);
+
+    snprintf(phase, sizeof(phase), "write %s", name);
+    t = stats_begin(phase);
+    FILE *out = fopen(file, "wb");
+    fwrite(data, size, 1, out);
+    fclose(out);
+    stats_end(&t, size);
+    free(data);
 }
 
 const char *detect_hash_type(boot_img_hdr_v2 *hdr)
@@ -63,6 +91,7 @@ int usage()
     printf("\t-i|--input boot.img\n");
     printf("\t[ -o|--output output_directory]\n");
     printf("\t[ -p|--pagesize <size-in-hexadecimal> ]\n");
+    printf("\t[ --stats[=text|json] ]\n");
     return 0;
 }
 
@@ -137,27 +166,19 @@ int unpack_bootimg_v3(FILE *f, const char *directory, char *filename) {
 
     sprintf(tmp, "%s/%s", directory, basename(filename));
     strcat(tmp, "-zImage");
-    FILE *k = fopen(tmp, "wb");
-    byte *kernel = (byte *)malloc(header.kernel_size);
     //printf("Reading kernel...\n");
     fseek(f, header.header_size - sizeof(header), SEEK_CUR);
-    if(fread(kernel, header.kernel_size, 1, f)){};
+    extract_file(f, tmp, header.kernel_size, "kernel");
     //total_read += header.kernel_size;
-    fwrite(kernel, header.kernel_size, 1, k);
-    fclose(k);
 
     //printf("total read: %d\n", header.kernel_size);
     read_padding(f, header.kernel_size, 4096);
 
     sprintf(tmp, "%s/%s", directory, basename(filename));
     strcat(tmp, "-ramdisk.gz");
-    FILE *r = fopen(tmp, "wb");
-    byte *ramdisk = (byte *)malloc(header.ramdisk_size);
     //printf("Reading ramdisk...\n");
-    if(fread(ramdisk, header.ramdisk_size, 1, f)){};
+    extract_file(f, tmp, header.ramdisk_size, "ramdisk");
     //total_read += header.ramdisk_size;
-    fwrite(ramdisk, header.ramdisk_size, 1, r);
-    fclose(r);
 
     fclose(f);
 
@@ -172,6 +193,8 @@ int main(int argc, char **argv)
     char *filename = NULL;
     int pagesize = 0;
     int base = 0;
+    enum stats_format stats = STATS_OFF;
+    struct stats_timer t;
 
     int seeklimit = 65536; // arbitrary byte limit to search in input file for ANDROID! magic
     int hdr_ver_max = 4; // arbitrary maximum header version value; when greater assume the field is appended dtb size
@@ -181,6 +204,15 @@ int main(int argc, char **argv)
     while(argc > 0){
         char *arg = argv[0];
         char *val = argv[1];
+        if(!strcmp(arg, "--stats") || !strncmp(arg, "--stats=", 8)) {
+            stats = arg[7] ? stats_parse_format(arg + 8) : STATS_TEXT;
+            if(stats == STATS_OFF) {
+                return usage();
+            }
+            argc -= 1;
+            argv += 1;
+            continue;
+        }
         argc -= 2;
         argv += 2;
         if(!strcmp(arg, "--input") || !strcmp(arg, "-i")) {
@@ -208,7 +240,12 @@ int main(int argc, char **argv)
         return 1;
     }
 
+    if (stats) {
+        stats_start(stats);
+    }
+
     int total_read = 0;
+    t = stats_begin("open");
     FILE *f = fopen(filename, "rb");
     boot_img_hdr_v2 header;
 
@@ -232,17 +269,22 @@ int main(int argc, char **argv)
         return 1;
     }
     fseek(f, i, SEEK_SET);
+    stats_end(&t, 0);
     if (i > 0) {
         printf("Android magic found at: %d\n", i);
     }
 
+    t = stats_begin("header");
     if(fread(&header, sizeof(header), 1, f)){};
+    stats_end(&t, sizeof(header));
 
     printf("HEADER_VERSION %u\n", header.header_version);
 
     if (header.header_version == 3) {
         fseek(f, i, SEEK_SET);
-        return unpack_bootimg_v3(f, directory, filename);
+        int ret = unpack_bootimg_v3(f, directory, filename);
+        stats_report("unpackbootimg");
+        return ret;
     }
 
     base = header.kernel_addr - 0x00008000;
@@ -407,26 +449,18 @@ int main(int argc, char **argv)
 
     sprintf(tmp, "%s/%s", directory, basename(filename));
     strcat(tmp, "-zImage");
-    FILE *k = fopen(tmp, "wb");
-    byte *kernel = (byte *)malloc(header.kernel_size);
     //printf("Reading kernel...\n");
-    if(fread(kernel, header.kernel_size, 1, f)){};
+    extract_file(f, tmp, header.kernel_size, "kernel");
     total_read += header.kernel_size;
-    fwrite(kernel, header.kernel_size, 1, k);
-    fclose(k);
 
     //printf("total read: %d\n", header.kernel_size);
     total_read += read_padding(f, header.kernel_size, pagesize);
 
     sprintf(tmp, "%s/%s", directory, basename(filename));
     strcat(tmp, "-ramdisk.gz");
-    FILE *r = fopen(tmp, "wb");
-    byte *ramdisk = (byte *)malloc(header.ramdisk_size);
     //printf("Reading ramdisk...\n");
-    if(fread(ramdisk, header.ramdisk_size, 1, f)){};
+    extract_file(f, tmp, header.ramdisk_size, "ramdisk");
     total_read += header.ramdisk_size;
-    fwrite(ramdisk, header.ramdisk_size, 1, r);
-    fclose(r);
 
     //printf("total read: %d\n", header.ramdisk_size);
     total_read += read_padding(f, header.ramdisk_size, pagesize);
@@ -434,13 +468,9 @@ int main(int argc, char **argv)
     if (header.second_size != 0) {
         sprintf(tmp, "%s/%s", directory, basename(filename));
         strcat(tmp, "-second");
-        FILE *s = fopen(tmp, "wb");
-        byte *second = (byte *)malloc(header.second_size);
         //printf("Reading second...\n");
-        if(fread(second, header.second_size, 1, f)){};
+        extract_file(f, tmp, header.second_size, "second");
         total_read += header.second_size;
-        fwrite(second, header.second_size, 1, s);
-        fclose(s);
     }
 
     //printf("total read: %d\n", header.second_size);
@@ -449,24 +479,16 @@ int main(int argc, char **argv)
     if (header.dt_size > hdr_ver_max) {
         sprintf(tmp, "%s/%s", directory, basename(filename));
         strcat(tmp, "-dt");
-        FILE *d = fopen(tmp, "wb");
-        byte *dt = (byte *)malloc(header.dt_size);
         //printf("Reading dt...\n");
-        if(fread(dt, header.dt_size, 1, f)){};
+        extract_file(f, tmp, header.dt_size, "dt");
         total_read += header.dt_size;
-        fwrite(dt, header.dt_size, 1, d);
-        fclose(d);
     } else {
         if (header.recovery_dtbo_size != 0) {
             sprintf(tmp, "%s/%s", directory, basename(filename));
             strcat(tmp, "-recovery_dtbo");
-            FILE *o = fopen(tmp, "wb");
-            byte *dtbo = (byte *)malloc(header.recovery_dtbo_size);
             //printf("Reading recovery_dtbo...\n");
-            if(fread(dtbo, header.recovery_dtbo_size, 1, f)){};
+            extract_file(f, tmp, header.recovery_dtbo_size, "recovery_dtbo");
             total_read += header.recovery_dtbo_size;
-            fwrite(dtbo, header.recovery_dtbo_size, 1, o);
-            fclose(o);
         }
 
         //printf("total read: %d\n", header.recovery_dtbo_size);
@@ -475,19 +497,16 @@ int main(int argc, char **argv)
         if (header.dtb_size != 0) {
             sprintf(tmp, "%s/%s", directory, basename(filename));
             strcat(tmp, "-dtb");
-            FILE *b = fopen(tmp, "wb");
-            byte *dtb = (byte *)malloc(header.dtb_size);
             //printf("Reading dtb...\n");
-            if(fread(dtb, header.dtb_size, 1, f)){};
+            extract_file(f, tmp, header.dtb_size, "dtb");
             total_read += header.dtb_size;
-            fwrite(dtb, header.dtb_size, 1, b);
-            fclose(b);
         }
     }
 
     fclose(f);
 
     //printf("Total Read: %d\n", total_read);
+    stats_report("unpackbootimg");
     return 0;
 }
 